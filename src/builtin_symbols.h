@@ -18,6 +18,12 @@
 #define BUILTIN_SYM_INIT "init"
 #define BUILTIN_SYM_LET "let"
 #define BUILTIN_SYM_LAMBDA "\\"
+#define BUILTIN_SYM_QUASIQUOTE "quasiquote"
+
+// Quasiquote reader syntax, `{a ,b ,@c}, and the markers left in the template
+#define QUASI_QUOTE "`"
+#define QUASI_UNQUOTE ","
+#define QUASI_SPLICE ",@"
 
 // Comparison / sequencing
 #define BUILTIN_SYM_IF "if"
@@ -25,15 +31,62 @@
 #define BUILTIN_SYM_AND "and"
 #define BUILTIN_SYM_OR "or"
 #define BUILTIN_SYM_NOT "not"
+#define BUILTIN_SYM_MATCH "match"
 
 // Utilities
 #define BUILTIN_SYM_LOAD "load"
 #define BUILTIN_SYM_READ "read"
 #define BUILTIN_SYM_ENV "env"
+#define BUILTIN_SYM_ENV_HAS "env-has?"
+#define BUILTIN_SYM_ENV_GET "env-get"
+#define BUILTIN_SYM_ENV_KEYS "env-keys"
+#define BUILTIN_SYM_ENV_COUNT "env-count"
 #define BUILTIN_SYM_PRINT "print"
 #define BUILTIN_SYM_ERROR "error"
 #define BUILTIN_SYM_TRY "try"
 
+// Modules
+#define BUILTIN_SYM_REQUIRE "require"
+#define BUILTIN_SYM_PROVIDE "provide"
+
+// Caching
+#define BUILTIN_SYM_CACHED "cached"
+
+// Lazy evaluation
+#define BUILTIN_SYM_DELAY "delay"
+#define BUILTIN_SYM_FORCE "force"
+
+// Aggregation
+#define BUILTIN_SYM_GROUP_BY "group-by"
+#define BUILTIN_SYM_COUNT_BY "count-by"
+#define BUILTIN_SYM_SUM_BY "sum-by"
+#define BUILTIN_SYM_REDUCE_BY "reduce-by"
+
+// Sketches
+#define BUILTIN_SYM_SKETCH_HLL "hyperloglog"
+#define BUILTIN_SYM_SKETCH_TDIGEST "t-digest"
+#define BUILTIN_SYM_SKETCH_CMS "count-min"
+#define BUILTIN_SYM_SKETCH_ADD "sketch-add"
+#define BUILTIN_SYM_SKETCH_ADD_BANG "sketch-add!"
+#define BUILTIN_SYM_SKETCH_MERGE "sketch-merge"
+#define BUILTIN_SYM_SKETCH_COUNT "sketch-count"
+#define BUILTIN_SYM_SKETCH_QUANTILE "sketch-quantile"
+#define BUILTIN_SYM_SKETCH_FREQUENCY "sketch-frequency"
+#define BUILTIN_SYM_SKETCH_ENCODE "sketch-encode"
+#define BUILTIN_SYM_SKETCH_DECODE "sketch-decode"
+
+// Step-sliced evaluation
+#define BUILTIN_SYM_EVAL_STEPS "eval-steps"
+
+// Files
+#define BUILTIN_SYM_EXTERNAL_SORT "external-sort"
+
+// In-place mutation
+#define BUILTIN_SYM_SET "set!"
+#define BUILTIN_SYM_APPEND "append!"
+#define BUILTIN_SYM_SET_NTH "set-nth!"
+#define BUILTIN_SYM_REVERSE "reverse!"
+
 // Type checking
 #define BUILTIN_SYM_IS_STRING "string?"
 #define BUILTIN_SYM_IS_LONG "number?"
@@ -42,6 +95,10 @@
 #define BUILTIN_SYM_IS_QEXPR "q-expression?"
 #define BUILTIN_SYM_IS_SEXPR "s-expression?"
 
+// Foreign function interface
+#define BUILTIN_SYM_FFI_OPEN "ffi-open"
+#define BUILTIN_SYM_FFI_FN "ffi-fn"
+
 /*
  * Error checking macros.
  */
@@ -7,7 +7,7 @@
 #include "lilith_int.h"
 #include "builtin_symbols.h"
 
-char *lookup_load_file(const char *filename);
+char *lookup_load_path(const char *filename, struct stat *fn);
 static lval *builtin_eval(lenv* env, lval *args);
 
 #define LASSERT_NUM_ARGS(arg, expected, arg_symbol)       \
@@ -319,6 +319,144 @@ static lval *builtin_init(lenv *env, lval *args)
     return rv;
 }
 
+/**
+ * Checks for a marker left by the reader in a quasiquoted template.
+ */
+static bool is_quasi_marker(const lval *v, const char *marker)
+{
+    return v->type == LVAL_SYMBOL && !strcmp(v->value.str_val, marker);
+}
+
+/**
+ * Checks whether a list is a quasiquoted template nested in another, which the
+ * reader compiles to an s-expression. A q-expression starting with the symbol is
+ * just data.
+ */
+static bool is_quasi_nested(const lval *list)
+{
+    return list->type == LVAL_SEXPRESSION && LVAL_EXPR_CNT(list) &&
+        is_quasi_marker(list->value.list.head->data, BUILTIN_SYM_QUASIQUOTE);
+}
+
+/**
+ * Counts the markers in a quasiquoted template. Templates nested in it have their
+ * own values so are skipped.
+ */
+static size_t quasi_count(const lval *list)
+{
+    if (is_quasi_nested(list))
+    {
+        return 0;
+    }
+
+    size_t rv = 0;
+    for (pair *ptr = list->value.list.head; ptr; ptr = ptr->next)
+    {
+        if (is_quasi_marker(ptr->data, QUASI_UNQUOTE) || is_quasi_marker(ptr->data, QUASI_SPLICE))
+        {
+            rv++;
+        }
+        else if (ptr->data->type == LVAL_SEXPRESSION || ptr->data->type == LVAL_QEXPRESSION)
+        {
+            rv += quasi_count(ptr->data);
+        }
+    }
+
+    return rv;
+}
+
+/**
+ * Fills in the markers of a quasiquoted template, in place, with the values in
+ * order. Values are moved rather than copied and spliced lists relinked, so the
+ * only allocation is the template itself. Returns an error, or 0.
+ */
+static lval *quasi_fill(lval *list, lval *values)
+{
+    if (is_quasi_nested(list))
+    {
+        return 0;
+    }
+
+    for (pair **ptr = &list->value.list.head; *ptr; )
+    {
+        pair *node = *ptr;
+        if (is_quasi_marker(node->data, QUASI_UNQUOTE))
+        {
+            lval_del(node->data);
+            node->data = lval_pop(values);
+        }
+        else if (is_quasi_marker(node->data, QUASI_SPLICE))
+        {
+            lval *x = lval_pop(values);
+            if (x->type != LVAL_QEXPRESSION)
+            {
+                lval *err = lval_error("function '%s' type mismatch - expected %s, received %s",
+                    BUILTIN_SYM_QUASIQUOTE, ltype_name(LVAL_QEXPRESSION), ltype_name(x->type));
+                lval_del(x);
+                return err;
+            }
+
+            // Link the items of the list in place of the marker
+            pair **last = ptr;
+            *ptr = x->value.list.head;
+            while (*last)
+            {
+                last = &(*last)->next;
+            }
+
+            *last = node->next;
+            LVAL_EXPR_CNT(list) += LVAL_EXPR_CNT(x) - 1;
+            x->value.list.head = 0;
+            LVAL_EXPR_CNT(x) = 0;
+            lval_del(x);
+            lval_del(node->data);
+            free(node);
+            ptr = last;
+            continue;
+        }
+        else if (node->data->type == LVAL_SEXPRESSION || node->data->type == LVAL_QEXPRESSION)
+        {
+            lval *err = quasi_fill(node->data, values);
+            if (err)
+            {
+                return err;
+            }
+        }
+
+        ptr = &node->next;
+    }
+
+    return 0;
+}
+
+/**
+ * Built-in function to fill in a quasiquoted template. Written by the reader for
+ * `{...} as (quasiquote {template} values...), the values being the unquoted
+ * expressions in the order they appear in the template.
+ */
+static lval *builtin_quasiquote(lenv *env, lval *args)
+{
+    LASSERT_ENV(args, env, BUILTIN_SYM_QUASIQUOTE);
+    LASSERT_NO_ERROR(args);
+    LASSERT(args, LVAL_EXPR_CNT(args) > 0, "function '%s' expects at least one argument", BUILTIN_SYM_QUASIQUOTE);
+    LASSERT_TYPE_ARG(args, LVAL_EXPR_FIRST(args), LVAL_QEXPRESSION, BUILTIN_SYM_QUASIQUOTE);
+
+    size_t count = quasi_count(LVAL_EXPR_FIRST(args));
+    LASSERT(args, count == LVAL_EXPR_CNT(args) - 1, "function '%s' expects %zu values, received %zu",
+        BUILTIN_SYM_QUASIQUOTE, count, LVAL_EXPR_CNT(args) - 1);
+
+    lval *rv = lval_pop(args);
+    lval *err = quasi_fill(rv, args);
+    lval_del(args);
+    if (err)
+    {
+        lval_del(rv);
+        return err;
+    }
+
+    return rv;
+}
+
 /**
  * Built-in function to check the structure of a lambda
  * expression and read off the relevant arguments.
@@ -345,7 +483,16 @@ static lval *builtin_lambda(lenv *env, lval *args)
     lval *body = lval_pop(args);
     lval_del(args);
 
-    return lval_lambda(formals, body);
+    lval *rv = lval_lambda(formals, body);
+    lval *err = lfun_annotate(rv);
+    if (err)
+    {
+        lval_del(rv);
+        return err;
+    }
+
+    lfun_fold(env, rv);
+    return rv;
 }
 
 /**
@@ -383,6 +530,11 @@ static lval *builtin_if(lenv *env, lval *args)
     return rv;
 }
 
+bool lval_is_if(const lval *v)
+{
+    return v->type == LVAL_BUILTIN_FUN && v->value.builtin == builtin_if;
+}
+
 /**
  * Check two types for equality.
  */
@@ -529,37 +681,49 @@ static lval *builtin_load(lenv *env, lval *args)
     LASSERT_NUM_ARGS(args, 1, BUILTIN_SYM_LOAD);
 
     lval *rv = 0;
-    char *fn = lookup_load_file(LVAL_EXPR_FIRST(args)->value.str_val);
-    if (!fn)
+    struct stat fn;
+    char *path = 0;
+    lval *expr = 0;
+    const lval *bundled = bundle_get(LVAL_EXPR_FIRST(args)->value.str_val);
+    if (bundled)
+    {
+        expr = lval_copy((lval*)bundled);
+    }
+    else if ((path = lookup_load_path(LVAL_EXPR_FIRST(args)->value.str_val, &fn)))
+    {
+        expr = read_source_file(path, &fn);
+    }
+
+    if (!expr)
     {
         rv = lval_error("File not found %s", LVAL_EXPR_FIRST(args)->value.str_val);
     }
     else
     {
-        lval *expr = lilith_read_from_string(fn);
         rv = multi_eval(env, expr);
-        free(fn);
     }
 
+    free(path);
     lval_del(args);
     return rv;
 }
 
 /**
- * Built-in function to print an lval to the screen.
+ * Built-in function to print an lval to the environment's output.
  */
 static lval *builtin_print(lenv *env, lval *args)
 {
     LASSERT_ENV(args, env, BUILTIN_SYM_PRINT);
     LASSERT_NO_ERROR(args);
 
+    lout *out = lenv_out(env);
     for (pair *ptr = args->value.list.head; ptr; ptr = ptr->next)
     {
-        lval_print(ptr->data, 1);
-        putchar(' ');
+        lval_print(out, ptr->data, 1);
+        lout_putc(out, ' ');
     }
 
-    putchar('\n');
+    lout_putc(out, '\n');
     lval_del(args);
 
     return lval_sexpression();
@@ -609,6 +773,73 @@ static lval *builtin_env(lenv *env, lval *args)
     return lenv_to_lval(env);
 }
 
+/*
+ * Views of the environment. Each sees the bindings env returns, but without
+ * copying them all -- the names are listed on their own and values looked up
+ * one at a time.
+ */
+
+/**
+ * Built-in function to check whether a name is bound in the environment.
+ */
+static lval *builtin_env_has(lenv *env, lval *args)
+{
+    LASSERT_ENV(args, env, BUILTIN_SYM_ENV_HAS);
+    LASSERT_NO_ERROR(args);
+    LASSERT_NUM_ARGS(args, 1, BUILTIN_SYM_ENV_HAS);
+    LASSERT_TYPE_ARG(args, LVAL_EXPR_FIRST(args), LVAL_STRING, BUILTIN_SYM_ENV_HAS);
+
+    lval *rv = lval_bool(lenv_view_find(env, LVAL_EXPR_FIRST(args)->value.str_val) != 0);
+    lval_del(args);
+    return rv;
+}
+
+/**
+ * Built-in function to get the value a name is bound to in the environment.
+ */
+static lval *builtin_env_get(lenv *env, lval *args)
+{
+    LASSERT_ENV(args, env, BUILTIN_SYM_ENV_GET);
+    LASSERT_NO_ERROR(args);
+    LASSERT_NUM_ARGS(args, 1, BUILTIN_SYM_ENV_GET);
+    LASSERT_TYPE_ARG(args, LVAL_EXPR_FIRST(args), LVAL_STRING, BUILTIN_SYM_ENV_GET);
+
+    lval *v = lenv_view_find(env, LVAL_EXPR_FIRST(args)->value.str_val);
+    if (v)
+    {
+        lval_force(v);
+    }
+
+    LASSERT(args, v && v->type != LVAL_LAZY, "unbound symbol '%s'", LVAL_EXPR_FIRST(args)->value.str_val);
+
+    lval_del(args);
+    return lval_copy(v);
+}
+
+/**
+ * Built-in function to list the names bound in the environment.
+ */
+static lval *builtin_env_keys(lenv *env, lval *args)
+{
+    LASSERT_ENV(args, env, BUILTIN_SYM_ENV_KEYS);
+    LASSERT_NO_ERROR(args);
+
+    lval_del(args);
+    return lenv_keys(env);
+}
+
+/**
+ * Built-in function to count the names bound in the environment.
+ */
+static lval *builtin_env_count(lenv *env, lval *args)
+{
+    LASSERT_ENV(args, env, BUILTIN_SYM_ENV_COUNT);
+    LASSERT_NO_ERROR(args);
+
+    lval_del(args);
+    return lval_long(lenv_view_count(env));
+}
+
 /**
  * Built-in function to handle errors. If the first argument
  * is an error then eval the second expression.
@@ -708,6 +939,7 @@ void lenv_add_builtins_funcs(lenv *e)
     lenv_add_builtin(e, BUILTIN_SYM_LEN, builtin_len);
     lenv_add_builtin(e, BUILTIN_SYM_CONS, builtin_cons);
     lenv_add_builtin(e, BUILTIN_SYM_INIT, builtin_init);
+    lenv_add_builtin(e, BUILTIN_SYM_QUASIQUOTE, builtin_quasiquote);
     lenv_add_builtin(e, BUILTIN_SYM_LAMBDA, builtin_lambda);
     lenv_add_builtin(e, BUILTIN_SYM_IF, builtin_if);
     lenv_add_builtin(e, BUILTIN_SYM_EQ, builtin_eq);
@@ -719,6 +951,10 @@ void lenv_add_builtins_funcs(lenv *e)
     lenv_add_builtin(e, BUILTIN_SYM_ERROR, builtin_error);
     lenv_add_builtin(e, BUILTIN_SYM_READ, builtin_read);
     lenv_add_builtin(e, BUILTIN_SYM_ENV, builtin_env);
+    lenv_add_builtin(e, BUILTIN_SYM_ENV_HAS, builtin_env_has);
+    lenv_add_builtin(e, BUILTIN_SYM_ENV_GET, builtin_env_get);
+    lenv_add_builtin(e, BUILTIN_SYM_ENV_KEYS, builtin_env_keys);
+    lenv_add_builtin(e, BUILTIN_SYM_ENV_COUNT, builtin_env_count);
     lenv_add_builtin(e, BUILTIN_SYM_TRY, builtin_try);
     lenv_add_builtin(e, BUILTIN_SYM_IS_STRING, builtin_is_string);
     lenv_add_builtin(e, BUILTIN_SYM_IS_LONG, builtin_is_long);
@@ -734,7 +970,12 @@ void lilith_eval_file(lenv *env, const char *filename)
     lval *x = builtin_load(env, args);
     if (x->type == LVAL_ERROR)
     {
-        lilith_println(x);
+        // Keep diagnostics in order with the output preceding them
+        lout *err = lenv_err(env);
+        lout_flush(lenv_out(env));
+        lval_print(err, x, 0);
+        lout_putc(err, '\n');
+        lout_flush(err);
     }
 
     lval_del(x);
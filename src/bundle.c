@@ -0,0 +1,246 @@
+/*
+ * Bundled scripts. A standalone application is a copy of the interpreter with its
+ * scripts appended in compiled form, followed by a trailer locating them. The
+ * first script is the entry point; the rest are found by load and require under
+ * the names they were bundled with.
+ */
+
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <collections.h>
+
+#ifdef __APPLE__
+#include <mach-o/dyld.h>
+#endif
+
+#include "lilith_int.h"
+
+#define BUNDLE_MAGIC "LLTHBNDL"
+
+typedef struct
+{
+    uint64_t size; // size of the payload preceding the trailer
+    char magic[8];
+} bundle_trailer;
+
+/**
+ * The scripts bundled in to the running executable, read once per process.
+ */
+static void *bundle_files;
+static char *bundle_entry;
+static pthread_once_t bundle_once = PTHREAD_ONCE_INIT;
+
+static FILE *open_self()
+{
+#ifdef __APPLE__
+    char path[PATH_MAX];
+    uint32_t size = sizeof(path);
+    return _NSGetExecutablePath(path, &size) == 0 ? fopen(path, "rb") : 0;
+#else
+    return fopen("/proc/self/exe", "rb");
+#endif
+}
+
+/**
+ * Reads the trailer of an executable.
+ *
+ * @param file the executable
+ * @param size populated with the size of the executable
+ * @returns    the size of the bundled payload, or 0 if there is none
+ */
+static uint64_t read_trailer(FILE *file, off_t *size)
+{
+    struct stat fn;
+    bundle_trailer trailer;
+    if (fstat(fileno(file), &fn) != 0)
+    {
+        return 0;
+    }
+
+    *size = fn.st_size;
+    if (fn.st_size < (off_t)sizeof(trailer) ||
+        fseeko(file, fn.st_size - sizeof(trailer), SEEK_SET) != 0 ||
+        fread(&trailer, sizeof(trailer), 1, file) != 1 ||
+        memcmp(trailer.magic, BUNDLE_MAGIC, sizeof(trailer.magic)) ||
+        trailer.size > (uint64_t)fn.st_size - sizeof(trailer))
+    {
+        return 0;
+    }
+
+    return trailer.size;
+}
+
+/**
+ * Reads the payload of the running executable -- a q-expression of alternating
+ * script names and parsed scripts.
+ */
+static void load_bundle()
+{
+    FILE *file = open_self();
+    if (!file)
+    {
+        return;
+    }
+
+    off_t size;
+    uint64_t len = read_trailer(file, &size);
+    lval *payload = 0;
+    if (len && fseeko(file, size - sizeof(bundle_trailer) - len, SEEK_SET) == 0)
+    {
+        char *data = malloc(len);
+        if (fread(data, 1, len, file) == len)
+        {
+            const char *pos = data;
+            payload = lval_deserialise(&pos, data + len);
+        }
+
+        free(data);
+    }
+
+    fclose(file);
+    if (!payload || payload->type != LVAL_QEXPRESSION || !LVAL_EXPR_CNT(payload))
+    {
+        if (payload)
+        {
+            lval_del(payload);
+        }
+
+        return;
+    }
+
+    bundle_files = hash_table(31);
+    while (LVAL_EXPR_CNT(payload) >= 2)
+    {
+        lval *name = lval_pop(payload);
+        lval *expr = lval_pop(payload);
+        if (!bundle_entry)
+        {
+            bundle_entry = strdup(name->value.str_val);
+        }
+
+        hash_table_add(bundle_files, strdup(name->value.str_val), expr);
+        lval_del(name);
+    }
+
+    lval_del(payload);
+}
+
+const lval *bundle_get(const char *name)
+{
+    pthread_once(&bundle_once, load_bundle);
+
+    lval *rv;
+    if (bundle_files && hash_table_get(bundle_files, name, (void**)&rv) == C_OK)
+    {
+        return rv;
+    }
+
+    return 0;
+}
+
+int lilith_run_bundle(lenv *env)
+{
+    pthread_once(&bundle_once, load_bundle);
+    if (!bundle_entry)
+    {
+        return 0;
+    }
+
+    lilith_eval_file(env, bundle_entry);
+    return 1;
+}
+
+/**
+ * Copies the interpreter part of the running executable, leaving out any scripts
+ * already bundled in to it.
+ */
+static lval *copy_self(FILE *out)
+{
+    FILE *file = open_self();
+    if (!file)
+    {
+        return lval_error("unable to open the lilith executable");
+    }
+
+    off_t size = 0;
+    uint64_t len = read_trailer(file, &size);
+    if (len)
+    {
+        size -= len + sizeof(bundle_trailer);
+    }
+
+    rewind(file);
+    char buf[BUFSIZ];
+    while (size > 0)
+    {
+        size_t n = fread(buf, 1, size < (off_t)sizeof(buf) ? (size_t)size : sizeof(buf), file);
+        if (!n || fwrite(buf, 1, n, out) != n)
+        {
+            fclose(file);
+            return lval_error("unable to copy the lilith executable");
+        }
+
+        size -= n;
+    }
+
+    fclose(file);
+    return 0;
+}
+
+lval *lilith_bundle(const char *output, const char **files, int count)
+{
+    if (count < 1)
+    {
+        return lval_error("no scripts to bundle");
+    }
+
+    lval *payload = lval_qexpression();
+    for (int i = 0; i < count; i++)
+    {
+        struct stat fn;
+        lval *expr = stat(files[i], &fn) == 0 ? read_source_file(files[i], &fn) : 0;
+        if (!expr || expr->type == LVAL_ERROR)
+        {
+            lval_del(payload);
+            return expr ? expr : lval_error("File not found %s", files[i]);
+        }
+
+        lval_add(payload, lval_string(files[i]));
+        lval_add(payload, expr);
+    }
+
+    lbuf buf;
+    lbuf_init(&buf);
+    lval_serialise(&buf, payload);
+    lval_del(payload);
+
+    bundle_trailer trailer = { buf.len, BUNDLE_MAGIC };
+    FILE *out = fopen(output, "wb");
+    lval *rv = out ? copy_self(out) : lval_error("unable to create %s", output);
+    if (out)
+    {
+        if (!rv && (fwrite(buf.data, 1, buf.len, out) != buf.len ||
+                    fwrite(&trailer, sizeof(trailer), 1, out) != 1))
+        {
+            rv = lval_error("unable to write %s", output);
+        }
+
+        if (fclose(out) != 0 && !rv)
+        {
+            rv = lval_error("unable to write %s", output);
+        }
+
+        if (rv)
+        {
+            unlink(output);
+        }
+        else
+        {
+            chmod(output, 0755);
+        }
+    }
+
+    lbuf_free(&buf);
+    return rv;
+}
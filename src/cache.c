@@ -0,0 +1,369 @@
+/*
+ * Result cache. (cached "namespace" {expression}) evaluates the expression once and
+ * stores the result on disk, keyed by a hash of the expression, the values of the
+ * symbols it uses and the namespace. Later evaluations, in this process or another,
+ * read the stored result instead. Entries are dropped, least recently used first,
+ * once the cache grows beyond LILITH_CACHE_SIZE bytes.
+ */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <collections.h>
+
+#include "lilith_int.h"
+#include "builtin_symbols.h"
+
+#define CACHE_EXT ".llthr"
+#define CACHE_MAGIC "LLTHR " LILITH_VERSION "\n"
+#define CACHE_DEFAULT_SIZE (64L * 1024 * 1024)
+
+/**
+ * Header of a cached result. The key is checked on reading so a result is never
+ * returned for another expression.
+ */
+typedef struct
+{
+    char magic[sizeof(CACHE_MAGIC)];
+    uint32_t order;
+    uint32_t long_size;
+    uint64_t key;
+} cache_header;
+
+typedef struct
+{
+    char *path;
+    off_t size;
+    time_t mtime;
+} cache_entry;
+
+static void cache_header_init(cache_header *hdr, uint64_t key)
+{
+    memset(hdr, 0, sizeof(cache_header));
+    memcpy(hdr->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    hdr->order = 0x01020304;
+    hdr->long_size = sizeof(long);
+    hdr->key = key;
+}
+
+/**
+ * Gets the size the cache is limited to. Zero turns caching off.
+ */
+static off_t cache_limit()
+{
+    const char *size = getenv("LILITH_CACHE_SIZE");
+    return size && *size ? strtoll(size, 0, 10) : CACHE_DEFAULT_SIZE;
+}
+
+/**
+ * Gets the cache directory, creating it if needed -- LILITH_CACHE_DIR, or lilith
+ * in the user's cache directory.
+ */
+static char *cache_dir()
+{
+    const char *dir = getenv("LILITH_CACHE_DIR");
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+
+    char *rv;
+    if (dir && *dir)
+    {
+        rv = strdup(dir);
+    }
+    else if (xdg && *xdg)
+    {
+        rv = malloc(strlen(xdg) + sizeof("/lilith"));
+        sprintf(rv, "%s/lilith", xdg);
+    }
+    else if (home && *home)
+    {
+        rv = malloc(strlen(home) + sizeof("/.cache/lilith"));
+        sprintf(rv, "%s/.cache/lilith", home);
+    }
+    else
+    {
+        return 0;
+    }
+
+    for (char *ptr = strchr(rv + 1, '/'); ptr; ptr = strchr(ptr + 1, '/'))
+    {
+        *ptr = 0;
+        mkdir(rv, 0755);
+        *ptr = '/';
+    }
+
+    mkdir(rv, 0755);
+    return rv;
+}
+
+/**
+ * Adds the values of the symbols an expression uses to a hash, following the
+ * definitions of the functions it calls. Built-ins cannot be redefined, so their
+ * names -- already part of the expression -- are enough.
+ */
+static uint64_t cache_hash_inputs(lenv *env, const lval *expr, void *seen, uint64_t rv)
+{
+    if (expr->type == LVAL_SEXPRESSION || expr->type == LVAL_QEXPRESSION)
+    {
+        for (pair *ptr = expr->value.list.head; ptr; ptr = ptr->next)
+        {
+            rv = cache_hash_inputs(env, ptr->data, seen, rv);
+        }
+
+        return rv;
+    }
+
+    lval *v;
+    if (expr->type != LVAL_SYMBOL || hash_table_get(seen, expr->value.str_val, (void**)&v) == C_OK)
+    {
+        return rv;
+    }
+
+    hash_table_add(seen, strdup(expr->value.str_val), 0);
+    v = lenv_find(env, expr->value.str_val);
+    if (!v || v->type == LVAL_BUILTIN_FUN)
+    {
+        return rv;
+    }
+
+    rv = lilith_hash(expr->value.str_val, strlen(expr->value.str_val) + 1, rv);
+    rv = lval_hash(v, rv);
+    if (v->type == LVAL_USER_FUN)
+    {
+        // Arguments bound by partial application
+        lval *bound = lenv_to_lval(v->value.user_fun.env);
+        rv = lval_hash(bound, rv);
+        lval_del(bound);
+
+        rv = cache_hash_inputs(env, v->value.user_fun.body, seen, rv);
+    }
+
+    return rv;
+}
+
+static char *cache_path(const char *dir, uint64_t key)
+{
+    char *rv = malloc(strlen(dir) + 18 + sizeof(CACHE_EXT));
+    sprintf(rv, "%s/%016llx" CACHE_EXT, dir, (unsigned long long)key);
+    return rv;
+}
+
+/**
+ * Reads a cached result. The file is mapped rather than read and its modification
+ * time updated to mark it as recently used.
+ */
+static lval *cache_read(const char *path, uint64_t key)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return 0;
+    }
+
+    lval *rv = 0;
+    struct stat fn;
+    if (fstat(fd, &fn) == 0 && fn.st_size > (off_t)sizeof(cache_header))
+    {
+        void *data = mmap(0, fn.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED)
+        {
+            cache_header hdr;
+            cache_header_init(&hdr, key);
+
+            const char *pos = (const char*)data + sizeof(hdr);
+            const char *end = (const char*)data + fn.st_size;
+            if (!memcmp(data, &hdr, sizeof(hdr)))
+            {
+                rv = lval_deserialise(&pos, end);
+                if (rv && pos != end)
+                {
+                    lval_del(rv);
+                    rv = 0;
+                }
+            }
+
+            munmap(data, fn.st_size);
+        }
+    }
+
+    if (rv)
+    {
+        futimens(fd, 0);
+    }
+
+    close(fd);
+    return rv;
+}
+
+static int compare_entry(const void *x, const void *y)
+{
+    const cache_entry *a = x;
+    const cache_entry *b = y;
+    return a->mtime < b->mtime ? -1 : a->mtime > b->mtime;
+}
+
+/**
+ * Removes the least recently used results until the cache is within its limit.
+ */
+static void cache_evict(const char *dir, off_t limit)
+{
+    DIR *d = opendir(dir);
+    if (!d)
+    {
+        return;
+    }
+
+    cache_entry *entries = 0;
+    size_t count = 0, cap = 0;
+    off_t total = 0;
+
+    struct dirent *de;
+    while ((de = readdir(d)))
+    {
+        size_t len = strlen(de->d_name);
+        if (len <= strlen(CACHE_EXT) || strcmp(de->d_name + len - strlen(CACHE_EXT), CACHE_EXT))
+        {
+            continue;
+        }
+
+        struct stat fn;
+        char *path = malloc(strlen(dir) + len + 2);
+        sprintf(path, "%s/%s", dir, de->d_name);
+        if (stat(path, &fn) != 0)
+        {
+            free(path);
+            continue;
+        }
+
+        if (count == cap)
+        {
+            cap = cap ? cap * 2 : 64;
+            entries = realloc(entries, sizeof(cache_entry) * cap);
+        }
+
+        entries[count++] = (cache_entry){ path, fn.st_size, fn.st_mtime };
+        total += fn.st_size;
+    }
+
+    closedir(d);
+    qsort(entries, count, sizeof(cache_entry), compare_entry);
+    for (size_t i = 0; i < count; i++)
+    {
+        if (total > limit && unlink(entries[i].path) == 0)
+        {
+            total -= entries[i].size;
+        }
+
+        free(entries[i].path);
+    }
+
+    free(entries);
+}
+
+/**
+ * Stores a result. Written under a temporary name and renamed so readers never see
+ * a partial file. Results that cannot be serialised, such as functions, are not stored.
+ */
+static void cache_write(const char *dir, const char *path, uint64_t key, const lval *val, off_t limit)
+{
+    cache_header hdr;
+    cache_header_init(&hdr, key);
+
+    lbuf buf;
+    lbuf_init(&buf);
+    lbuf_write(&buf, &hdr, sizeof(hdr));
+    if (lval_serialise(&buf, val) && (off_t)buf.len <= limit)
+    {
+        char *tmp = malloc(strlen(path) + 24);
+        sprintf(tmp, "%s.%ld.tmp", path, (long)getpid());
+
+        FILE *file = fopen(tmp, "wb");
+        if (file)
+        {
+            bool ok = fwrite(buf.data, 1, buf.len, file) == buf.len;
+            ok = (fclose(file) == 0) && ok;
+            if (!ok || rename(tmp, path) != 0)
+            {
+                unlink(tmp);
+            }
+            else
+            {
+                cache_evict(dir, limit);
+            }
+        }
+
+        free(tmp);
+    }
+
+    lbuf_free(&buf);
+}
+
+/**
+ * Built-in function to evaluate an expression, or return its result from the
+ * cache if it has been evaluated before with the same inputs.
+ */
+static lval *builtin_cached(lenv *env, lval *args)
+{
+    LASSERT_ENV(args, env, BUILTIN_SYM_CACHED);
+    LASSERT_NO_ERROR(args);
+    LASSERT(args, LVAL_EXPR_CNT(args) == 2, "function '%s' expects 2 arguments, received %d",
+        BUILTIN_SYM_CACHED, LVAL_EXPR_CNT(args));
+    LASSERT(args, LVAL_EXPR_FIRST(args)->type == LVAL_STRING,
+        "function '%s' type mismatch - expected %s, received %s",
+        BUILTIN_SYM_CACHED, ltype_name(LVAL_STRING), ltype_name(LVAL_EXPR_FIRST(args)->type));
+    LASSERT(args, args->value.list.head->next->data->type == LVAL_QEXPRESSION,
+        "function '%s' type mismatch - expected %s, received %s",
+        BUILTIN_SYM_CACHED, ltype_name(LVAL_QEXPRESSION), ltype_name(args->value.list.head->next->data->type));
+
+    lval *name = lval_pop(args);
+    lval *expr = lval_take(args, 0);
+    expr->type = LVAL_SEXPRESSION;
+
+    off_t limit = cache_limit();
+    char *dir = limit > 0 ? cache_dir() : 0;
+    if (!dir)
+    {
+        lval_del(name);
+        return lilith_eval_expr(env, expr);
+    }
+
+    void *seen = hash_table(31);
+    uint64_t key = lilith_hash(name->value.str_val, strlen(name->value.str_val) + 1, LILITH_HASH_SEED);
+    key = lval_hash(expr, key);
+    key = cache_hash_inputs(env, expr, seen, key);
+    lval_del(name);
+
+    void *iter = clxns_iter_new(seen);
+    while (clxns_iter_move_next(iter))
+    {
+        free(((kvp*)clxns_iter_get_next(iter))->key);
+    }
+
+    clxns_iter_free(iter);
+    clxns_free(seen, 0);
+
+    char *path = cache_path(dir, key);
+    lval *rv = cache_read(path, key);
+    if (rv)
+    {
+        lval_del(expr);
+    }
+    else
+    {
+        rv = lilith_eval_expr(env, expr);
+        if (rv->type != LVAL_ERROR)
+        {
+            cache_write(dir, path, key, rv, limit);
+        }
+    }
+
+    free(path);
+    free(dir);
+    return rv;
+}
+
+void lenv_add_builtins_cache(lenv *e)
+{
+    lenv_add_builtin(e, BUILTIN_SYM_CACHED, builtin_cached);
+}
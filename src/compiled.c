@@ -0,0 +1,166 @@
+/*
+ * Compiled scripts. The parsed form of a loaded file is stored next to it, or in
+ * LILITH_CACHE_DIR if set, and used instead of parsing the file again. The stored
+ * form is stamped with the interpreter version and a hash of the source so it is
+ * ignored once either changes.
+ */
+
+#include <limits.h>
+#include <unistd.h>
+
+#include "lilith_int.h"
+
+#define COMPILED_EXT "c"
+#define COMPILED_MAGIC "LLTHC " LILITH_VERSION "\n"
+
+char *load_file(const char *filename, struct stat *fn);
+
+/**
+ * Header of a compiled file. The byte order and word size must match the
+ * interpreter reading it.
+ */
+typedef struct
+{
+    char magic[sizeof(COMPILED_MAGIC)];
+    uint32_t order;
+    uint32_t long_size;
+    uint64_t hash;
+} compiled_header;
+
+static void compiled_header_init(compiled_header *hdr, uint64_t hash)
+{
+    memset(hdr, 0, sizeof(compiled_header));
+    memcpy(hdr->magic, COMPILED_MAGIC, sizeof(COMPILED_MAGIC));
+    hdr->order = 0x01020304;
+    hdr->long_size = sizeof(long);
+    hdr->hash = hash;
+}
+
+/**
+ * Gets the path of the compiled form of a source file.
+ */
+static char *compiled_path(const char *path)
+{
+    const char *dir = getenv("LILITH_CACHE_DIR");
+    if (!dir || !*dir)
+    {
+        char *rv = malloc(strlen(path) + sizeof(COMPILED_EXT));
+        sprintf(rv, "%s" COMPILED_EXT, path);
+        return rv;
+    }
+
+    // Files with the same name in different directories must not share a cache entry
+    char full[PATH_MAX];
+    if (!realpath(path, full))
+    {
+        return 0;
+    }
+
+    const char *base = strrchr(full, '/');
+    base = base ? base + 1 : full;
+
+    uint64_t hash = lilith_hash(full, strlen(full), LILITH_HASH_SEED);
+    char *rv = malloc(strlen(dir) + strlen(base) + 24 + sizeof(COMPILED_EXT));
+    sprintf(rv, "%s/%016llx-%s" COMPILED_EXT, dir, (unsigned long long)hash, base);
+    return rv;
+}
+
+/**
+ * Reads a compiled file if it was made from the same source by this interpreter.
+ */
+static lval *compiled_read(const char *cpath, const compiled_header *expected)
+{
+    FILE *file = fopen(cpath, "rb");
+    if (!file)
+    {
+        return 0;
+    }
+
+    lval *rv = 0;
+    compiled_header hdr;
+    struct stat fn;
+    if (fread(&hdr, sizeof(hdr), 1, file) == 1 && !memcmp(&hdr, expected, sizeof(hdr)) &&
+        fstat(fileno(file), &fn) == 0 && fn.st_size > (off_t)sizeof(hdr))
+    {
+        size_t len = fn.st_size - sizeof(hdr);
+        char *data = malloc(len);
+        if (fread(data, 1, len, file) == len)
+        {
+            const char *pos = data;
+            rv = lval_deserialise(&pos, data + len);
+            if (rv && (pos != data + len || rv->type != LVAL_SEXPRESSION))
+            {
+                lval_del(rv);
+                rv = 0;
+            }
+        }
+
+        free(data);
+    }
+
+    fclose(file);
+    return rv;
+}
+
+/**
+ * Stores a compiled file. Written under a temporary name and renamed so readers
+ * never see a partial file. Failures are ignored -- the source is parsed next time.
+ */
+static void compiled_write(const char *cpath, const compiled_header *hdr, const lval *expr)
+{
+    lbuf buf;
+    lbuf_init(&buf);
+    lbuf_write(&buf, hdr, sizeof(compiled_header));
+    if (lval_serialise(&buf, expr))
+    {
+        char *tmp = malloc(strlen(cpath) + 24);
+        sprintf(tmp, "%s.%ld.tmp", cpath, (long)getpid());
+
+        FILE *file = fopen(tmp, "wb");
+        if (file)
+        {
+            bool ok = fwrite(buf.data, 1, buf.len, file) == buf.len;
+            ok = (fclose(file) == 0) && ok;
+            if (!ok || rename(tmp, cpath) != 0)
+            {
+                unlink(tmp);
+            }
+        }
+
+        free(tmp);
+    }
+
+    lbuf_free(&buf);
+}
+
+lval *read_source_file(const char *path, struct stat *fn)
+{
+    char *contents = load_file(path, fn);
+    if (!contents)
+    {
+        return 0;
+    }
+
+    compiled_header hdr;
+    compiled_header_init(&hdr, lilith_hash(contents, fn->st_size, LILITH_HASH_SEED));
+
+    lval *rv = 0;
+    char *cpath = compiled_path(path);
+    if (cpath)
+    {
+        rv = compiled_read(cpath, &hdr);
+    }
+
+    if (!rv)
+    {
+        rv = lilith_read_from_string(contents);
+        if (cpath && rv->type != LVAL_ERROR)
+        {
+            compiled_write(cpath, &hdr, rv);
+        }
+    }
+
+    free(cpath);
+    free(contents);
+    return rv;
+}
@@ -9,6 +9,92 @@
 
 lval *lilith_eval_expr(lenv *env, lval *val);
 
+/**
+ * Checks whether a function called in tail position of a function's body is the
+ * function itself, with all of its parameters unbound and all of them passed.
+ */
+static bool lval_is_self(const lval *func, const lval *callee, size_t count)
+{
+    const lval *formals = lfun_formals(func);
+    return formals && callee && callee->type == LVAL_USER_FUN &&
+        callee->value.user_fun.opt == func->value.user_fun.opt && !callee->value.user_fun.native &&
+        LVAL_EXPR_CNT(formals) == count && LVAL_EXPR_CNT(callee->value.user_fun.formals) == count &&
+        lenv_empty(callee->value.user_fun.env);
+}
+
+/**
+ * Evaluates the body of a function with its parameters bound. The expressions in
+ * tail position -- the body and the branches of an if -- are evaluated in a loop
+ * rather than recursively, and a call there to the function itself rebinds the
+ * parameters and starts the body again instead of creating another environment.
+ * That is only done while the environment holds nothing but the parameters, as a
+ * new call would completely shadow them.
+ */
+static lval *lval_call_body(lval *func)
+{
+    lenv *env = func->value.user_fun.env;
+    lval *x = lval_copy(lfun_body(func));
+    x->type = LVAL_SEXPRESSION;
+    for (;;)
+    {
+        // Yield to the host when evaluating a step-sliced task
+        if (task_current && !task_step())
+        {
+            lval_del(x);
+            return lval_error("evaluation cancelled");
+        }
+
+        size_t count = LVAL_EXPR_CNT(x);
+        if (!count)
+        {
+            return x;
+        }
+
+        // A call to the function itself is made without copying it
+        lval *head = LVAL_EXPR_FIRST(x);
+        bool self = count > 1 && head->type == LVAL_SYMBOL &&
+            lval_is_self(func, lenv_find_raw(env, head->value.str_val), count - 1);
+
+        for (pair *ptr = self ? x->value.list.head->next : x->value.list.head; ptr; ptr = ptr->next)
+        {
+            ptr->data = lilith_eval_expr(env, ptr->data);
+        }
+
+        // Evaluating the arguments could have rebound the name or added to the environment
+        if (self && lval_is_self(func, lenv_find_raw(env, head->value.str_val), count - 1) &&
+            lenv_count(env) == count - 1)
+        {
+            lval_del(lval_pop(x));
+            for (pair *ptr = lfun_formals(func)->value.list.head; ptr; ptr = ptr->next)
+            {
+                lenv_rebind(env, ptr->data->value.str_val, lval_pop(x));
+            }
+
+            lval_del(x);
+            x = lval_copy(lfun_body(func));
+            x->type = LVAL_SEXPRESSION;
+            continue;
+        }
+
+        if (self)
+        {
+            x->value.list.head->data = lilith_eval_expr(env, head);
+        }
+
+        // Continue with the branch an if takes; anything else is left to the if to report
+        head = LVAL_EXPR_FIRST(x);
+        if (lval_is_if(head) && count == 4 && lval_expr_item(x, 1)->type == LVAL_BOOL &&
+            lval_expr_item(x, 2)->type == LVAL_QEXPRESSION && lval_expr_item(x, 3)->type == LVAL_QEXPRESSION)
+        {
+            x = lval_take(x, lval_expr_item(x, 1)->value.bval ? 2 : 3);
+            x->type = LVAL_SEXPRESSION;
+            continue;
+        }
+
+        return lval_apply(env, x);
+    }
+}
+
 /**
  * Calls a function. Binds each parameter to its environment and evaluates
  * the function with that environment. If too few arguments are passed it
@@ -19,17 +105,28 @@ lval *lilith_eval_expr(lenv *env, lval *val);
  * @param args the arguments to pass to the function
  * @returns    a result, or a partially evaluated function
  */
-static lval *lval_call(lenv *env, lval *func, lval *args)
+lval *lval_call(lenv *env, lval *func, lval *args)
 {
     if (func->type == LVAL_BUILTIN_FUN)
     {
         return func->value.builtin(env, args);
     }
 
+    if (func->type == LVAL_FFI_FUN)
+    {
+        return ffi_call(func, args);
+    }
+
     // Argument counts
     size_t given = LVAL_EXPR_CNT(args);
     size_t expected = LVAL_EXPR_CNT(func->value.user_fun.formals);
 
+    // Compiled functions bind their own arguments
+    if (func->value.user_fun.native && given == expected)
+    {
+        return func->value.user_fun.native(func->value.user_fun.scope ? func->value.user_fun.scope : env, args);
+    }
+
     // Bind the parameters to the formal symbols
     while (LVAL_EXPR_CNT(args))
     {
@@ -103,28 +200,23 @@ static lval *lval_call(lenv *env, lval *func, lval *args)
 
     if (LVAL_EXPR_CNT(func->value.user_fun.formals) == 0)
     {
-        // All arguments are bound so call function
-        lenv_set_parent(func->value.user_fun.env, env);
-        return call_builtin(func->value.user_fun.env, BUILTIN_SYM_EVAL,
-                            lval_add(lval_sexpression(), lval_copy(func->value.user_fun.body)));
+        // All arguments are bound so call function. Functions from a module see the module's definitions.
+        lenv_set_parent(func->value.user_fun.env, func->value.user_fun.scope ? func->value.user_fun.scope : env);
+        return lfun_return(func, lval_call_body(func));
     }
 
     /*
      * Return the partially evaluated function. At this stage all of the passed-in params
      * have been bound to the function's local environment and the corresponding formals
-     * have been removed.
+     * have been removed. The compiled form expects all of the arguments so can no longer be used.
      */
-    return lval_copy(func);
+    lval *rv = lval_copy(func);
+    rv->value.user_fun.native = 0;
+    return rv;
 }
 
-static lval *lval_eval_sexpr(lenv *env, lval *val)
+lval *lval_apply(lenv *env, lval *val)
 {
-    // Evaluate children
-    for (pair *ptr = val->value.list.head; ptr; ptr = ptr->next)
-    {
-        ptr->data = lilith_eval_expr(env, ptr->data);
-    }
-
     // Empty expressions
     if (LVAL_EXPR_CNT(val) == 0)
     {
@@ -137,7 +229,8 @@ static lval *lval_eval_sexpr(lenv *env, lval *val)
     }
 
     // Single expression
-    if (LVAL_EXPR_CNT(val) == 1 && (LVAL_EXPR_FIRST(val)->type != LVAL_BUILTIN_FUN))
+    if (LVAL_EXPR_CNT(val) == 1 &&
+        LVAL_EXPR_FIRST(val)->type != LVAL_BUILTIN_FUN && LVAL_EXPR_FIRST(val)->type != LVAL_FFI_FUN)
     {
         lval *rv = lval_pop(val);
         lval_del(val);
@@ -146,7 +239,7 @@ static lval *lval_eval_sexpr(lenv *env, lval *val)
 
     // First element must be a function
     lval *first = lval_pop(val);
-    if (first->type != LVAL_BUILTIN_FUN && first->type != LVAL_USER_FUN)
+    if (first->type != LVAL_BUILTIN_FUN && first->type != LVAL_USER_FUN && first->type != LVAL_FFI_FUN)
     {
         lval *rv = lval_error("s-expression does not start with function, '%s'", ltype_name(first->type));
         lval_del(first);
@@ -160,8 +253,26 @@ static lval *lval_eval_sexpr(lenv *env, lval *val)
     return result;
 }
 
+static lval *lval_eval_sexpr(lenv *env, lval *val)
+{
+    // Evaluate children
+    for (pair *ptr = val->value.list.head; ptr; ptr = ptr->next)
+    {
+        ptr->data = lilith_eval_expr(env, ptr->data);
+    }
+
+    return lval_apply(env, val);
+}
+
 lval *lilith_eval_expr(lenv *env, lval *val)
 {
+    // Yield to the host when evaluating a step-sliced task
+    if (task_current && !task_step())
+    {
+        lval_del(val);
+        return lval_error("evaluation cancelled");
+    }
+
     // Lookup the function and return
     if (val->type == LVAL_SYMBOL)
     {
@@ -182,6 +293,12 @@ lval *lilith_eval_expr(lenv *env, lval *val)
 
 lval *multi_eval(lenv *env, lval *expr)
 {
+    // The expressions could not be read
+    if (expr->type == LVAL_ERROR)
+    {
+        return expr;
+    }
+
     // Evaluate each expression
     while (LVAL_EXPR_CNT(expr))
     {
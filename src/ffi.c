@@ -0,0 +1,418 @@
+/*
+ * Built-in functions to call C functions in shared libraries. Uses an X macro to
+ * generate a call trampoline for every combination of integer and decimal arguments.
+ */
+
+#include <dlfcn.h>
+#include <limits.h>
+#include <pthread.h>
+#include <collections.h>
+
+#include "lilith_int.h"
+#include "builtin_symbols.h"
+
+#define FFI_MAX_ARGS 4
+
+/**
+ * A single argument or return value passed across the C boundary. Pointers travel
+ * in the integer class, which matches the calling convention on the LP64 platforms
+ * Lilith supports.
+ */
+typedef union
+{
+    long l;
+    double d;
+    void *p;
+} ffi_word;
+
+/**
+ * Pointer to a call trampoline -- casts fn to a concrete prototype and calls it.
+ */
+typedef void (*ffi_tramp)(void *fn, ffi_word *args, ffi_word *ret);
+
+/**
+ * A library opened by ffi-open. Closed once neither it nor any function looked up
+ * in it is referenced.
+ */
+struct ffi_lib
+{
+    unsigned refs;
+    void *handle;
+    char *name;
+};
+
+/**
+ * A parsed signature description. Shared by every function with the same signature.
+ */
+struct ffi_sig
+{
+    char *desc;              // the signature description, e.g. "d:dd"
+    char ret;                // return type code
+    unsigned argc;           // number of arguments
+    char args[FFI_MAX_ARGS]; // argument type codes
+    ffi_tramp tramp;         // trampoline matching the argument layout
+};
+
+/*
+ * A macro defining the supported argument layouts. The first argument names the
+ * layout (L for integer class, D for decimal); the second the C parameter list;
+ * the third the argument list. Layouts are ordered by arity and then by a bit mask
+ * where bit i is set when argument i is a decimal.
+ */
+#define FFI_LAYOUTS                                                             \
+    $(V, (void), ())                                                            \
+    $(L, (long), (a[0].l))                                                      \
+    $(D, (double), (a[0].d))                                                    \
+    $(LL, (long, long), (a[0].l, a[1].l))                                       \
+    $(DL, (double, long), (a[0].d, a[1].l))                                     \
+    $(LD, (long, double), (a[0].l, a[1].d))                                     \
+    $(DD, (double, double), (a[0].d, a[1].d))                                   \
+    $(LLL, (long, long, long), (a[0].l, a[1].l, a[2].l))                        \
+    $(DLL, (double, long, long), (a[0].d, a[1].l, a[2].l))                      \
+    $(LDL, (long, double, long), (a[0].l, a[1].d, a[2].l))                      \
+    $(DDL, (double, double, long), (a[0].d, a[1].d, a[2].l))                    \
+    $(LLD, (long, long, double), (a[0].l, a[1].l, a[2].d))                      \
+    $(DLD, (double, long, double), (a[0].d, a[1].l, a[2].d))                    \
+    $(LDD, (long, double, double), (a[0].l, a[1].d, a[2].d))                    \
+    $(DDD, (double, double, double), (a[0].d, a[1].d, a[2].d))                  \
+    $(LLLL, (long, long, long, long), (a[0].l, a[1].l, a[2].l, a[3].l))         \
+    $(DLLL, (double, long, long, long), (a[0].d, a[1].l, a[2].l, a[3].l))       \
+    $(LDLL, (long, double, long, long), (a[0].l, a[1].d, a[2].l, a[3].l))       \
+    $(DDLL, (double, double, long, long), (a[0].d, a[1].d, a[2].l, a[3].l))     \
+    $(LLDL, (long, long, double, long), (a[0].l, a[1].l, a[2].d, a[3].l))       \
+    $(DLDL, (double, long, double, long), (a[0].d, a[1].l, a[2].d, a[3].l))     \
+    $(LDDL, (long, double, double, long), (a[0].l, a[1].d, a[2].d, a[3].l))     \
+    $(DDDL, (double, double, double, long), (a[0].d, a[1].d, a[2].d, a[3].l))   \
+    $(LLLD, (long, long, long, double), (a[0].l, a[1].l, a[2].l, a[3].d))       \
+    $(DLLD, (double, long, long, double), (a[0].d, a[1].l, a[2].l, a[3].d))     \
+    $(LDLD, (long, double, long, double), (a[0].l, a[1].d, a[2].l, a[3].d))     \
+    $(DDLD, (double, double, long, double), (a[0].d, a[1].d, a[2].l, a[3].d))   \
+    $(LLDD, (long, long, double, double), (a[0].l, a[1].l, a[2].d, a[3].d))     \
+    $(DLDD, (double, long, double, double), (a[0].d, a[1].l, a[2].d, a[3].d))   \
+    $(LDDD, (long, double, double, double), (a[0].l, a[1].d, a[2].d, a[3].d))   \
+    $(DDDD, (double, double, double, double), (a[0].d, a[1].d, a[2].d, a[3].d))
+
+// Trampolines for long, int, decimal and void returns. Only the low half of an int
+// return is set, so it has its own trampoline.
+#define $(N, P, A)                                                                       \
+    static void ffi_l_##N(void *fn, ffi_word *a, ffi_word *r) { r->l = ((long (*)P)fn)A; }   \
+    static void ffi_i_##N(void *fn, ffi_word *a, ffi_word *r) { r->l = ((int (*)P)fn)A; }    \
+    static void ffi_d_##N(void *fn, ffi_word *a, ffi_word *r) { r->d = ((double (*)P)fn)A; } \
+    static void ffi_v_##N(void *fn, ffi_word *a, ffi_word *r) { ((void (*)P)fn)A; }
+    FFI_LAYOUTS
+#undef $
+
+static ffi_tramp ffi_tramps_l[] =
+{
+#define $(N, P, A) ffi_l_##N,
+    FFI_LAYOUTS
+#undef $
+};
+
+static ffi_tramp ffi_tramps_i[] =
+{
+#define $(N, P, A) ffi_i_##N,
+    FFI_LAYOUTS
+#undef $
+};
+
+static ffi_tramp ffi_tramps_d[] =
+{
+#define $(N, P, A) ffi_d_##N,
+    FFI_LAYOUTS
+#undef $
+};
+
+static ffi_tramp ffi_tramps_v[] =
+{
+#define $(N, P, A) ffi_v_##N,
+    FFI_LAYOUTS
+#undef $
+};
+
+/**
+ * Parsed signatures keyed by their description. Lives for the life of the process
+ * and is shared by all interpreters, so is only used holding sig_lock.
+ */
+static void *sig_cache;
+static pthread_mutex_t sig_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Parses a signature description of the form "r:aaa". The return type r is one of
+ * l (long), i (int), d (double), s (string) or v (void); each argument a is one of
+ * l, i, d, s or b (a byte buffer built from a q-expression of numbers). An int
+ * argument is passed in the integer class like a long, which the callee reads the
+ * low half of.
+ *
+ * @param desc the signature description
+ * @returns    the cached signature, or 0 if the description is invalid
+ */
+static struct ffi_sig *ffi_sig_get(const char *desc)
+{
+    size_t len = strlen(desc);
+    if (len < 2 || !strchr("lidsv", desc[0]) || desc[1] != ':' || len - 2 > FFI_MAX_ARGS ||
+        strspn(desc + 2, "lidsb") != len - 2)
+    {
+        return 0;
+    }
+
+    struct ffi_sig *sig;
+    pthread_mutex_lock(&sig_lock);
+    if (!sig_cache)
+    {
+        sig_cache = hash_table(31);
+    }
+    else if (hash_table_get(sig_cache, desc, (void**)&sig) == C_OK)
+    {
+        pthread_mutex_unlock(&sig_lock);
+        return sig;
+    }
+
+    sig = malloc(sizeof(struct ffi_sig));
+    sig->desc = strdup(desc);
+    sig->ret = desc[0];
+    sig->argc = len - 2;
+
+    unsigned layout = 0;
+    for (unsigned i = 0; i < sig->argc; i++)
+    {
+        sig->args[i] = desc[i + 2];
+        if (sig->args[i] == 'd')
+        {
+            layout |= 1 << i;
+        }
+    }
+
+    // Layouts of each arity start after all of those of smaller arities
+    layout += (1 << sig->argc) - 1;
+    switch (sig->ret)
+    {
+    case 'i':
+        sig->tramp = ffi_tramps_i[layout];
+        break;
+    case 'd':
+        sig->tramp = ffi_tramps_d[layout];
+        break;
+    case 'v':
+        sig->tramp = ffi_tramps_v[layout];
+        break;
+    default:
+        sig->tramp = ffi_tramps_l[layout];
+        break;
+    }
+
+    hash_table_add(sig_cache, strdup(desc), sig);
+    pthread_mutex_unlock(&sig_lock);
+    return sig;
+}
+
+/**
+ * Copies a q-expression of byte values in to a new buffer.
+ */
+static unsigned char *ffi_byte_buffer(lval *val)
+{
+    unsigned char *rv = malloc(LVAL_EXPR_CNT(val) + 1);
+    size_t i = 0;
+    for (pair *ptr = val->value.list.head; ptr; ptr = ptr->next)
+    {
+        if (ptr->data->type != LVAL_LONG || ptr->data->value.num_l < 0 || ptr->data->value.num_l > 255)
+        {
+            free(rv);
+            return 0;
+        }
+
+        rv[i++] = ptr->data->value.num_l;
+    }
+
+    return rv;
+}
+
+lval *ffi_call(lval *func, lval *args)
+{
+    LASSERT_NO_ERROR(args);
+
+    struct ffi_sig *sig = func->value.ffi_fun.sig;
+    LASSERT(args, LVAL_EXPR_CNT(args) == sig->argc,
+        "foreign function '%s' expects %d arguments, received %d",
+        func->value.ffi_fun.name, sig->argc, LVAL_EXPR_CNT(args));
+
+    ffi_word words[FFI_MAX_ARGS];
+    void *buffers[FFI_MAX_ARGS] = { 0 };
+    lval *rv = 0;
+
+    unsigned i = 0;
+    for (pair *ptr = args->value.list.head; ptr && !rv; ptr = ptr->next, i++)
+    {
+        lval *arg = ptr->data;
+        switch (sig->args[i])
+        {
+        case 'l':
+            if (arg->type == LVAL_LONG)
+            {
+                words[i].l = arg->value.num_l;
+                continue;
+            }
+            break;
+        case 'i':
+            if (arg->type == LVAL_LONG && arg->value.num_l >= INT_MIN && arg->value.num_l <= INT_MAX)
+            {
+                words[i].l = arg->value.num_l;
+                continue;
+            }
+            break;
+        case 'd':
+            if (arg->type == LVAL_LONG || arg->type == LVAL_DOUBLE)
+            {
+                words[i].d = arg->type == LVAL_LONG ? arg->value.num_l : arg->value.num_d;
+                continue;
+            }
+            break;
+        case 's':
+            if (arg->type == LVAL_STRING)
+            {
+                words[i].p = arg->value.str_val;
+                continue;
+            }
+            break;
+        case 'b':
+            if (arg->type == LVAL_QEXPRESSION && (buffers[i] = ffi_byte_buffer(arg)))
+            {
+                words[i].p = buffers[i];
+                continue;
+            }
+            break;
+        }
+
+        rv = lval_error("foreign function '%s' type mismatch - argument %d does not match signature '%s'",
+            func->value.ffi_fun.name, i + 1, sig->desc);
+    }
+
+    if (!rv)
+    {
+        ffi_word ret;
+        sig->tramp(func->value.ffi_fun.fn, words, &ret);
+        switch (sig->ret)
+        {
+        case 'l':
+        case 'i':
+            rv = lval_long(ret.l);
+            break;
+        case 'd':
+            rv = lval_double(ret.d);
+            break;
+        case 's':
+            rv = ret.p ? lval_string(ret.p) : lval_qexpression();
+            break;
+        default:
+            rv = lval_sexpression();
+            break;
+        }
+    }
+
+    for (i = 0; i < FFI_MAX_ARGS; i++)
+    {
+        free(buffers[i]);
+    }
+
+    lval_del(args);
+    return rv;
+}
+
+/**
+ * Built-in function to open a shared library. An empty filename opens the
+ * running program and the libraries it is linked with.
+ */
+static lval *builtin_ffi_open(lenv *env, lval *args)
+{
+    LASSERT_ENV(args, env, BUILTIN_SYM_FFI_OPEN);
+    LASSERT_NO_ERROR(args);
+    LASSERT(args, LVAL_EXPR_CNT(args) == 1, "function '%s' expects 1 argument, received %d",
+        BUILTIN_SYM_FFI_OPEN, LVAL_EXPR_CNT(args));
+    LASSERT(args, LVAL_EXPR_FIRST(args)->type == LVAL_STRING,
+        "function '%s' type mismatch - expected %s, received %s",
+        BUILTIN_SYM_FFI_OPEN, ltype_name(LVAL_STRING), ltype_name(LVAL_EXPR_FIRST(args)->type));
+
+    const char *name = LVAL_EXPR_FIRST(args)->value.str_val;
+    void *handle = dlopen(*name ? name : 0, RTLD_NOW | RTLD_LOCAL);
+    LASSERT(args, handle, "function '%s' unable to open library - %s", BUILTIN_SYM_FFI_OPEN, dlerror());
+
+    struct ffi_lib *lib = malloc(sizeof(struct ffi_lib));
+    lib->refs = 1;
+    lib->handle = handle;
+    lib->name = strdup(name);
+
+    lval *rv = lval_ffi_lib(lib);
+    lval_del(args);
+    return rv;
+}
+
+/**
+ * Built-in function to look up a function in a library opened with ffi-open.
+ * Takes the library, the symbol name and a signature description.
+ */
+static lval *builtin_ffi_fn(lenv *env, lval *args)
+{
+    LASSERT_ENV(args, env, BUILTIN_SYM_FFI_FN);
+    LASSERT_NO_ERROR(args);
+    LASSERT(args, LVAL_EXPR_CNT(args) == 3, "function '%s' expects 3 arguments, received %d",
+        BUILTIN_SYM_FFI_FN, LVAL_EXPR_CNT(args));
+    LASSERT(args, LVAL_EXPR_FIRST(args)->type == LVAL_FFI_LIB,
+        "function '%s' type mismatch - expected %s, received %s",
+        BUILTIN_SYM_FFI_FN, ltype_name(LVAL_FFI_LIB), ltype_name(LVAL_EXPR_FIRST(args)->type));
+    LASSERT(args, lval_expr_item(args, 1)->type == LVAL_STRING && lval_expr_item(args, 2)->type == LVAL_STRING,
+        "function '%s' expects a symbol name and a signature string", BUILTIN_SYM_FFI_FN);
+
+    const char *name = lval_expr_item(args, 1)->value.str_val;
+    const char *desc = lval_expr_item(args, 2)->value.str_val;
+
+    struct ffi_sig *sig = ffi_sig_get(desc);
+    LASSERT(args, sig, "function '%s' invalid signature '%s'", BUILTIN_SYM_FFI_FN, desc);
+
+    struct ffi_lib *lib = LVAL_EXPR_FIRST(args)->value.ffi_lib;
+    void *fn = dlsym(lib->handle, name);
+    LASSERT(args, fn, "function '%s' symbol '%s' not found", BUILTIN_SYM_FFI_FN, name);
+
+    lval *rv = lval_ffi_fun(fn, sig, name, ffi_lib_ref(lib));
+    lval_del(args);
+    return rv;
+}
+
+const char *ffi_sig_desc(const struct ffi_sig *sig)
+{
+    return sig->desc;
+}
+
+struct ffi_lib *ffi_lib_ref(struct ffi_lib *lib)
+{
+    __atomic_add_fetch(&lib->refs, 1, __ATOMIC_RELAXED);
+    return lib;
+}
+
+void ffi_lib_del(struct ffi_lib *lib)
+{
+    if (__atomic_sub_fetch(&lib->refs, 1, __ATOMIC_ACQ_REL))
+    {
+        return;
+    }
+
+    dlclose(lib->handle);
+    free(lib->name);
+    free(lib);
+}
+
+const char *ffi_lib_name(const struct ffi_lib *lib)
+{
+    return lib->name;
+}
+
+bool ffi_lib_is_equal(const struct ffi_lib *x, const struct ffi_lib *y)
+{
+    // dlopen gives the same handle for a library opened more than once
+    return x->handle == y->handle;
+}
+
+void lenv_add_builtins_ffi(lenv *e)
+{
+    lenv_add_builtin(e, BUILTIN_SYM_FFI_OPEN, builtin_ffi_open);
+    lenv_add_builtin(e, BUILTIN_SYM_FFI_FN, builtin_ffi_fn);
+}
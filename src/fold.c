@@ -0,0 +1,710 @@
+/*
+ * Constant folding. When a function is created its body is partially evaluated:
+ * references to built-ins and to constants in the standard library are replaced
+ * by their values, and calls to side-effect free built-ins whose arguments are all
+ * constant are replaced by their results. Built-ins and the standard library cannot
+ * be redefined, but they can be shadowed -- by a definition in an interpreter or,
+ * with dynamic scoping, by a parameter of any calling function -- so the folded
+ * body records what it assumed and is only used while that still holds. Each name
+ * relied on is watched, and until one of them is bound outside the base
+ * environment a call uses the folded body without looking anything up.
+ *
+ * Calls to small standard library functions are inlined the same way, as long as
+ * the arguments are still evaluated once each and in order.
+ *
+ * Every function also keeps its full parameter list here, shared by its copies, so
+ * a call to itself in tail position can be recognised and made by rebinding the
+ * parameters rather than recursing.
+ *
+ * Parameters can be annotated with a type, as in {n:long}, and the result with a
+ * final :type. The interpreter checks the result type when the function returns;
+ * the native compiler also uses the parameter types to compile a version of the
+ * function that works on unboxed values.
+ */
+
+#include "lilith_int.h"
+#include "builtin_symbols.h"
+
+/**
+ * A binding a folded body relies on.
+ */
+typedef struct
+{
+    char *name;
+    const lval *value; // the binding in the base environment
+    const struct lenv_watch *watch;
+} fold_dep;
+
+struct lfun_opt
+{
+    unsigned refs;
+    lval *body;    // the folded body, or 0 if nothing was folded
+    lval *formals; // all of the parameters, or 0 if variadic
+    int ret;       // the annotated result type
+    fold_dep *deps;
+    size_t count;
+    unsigned epoch; // when none of the names relied on were last found bound elsewhere
+};
+
+typedef struct
+{
+    lenv *env;      // where the function is created
+    lval *formals;  // bound when the function is called, so never folded
+    struct lfun_opt *opt;
+    bool changed;
+} fold_ctx;
+
+#define FOLD_INLINE_SIZE 16  // the most nodes in a function body that is inlined
+#define FOLD_INLINE_DEPTH 4  // the most functions deep inlining looks
+
+/**
+ * The types a parameter or result can be annotated with.
+ */
+static const struct
+{
+    const char *name;
+    int type;
+} fold_types[] =
+{
+    { "long", LVAL_LONG }, { "double", LVAL_DOUBLE }, { "bool", LVAL_BOOL },
+    { "string", LVAL_STRING }, { "qexpr", LVAL_QEXPRESSION }
+};
+
+/**
+ * Built-ins that only compute a result from their arguments.
+ */
+static const char *fold_pure[] =
+{
+    "+", "-", "*", "/", "^", "%", "max", "min", ">", "<", ">=", "<=",
+    BUILTIN_SYM_EQ, BUILTIN_SYM_NOT, BUILTIN_SYM_LIST, BUILTIN_SYM_HEAD, BUILTIN_SYM_TAIL,
+    BUILTIN_SYM_JOIN, BUILTIN_SYM_LEN, BUILTIN_SYM_CONS, BUILTIN_SYM_INIT,
+    BUILTIN_SYM_IS_STRING, BUILTIN_SYM_IS_LONG, BUILTIN_SYM_IS_DOUBLE, BUILTIN_SYM_IS_BOOL,
+    BUILTIN_SYM_IS_QEXPR, BUILTIN_SYM_IS_SEXPR
+};
+
+static bool fold_is_pure(const char *name)
+{
+    for (size_t i = 0; i < sizeof(fold_pure) / sizeof(fold_pure[0]); i++)
+    {
+        if (!strcmp(fold_pure[i], name))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Values that evaluate to themselves.
+ */
+static bool fold_is_constant(const lval *v)
+{
+    return v->type == LVAL_LONG || v->type == LVAL_DOUBLE || v->type == LVAL_BOOL ||
+        v->type == LVAL_STRING || v->type == LVAL_QEXPRESSION;
+}
+
+/**
+ * Gets the position of a parameter, or -1 if the symbol is not one.
+ */
+static int fold_formal(const lval *formals, const char *name)
+{
+    int i = 0;
+    for (pair *ptr = formals->value.list.head; ptr; ptr = ptr->next, i++)
+    {
+        if (!strcmp(ptr->data->value.str_val, name))
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static struct lfun_opt *lfun_opt_new()
+{
+    struct lfun_opt *rv = calloc(1, sizeof(struct lfun_opt));
+    rv->refs = 1;
+    rv->ret = LTYPE_ANY;
+    rv->epoch = lenv_bind_epoch() - 1;
+    return rv;
+}
+
+static struct lfun_opt *fold_opt(fold_ctx *ctx)
+{
+    if (!ctx->opt)
+    {
+        ctx->opt = lfun_opt_new();
+    }
+
+    return ctx->opt;
+}
+
+/**
+ * Records a binding in the base environment as one the folded body relies on.
+ */
+static void fold_depend(fold_ctx *ctx, const char *name, const lval *v)
+{
+    struct lfun_opt *opt = fold_opt(ctx);
+    for (size_t i = 0; i < opt->count; i++)
+    {
+        if (!strcmp(opt->deps[i].name, name))
+        {
+            return;
+        }
+    }
+
+    opt->deps = realloc(opt->deps, sizeof(fold_dep) * (opt->count + 1));
+    opt->deps[opt->count++] = (fold_dep){ strdup(name), v, lenv_watch(name) };
+}
+
+/**
+ * Looks up a built-in or constant in the base environment, recording the binding
+ * as one the folded body relies on. Returns 0 if the symbol is not bound there, or
+ * is a parameter of the function or shadowed where the function is created.
+ */
+static const lval *fold_lookup(fold_ctx *ctx, const char *name)
+{
+    if (fold_formal(ctx->formals, name) >= 0)
+    {
+        return 0;
+    }
+
+    const lval *v = lenv_find_constant(ctx->env, name, false);
+    if (!v || (v->type != LVAL_BUILTIN_FUN && !fold_is_constant(v)))
+    {
+        return 0;
+    }
+
+    fold_depend(ctx, name, v);
+    return v;
+}
+
+/**
+ * How the body of a function that could be inlined uses its parameters.
+ */
+typedef struct
+{
+    fold_ctx *ctx;
+    lval *formals; // the parameters of the function being inlined
+    size_t *uses;  // times each parameter is evaluated
+    bool *early;   // evaluated before any call in the body returns
+    bool called;
+    size_t size;
+    int depth;
+} inline_scan;
+
+static const lval *fold_callee(fold_ctx *ctx, const char *name, inline_scan *rv, int depth);
+
+static bool inline_mentions(const lval *x, const lval *formals)
+{
+    if (x->type == LVAL_SYMBOL)
+    {
+        return fold_formal(formals, x->value.str_val) >= 0;
+    }
+
+    if (x->type == LVAL_SEXPRESSION || x->type == LVAL_QEXPRESSION)
+    {
+        for (pair *ptr = x->value.list.head; ptr; ptr = ptr->next)
+        {
+            if (inline_mentions(ptr->data, formals))
+            {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+static bool inline_check(inline_scan *scan, const lval *x);
+
+/**
+ * Checks a call in the body of a function could be made by its caller instead.
+ * Only built-ins without side effects, eval and other functions that can be
+ * inlined may be called -- anything else could see the parameters through
+ * dynamic scoping. That includes code given to eval, so eval may only be called
+ * on values that do not depend on the parameters.
+ */
+static bool inline_check_call(inline_scan *scan, const lval *x)
+{
+    if (!LVAL_EXPR_CNT(x))
+    {
+        return true;
+    }
+
+    const lval *head = LVAL_EXPR_FIRST(x);
+    if (head->type != LVAL_SYMBOL || fold_formal(scan->formals, head->value.str_val) >= 0)
+    {
+        return false;
+    }
+
+    const char *name = head->value.str_val;
+    const lval *fn = fold_lookup(scan->ctx, name);
+    if (fn ? fn->type != LVAL_BUILTIN_FUN || (!fold_is_pure(name) && strcmp(name, BUILTIN_SYM_EVAL))
+           : !fold_callee(scan->ctx, name, 0, scan->depth + 1))
+    {
+        return false;
+    }
+
+    for (pair *ptr = x->value.list.head->next; ptr; ptr = ptr->next)
+    {
+        if ((fn && !strcmp(name, BUILTIN_SYM_EVAL) && inline_mentions(ptr->data, scan->formals)) ||
+            !inline_check(scan, ptr->data))
+        {
+            return false;
+        }
+    }
+
+    scan->called = true;
+    return true;
+}
+
+static bool inline_check(inline_scan *scan, const lval *x)
+{
+    if (++scan->size > FOLD_INLINE_SIZE)
+    {
+        return false;
+    }
+
+    switch (x->type)
+    {
+    case LVAL_SYMBOL:
+    {
+        int i = fold_formal(scan->formals, x->value.str_val);
+        if (i >= 0)
+        {
+            scan->uses[i]++;
+            scan->early[i] = !scan->called;
+        }
+
+        return true;
+    }
+    case LVAL_SEXPRESSION:
+        return inline_check_call(scan, x);
+    case LVAL_QEXPRESSION:
+        // Data, but it could be passed to eval
+        return !inline_mentions(x, scan->formals);
+    }
+
+    return fold_is_constant(x);
+}
+
+/**
+ * Looks up a standard library function that can be inlined -- small, not variadic,
+ * not partially applied and only calling functions that can be inlined themselves,
+ * which rules out recursion.
+ *
+ * @param rv    populated with how the function uses its parameters, or 0 if not needed
+ * @param depth how many functions deep the check is
+ */
+static const lval *fold_callee(fold_ctx *ctx, const char *name, inline_scan *rv, int depth)
+{
+    if (depth > FOLD_INLINE_DEPTH || fold_formal(ctx->formals, name) >= 0)
+    {
+        return 0;
+    }
+
+    // Functions with an annotated result check it, which inlining would skip
+    const lval *f = lenv_find_constant(ctx->env, name, true);
+    if (!f || f->type != LVAL_USER_FUN || f->value.user_fun.scope || f->value.user_fun.native ||
+        !lenv_empty(f->value.user_fun.env) || fold_formal(f->value.user_fun.formals, "&") >= 0 ||
+        (f->value.user_fun.opt && f->value.user_fun.opt->ret != LTYPE_ANY))
+    {
+        return 0;
+    }
+
+    size_t count = LVAL_EXPR_CNT(f->value.user_fun.formals);
+    inline_scan scan = { ctx, f->value.user_fun.formals, calloc(count + 1, sizeof(size_t)),
+        calloc(count + 1, sizeof(bool)), false, 0, depth };
+
+    // The body is evaluated as an s-expression
+    bool ok = inline_check_call(&scan, f->value.user_fun.body);
+    if (ok)
+    {
+        fold_depend(ctx, name, f);
+    }
+
+    if (ok && rv)
+    {
+        *rv = scan;
+        return f;
+    }
+
+    free(scan.uses);
+    free(scan.early);
+    return ok ? f : 0;
+}
+
+/**
+ * Replaces the parameters evaluated in an expression with the arguments.
+ */
+static void inline_subst(lval *x, const lval *formals, lval **args)
+{
+    for (pair *ptr = x->value.list.head; ptr; ptr = ptr->next)
+    {
+        if (ptr->data->type == LVAL_SYMBOL)
+        {
+            int i = fold_formal(formals, ptr->data->value.str_val);
+            if (i >= 0)
+            {
+                lval_del(ptr->data);
+                ptr->data = lval_copy(args[i]);
+            }
+        }
+        else if (ptr->data->type == LVAL_SEXPRESSION)
+        {
+            inline_subst(ptr->data, formals, args);
+        }
+    }
+}
+
+/**
+ * Replaces a call to a small standard library function with its body, if that
+ * evaluates the arguments the same way -- each once and in order. Arguments that
+ * are themselves calls must be used once, before anything in the body returns.
+ */
+static lval *fold_inline(fold_ctx *ctx, lval *x)
+{
+    lval *head = LVAL_EXPR_FIRST(x);
+    inline_scan scan;
+    const lval *f = head->type == LVAL_SYMBOL ? fold_callee(ctx, head->value.str_val, &scan, 0) : 0;
+    if (!f)
+    {
+        return 0;
+    }
+
+    size_t count = LVAL_EXPR_CNT(scan.formals);
+    bool ok = LVAL_EXPR_CNT(x) == count + 1;
+    lval **args = calloc(count + 1, sizeof(lval*));
+
+    size_t i = 0, calls = 0;
+    for (pair *ptr = x->value.list.head->next; ok && ptr; ptr = ptr->next, i++)
+    {
+        lval *arg = args[i] = ptr->data;
+        if (!scan.uses[i])
+        {
+            // Not evaluated, so must not be able to fail
+            ok = fold_is_constant(arg) || arg->type == LVAL_BUILTIN_FUN;
+        }
+        else if (arg->type == LVAL_SEXPRESSION)
+        {
+            ok = scan.uses[i] == 1 && scan.early[i] && !calls++;
+        }
+        else
+        {
+            ok = fold_is_constant(arg) || arg->type == LVAL_BUILTIN_FUN || arg->type == LVAL_SYMBOL;
+        }
+    }
+
+    lval *rv = 0;
+    if (ok)
+    {
+        rv = lval_copy((lval*)f->value.user_fun.body);
+        rv->type = LVAL_SEXPRESSION;
+        inline_subst(rv, scan.formals, args);
+    }
+
+    free(args);
+    free(scan.uses);
+    free(scan.early);
+    return rv;
+}
+
+static lval *fold_expr(fold_ctx *ctx, lval *x);
+
+/**
+ * Folds code held in a q-expression, such as a function body or a branch of an if.
+ */
+static lval *fold_code(fold_ctx *ctx, lval *x)
+{
+    // Evaluated as an s-expression, which returns its only item
+    x->type = LVAL_SEXPRESSION;
+    x = fold_expr(ctx, x);
+    if (x->type == LVAL_SEXPRESSION)
+    {
+        x->type = LVAL_QEXPRESSION;
+        return x;
+    }
+
+    return lval_add(lval_qexpression(), x);
+}
+
+/**
+ * Folds the items of an expression, returning the result if it is a call to a
+ * pure built-in with constant arguments, otherwise 0. Branches of an if are code
+ * so are folded too; other q-expressions are data.
+ */
+static lval *fold_call(fold_ctx *ctx, lval *x)
+{
+    if (!LVAL_EXPR_CNT(x))
+    {
+        return 0;
+    }
+
+    lval *head = LVAL_EXPR_FIRST(x);
+    bool pure = false, branches = false;
+    if (head->type == LVAL_SYMBOL)
+    {
+        const lval *fn = fold_lookup(ctx, head->value.str_val);
+        if (fn && fn->type == LVAL_BUILTIN_FUN)
+        {
+            pure = fold_is_pure(head->value.str_val);
+            branches = !strcmp(head->value.str_val, BUILTIN_SYM_IF);
+        }
+    }
+
+    bool constant = true;
+    size_t i = 0;
+    for (pair *ptr = x->value.list.head; ptr; ptr = ptr->next, i++)
+    {
+        if (branches && i > 1 && ptr->data->type == LVAL_QEXPRESSION)
+        {
+            ptr->data = fold_code(ctx, ptr->data);
+        }
+        else
+        {
+            ptr->data = fold_expr(ctx, ptr->data);
+        }
+
+        constant = constant && (i == 0 || fold_is_constant(ptr->data));
+    }
+
+    if (!pure || !constant)
+    {
+        return 0;
+    }
+
+    lval *args = lval_sexpression();
+    for (pair *ptr = x->value.list.head->next; ptr; ptr = ptr->next)
+    {
+        lval_add(args, lval_copy(ptr->data));
+    }
+
+    // Errors are left to happen when the function is called
+    lval *rv = lval_call(ctx->env, LVAL_EXPR_FIRST(x), args);
+    if (!fold_is_constant(rv))
+    {
+        lval_del(rv);
+        return 0;
+    }
+
+    return rv;
+}
+
+static lval *fold_expr(fold_ctx *ctx, lval *x)
+{
+    if (x->type == LVAL_SYMBOL)
+    {
+        const lval *v = fold_lookup(ctx, x->value.str_val);
+        if (v)
+        {
+            lval_del(x);
+            ctx->changed = true;
+            return lval_copy((lval*)v);
+        }
+    }
+    else if (x->type == LVAL_SEXPRESSION)
+    {
+        lval *rv = fold_call(ctx, x);
+        if (!rv && LVAL_EXPR_CNT(x) && (rv = fold_inline(ctx, x)))
+        {
+            // The body may fold further with the arguments in place
+            rv = fold_expr(ctx, rv);
+        }
+
+        if (rv)
+        {
+            lval_del(x);
+            ctx->changed = true;
+            return rv;
+        }
+    }
+
+    return x;
+}
+
+int lfun_parse_formal(const char *formal, size_t *len)
+{
+    const char *sep = strchr(formal, ':');
+    *len = sep ? (size_t)(sep - formal) : strlen(formal);
+    if (!sep)
+    {
+        return LTYPE_ANY;
+    }
+
+    for (size_t i = 0; i < sizeof(fold_types) / sizeof(fold_types[0]); i++)
+    {
+        if (!strcmp(sep + 1, fold_types[i].name))
+        {
+            return fold_types[i].type;
+        }
+    }
+
+    return LTYPE_INVALID;
+}
+
+lval *lfun_annotate(lval *func)
+{
+    lval *formals = func->value.user_fun.formals;
+    lval *names = lval_qexpression();
+    int ret = LTYPE_ANY;
+    lval *err = 0;
+    while (!err && LVAL_EXPR_CNT(formals))
+    {
+        lval *sym = lval_pop(formals);
+        size_t len;
+        int type = lfun_parse_formal(sym->value.str_val, &len);
+        if (type == LTYPE_INVALID)
+        {
+            err = lval_error("function '%s' annotation invalid - unknown type in '%s'",
+                BUILTIN_SYM_LAMBDA, sym->value.str_val);
+        }
+        else if (type != LTYPE_ANY && !len)
+        {
+            // The result type comes last
+            if (LVAL_EXPR_CNT(formals))
+            {
+                err = lval_error("function '%s' annotation invalid - result type not last", BUILTIN_SYM_LAMBDA);
+            }
+
+            ret = type;
+        }
+        else if (type != LTYPE_ANY && len == 1 && sym->value.str_val[0] == '&')
+        {
+            err = lval_error("function '%s' annotation invalid - symbol '&' cannot have a type", BUILTIN_SYM_LAMBDA);
+        }
+        else
+        {
+            sym->value.str_val[len] = 0;
+            lval_add(names, sym);
+            continue;
+        }
+
+        lval_del(sym);
+    }
+
+    lval_del(formals);
+    func->value.user_fun.formals = names;
+    if (!err && ret != LTYPE_ANY)
+    {
+        func->value.user_fun.opt = lfun_opt_new();
+        func->value.user_fun.opt->ret = ret;
+    }
+
+    return err;
+}
+
+void lfun_fold(lenv *env, lval *func)
+{
+    fold_ctx ctx = { env, func->value.user_fun.formals, func->value.user_fun.opt, false };
+    lval *body = fold_code(&ctx, lval_copy(func->value.user_fun.body));
+    struct lfun_opt *opt = fold_opt(&ctx);
+    if (ctx.changed)
+    {
+        opt->body = body;
+    }
+    else
+    {
+        lval_del(body);
+    }
+
+    if (fold_formal(func->value.user_fun.formals, "&") < 0)
+    {
+        opt->formals = lval_copy(func->value.user_fun.formals);
+    }
+
+    func->value.user_fun.opt = opt;
+}
+
+lval *lfun_body(lval *func)
+{
+    struct lfun_opt *opt = func->value.user_fun.opt;
+    if (!opt || !opt->body)
+    {
+        return func->value.user_fun.body;
+    }
+
+    // Nothing relied on has been bound elsewhere since it was last checked
+    unsigned epoch = lenv_bind_epoch();
+    if (__atomic_load_n(&opt->epoch, __ATOMIC_RELAXED) == epoch)
+    {
+        return opt->body;
+    }
+
+    // Only names bound outside the base environment need looking up again
+    bool bound = false;
+    for (size_t i = 0; i < opt->count; i++)
+    {
+        if (lenv_watch_bound(opt->deps[i].watch))
+        {
+            bound = true;
+            if (lenv_find_raw(func->value.user_fun.env, opt->deps[i].name) != opt->deps[i].value)
+            {
+                return func->value.user_fun.body;
+            }
+        }
+    }
+
+    if (!bound)
+    {
+        __atomic_store_n(&opt->epoch, epoch, __ATOMIC_RELAXED);
+    }
+
+    return opt->body;
+}
+
+const lval *lfun_formals(const lval *func)
+{
+    return func->value.user_fun.opt ? func->value.user_fun.opt->formals : 0;
+}
+
+lval *lfun_check_type(int type, lval *rv)
+{
+    if (type == LTYPE_ANY || rv->type == LVAL_ERROR || (int)rv->type == type)
+    {
+        return rv;
+    }
+
+    lval *err = lval_error("function result type mismatch - expected %s, received %s",
+        ltype_name(type), ltype_name(rv->type));
+    lval_del(rv);
+    return err;
+}
+
+lval *lfun_return(const lval *func, lval *rv)
+{
+    return func->value.user_fun.opt ? lfun_check_type(func->value.user_fun.opt->ret, rv) : rv;
+}
+
+struct lfun_opt *lfun_opt_ref(struct lfun_opt *opt)
+{
+    __atomic_add_fetch(&opt->refs, 1, __ATOMIC_RELAXED);
+    return opt;
+}
+
+void lfun_opt_del(struct lfun_opt *opt)
+{
+    if (__atomic_sub_fetch(&opt->refs, 1, __ATOMIC_ACQ_REL))
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < opt->count; i++)
+    {
+        free(opt->deps[i].name);
+    }
+
+    if (opt->body)
+    {
+        lval_del(opt->body);
+    }
+
+    if (opt->formals)
+    {
+        lval_del(opt->formals);
+    }
+
+    free(opt->deps);
+    free(opt);
+}
@@ -0,0 +1,301 @@
+/*
+ * Aggregation by key. (group-by f l), (count-by f l), (sum-by f g l) and
+ * (reduce-by f g z l) call f on each item of l to get its key and accumulate the
+ * items with the same key in one pass, using a hash table of the keys seen so far.
+ * The result is a list of {key value} pairs in the order the keys were first seen.
+ */
+
+#include "lilith_int.h"
+#include "builtin_symbols.h"
+
+/**
+ * How the items with the same key are accumulated.
+ */
+enum
+{
+    GROUP_ITEMS,  // the items themselves
+    GROUP_COUNT,  // how many there are
+    GROUP_SUM,    // the sum of g of each item
+    GROUP_REDUCE  // g of the value so far and each item, starting from z
+};
+
+typedef struct
+{
+    uint64_t hash;
+    lval *key;
+    lval *value; // accumulated so far, or 0 for a new key
+    pair **last; // the end of the items, when collecting them
+} group_entry;
+
+typedef struct
+{
+    group_entry *entries; // in the order the keys were first seen
+    size_t count;
+    size_t *slots;        // the index of an entry plus 1, or 0 if empty
+    size_t mask;
+} group_table;
+
+#define GROUP_INITIAL_SLOTS 16
+
+/**
+ * Hashes a key so that keys lval_is_equal finds equal hash the same. Unlike
+ * lval_hash that means 1 and 1.0 do, so numbers are hashed by their value as a
+ * double.
+ */
+static uint64_t group_hash(const lval *v, uint64_t seed)
+{
+    unsigned char type = v->type;
+    switch (v->type)
+    {
+    case LVAL_LONG:
+    case LVAL_DOUBLE:
+    {
+        type = LVAL_DOUBLE;
+        double num = v->type == LVAL_LONG ? (double)v->value.num_l : v->value.num_d;
+        num = num == 0 ? 0 : num; // -0.0 is equal to 0.0
+        return lilith_hash(&num, sizeof(double), lilith_hash(&type, 1, seed));
+    }
+    case LVAL_SEXPRESSION:
+    case LVAL_QEXPRESSION:
+    {
+        uint64_t rv = lilith_hash(&type, 1, seed);
+        rv = lilith_hash(&LVAL_EXPR_CNT(v), sizeof(LVAL_EXPR_CNT(v)), rv);
+        for (pair *ptr = v->value.list.head; ptr; ptr = ptr->next)
+        {
+            rv = group_hash(ptr->data, rv);
+        }
+
+        return rv;
+    }
+    default:
+        return lval_hash(v, seed);
+    }
+}
+
+/**
+ * Finds the entry for a key, adding one if the key is new. Consumes the key.
+ */
+static group_entry *group_find(group_table *t, lval *key)
+{
+    uint64_t hash = group_hash(key, LILITH_HASH_SEED);
+    size_t i = hash & t->mask;
+    for (; t->slots[i]; i = (i + 1) & t->mask)
+    {
+        group_entry *e = &t->entries[t->slots[i] - 1];
+        if (e->hash == hash && lval_is_equal(e->key, key))
+        {
+            lval_del(key);
+            return e;
+        }
+    }
+
+    t->entries = realloc(t->entries, sizeof(group_entry) * (t->count + 1));
+    t->entries[t->count] = (group_entry){ hash, key, 0, 0 };
+    t->slots[i] = ++t->count;
+
+    // Kept at most half full
+    if (t->count * 2 > t->mask)
+    {
+        t->mask = t->mask * 2 + 1;
+        free(t->slots);
+        t->slots = calloc(t->mask + 1, sizeof(size_t));
+        for (size_t n = 0; n < t->count; n++)
+        {
+            size_t j = t->entries[n].hash & t->mask;
+            while (t->slots[j])
+            {
+                j = (j + 1) & t->mask;
+            }
+
+            t->slots[j] = n + 1;
+        }
+    }
+
+    return &t->entries[t->count - 1];
+}
+
+/**
+ * Calls a function with the arguments given, which it consumes.
+ */
+static lval *group_call(lenv *env, lval *f, lval *args)
+{
+    lval *fn = lval_copy(f);
+    lval *rv = lval_call(env, fn, args);
+    lval_del(fn);
+    return rv;
+}
+
+/**
+ * Adds an item to the value accumulated for its key. Consumes the item.
+ * Returns an error, or 0.
+ */
+static lval *group_add(lenv *env, int mode, lval *args, group_entry *e, lval *item)
+{
+    switch (mode)
+    {
+    case GROUP_ITEMS:
+        if (!e->value)
+        {
+            e->value = lval_qexpression();
+            e->last = &e->value->value.list.head;
+        }
+
+        *e->last = malloc(sizeof(pair));
+        (*e->last)->data = item;
+        (*e->last)->next = 0;
+        e->last = &(*e->last)->next;
+        LVAL_EXPR_CNT(e->value)++;
+        return 0;
+    case GROUP_COUNT:
+        lval_del(item);
+        if (!e->value)
+        {
+            e->value = lval_long(0);
+        }
+
+        e->value->value.num_l++;
+        return 0;
+    case GROUP_SUM:
+    {
+        lval *v = group_call(env, lval_expr_item(args, 1), lval_add(lval_sexpression(), item));
+        if (v->type == LVAL_ERROR)
+        {
+            return v;
+        }
+
+        e->value = e->value ? call_builtin(env, "+", lval_add(lval_add(lval_sexpression(), e->value), v)) : v;
+        break;
+    }
+    default:
+    {
+        lval *acc = e->value ? e->value : lval_copy(lval_expr_item(args, 2));
+        e->value = group_call(env, lval_expr_item(args, 1), lval_add(lval_add(lval_sexpression(), acc), item));
+        break;
+    }
+    }
+
+    if (e->value->type == LVAL_ERROR)
+    {
+        lval *err = e->value;
+        e->value = 0;
+        return err;
+    }
+
+    return 0;
+}
+
+/**
+ * Groups the items of the last argument by key, the result of the function in the
+ * first argument, accumulating them as the mode says.
+ */
+static lval *group_by(lenv *env, lval *args, int mode, const char *symbol)
+{
+    static const size_t expected[] = { 2, 2, 3, 4 };
+
+    LASSERT_ENV(args, env, symbol);
+    LASSERT_NO_ERROR(args);
+    LASSERT(args, LVAL_EXPR_CNT(args) == expected[mode], "function '%s' expects %d arguments, received %d",
+        symbol, expected[mode], LVAL_EXPR_CNT(args));
+
+    for (size_t i = 0; i < (mode >= GROUP_SUM ? 2 : 1); i++)
+    {
+        lval *f = lval_expr_item(args, i);
+        LASSERT(args, f->type == LVAL_BUILTIN_FUN || f->type == LVAL_USER_FUN || f->type == LVAL_FFI_FUN,
+            "function '%s' type mismatch - expected function, received %s", symbol, ltype_name(f->type));
+    }
+
+    lval *l = lval_expr_item(args, expected[mode] - 1);
+    LASSERT(args, l->type == LVAL_QEXPRESSION, "function '%s' type mismatch - expected %s, received %s",
+        symbol, ltype_name(LVAL_QEXPRESSION), ltype_name(l->type));
+
+    group_table t = { 0, 0, calloc(GROUP_INITIAL_SLOTS, sizeof(size_t)), GROUP_INITIAL_SLOTS - 1 };
+    lval *err = 0;
+    while (!err && LVAL_EXPR_CNT(l))
+    {
+        lval *item = lval_pop(l);
+        lval *key = group_call(env, LVAL_EXPR_FIRST(args), lval_add(lval_sexpression(), lval_copy(item)));
+        if (key->type == LVAL_ERROR)
+        {
+            lval_del(item);
+            err = key;
+            continue;
+        }
+
+        err = group_add(env, mode, args, group_find(&t, key), item);
+    }
+
+    // The pairs are built in place from the keys and values
+    lval *rv = lval_qexpression();
+    pair **last = &rv->value.list.head;
+    for (size_t i = 0; i < t.count; i++)
+    {
+        group_entry *e = &t.entries[i];
+        if (err || !e->value)
+        {
+            lval_del(e->key);
+            if (e->value)
+            {
+                lval_del(e->value);
+            }
+
+            continue;
+        }
+
+        *last = malloc(sizeof(pair));
+        (*last)->data = lval_add(lval_add(lval_qexpression(), e->key), e->value);
+        (*last)->next = 0;
+        last = &(*last)->next;
+        LVAL_EXPR_CNT(rv)++;
+    }
+
+    free(t.entries);
+    free(t.slots);
+    lval_del(args);
+    if (err)
+    {
+        lval_del(rv);
+        return err;
+    }
+
+    return rv;
+}
+
+/**
+ * Built-in function to collect the items of a list with the same key.
+ */
+static lval *builtin_group_by(lenv *env, lval *args)
+{
+    return group_by(env, args, GROUP_ITEMS, BUILTIN_SYM_GROUP_BY);
+}
+
+/**
+ * Built-in function to count the items of a list with each key.
+ */
+static lval *builtin_count_by(lenv *env, lval *args)
+{
+    return group_by(env, args, GROUP_COUNT, BUILTIN_SYM_COUNT_BY);
+}
+
+/**
+ * Built-in function to sum a function of the items of a list with each key.
+ */
+static lval *builtin_sum_by(lenv *env, lval *args)
+{
+    return group_by(env, args, GROUP_SUM, BUILTIN_SYM_SUM_BY);
+}
+
+/**
+ * Built-in function to fold the items of a list with each key, as foldl does.
+ */
+static lval *builtin_reduce_by(lenv *env, lval *args)
+{
+    return group_by(env, args, GROUP_REDUCE, BUILTIN_SYM_REDUCE_BY);
+}
+
+void lenv_add_builtins_group(lenv *e)
+{
+    lenv_add_builtin(e, BUILTIN_SYM_GROUP_BY, builtin_group_by);
+    lenv_add_builtin(e, BUILTIN_SYM_COUNT_BY, builtin_count_by);
+    lenv_add_builtin(e, BUILTIN_SYM_SUM_BY, builtin_sum_by);
+    lenv_add_builtin(e, BUILTIN_SYM_REDUCE_BY, builtin_reduce_by);
+}
@@ -2,6 +2,8 @@
  * Maintains the Lisp Environment -- the function lookup table.
  */
 
+#include <ctype.h>
+#include <pthread.h>
 #include <collections.h>
 #include "lilith_int.h"
 
@@ -15,10 +17,328 @@ struct lenv
 {
     lenv *parent;
     void *table;
+    bool overlay; // a forked environment -- definitions stop here rather than reaching the parent
+    bool frozen;  // a shared environment -- bindings can no longer be added or replaced
+    lout *out;    // where printed output goes, inherited from the parent if not set
+    lout *err;    // where diagnostics go, inherited from the parent if not set
+    void *modules;         // modules loaded by require
+    struct module *module; // the module this is the namespace of
+    bool base;             // builds the shared base environment -- its bindings shadow nothing
 };
 
+/**
+ * A base environment binding that folded code may rely on, flagged the first time
+ * its name is bound anywhere else. There is one for every name in the base
+ * environment, made as it is loaded and so before anything else is bound, kept for
+ * the life of the process and chained by the hash of the name.
+ */
+struct lenv_watch
+{
+    char *name;
+    bool bound;
+    struct lenv_watch *next;
+};
+
+#define WATCH_SLOTS 1024
+static struct lenv_watch *watches[WATCH_SLOTS];
+
+/**
+ * The first two characters of the watched names, as a bitmap, so binding any other
+ * name needs no hashing.
+ */
+static unsigned char watch_prefixes[65536 / 8];
+
+static unsigned watch_prefix(const char *key)
+{
+    return (unsigned char)key[0] << 8 | (key[0] ? (unsigned char)key[1] : 0);
+}
+
+/**
+ * Counts the watched names that have been bound outside the base environment.
+ */
+static unsigned bind_epoch;
+
+/**
+ * The built-ins and standard library, loaded once and shared by every interpreter.
+ */
+static lenv *base_env;
+static pthread_once_t base_env_once = PTHREAD_ONCE_INIT;
+
+/**
+ * A standard library definition that has not been evaluated. The source of the
+ * form is kept and evaluated the first time one of the names it defines is looked up.
+ */
+struct lazy_def
+{
+    lenv *env;       // the environment the definition belongs to
+    const char *src; // the form, in the statically linked standard library
+    size_t len;
+    char **names;    // the names the form defines
+    size_t count;
+    bool defun;      // defines a function rather than values
+    bool busy;       // being evaluated -- its names are unbound until it finishes
+    struct lazy_def *next;
+};
+
+/**
+ * Every deferred definition. Kept for the life of the process as definitions are
+ * shared by the placeholders of all their names.
+ */
+static struct lazy_def *lazy_defs;
+
+/**
+ * Serialises evaluation of deferred definitions. Recursive because evaluating
+ * one definition looks up, and so evaluates, the definitions it uses.
+ */
+static pthread_mutex_t lazy_lock;
+
+/**
+ * Skips whitespace and comments in Lilith source.
+ */
+static const char *skip_space(const char *pos)
+{
+    for (;;)
+    {
+        while (isspace((unsigned char)*pos))
+        {
+            pos++;
+        }
+
+        if (*pos != ';')
+        {
+            return pos;
+        }
+
+        while (*pos && *pos != '\n')
+        {
+            pos++;
+        }
+    }
+}
+
+/**
+ * Finds the end of the top-level form starting at pos. Stops at the end of the
+ * text if the brackets do not balance; the reader reports the error.
+ */
+static const char *form_end(const char *pos)
+{
+    int depth = 0;
+    do
+    {
+        switch (*pos)
+        {
+        case '(':
+        case '{':
+            depth++;
+            break;
+        case ')':
+        case '}':
+            depth--;
+            break;
+        case ';':
+            while (pos[1] && pos[1] != '\n')
+            {
+                pos++;
+            }
+            break;
+        case '"':
+            while (pos[1] && pos[1] != '"')
+            {
+                pos += pos[1] == '\\' && pos[2] ? 2 : 1;
+            }
+
+            if (pos[1])
+            {
+                pos++;
+            }
+            break;
+        default:
+            if (!depth)
+            {
+                // A bare atom
+                while (pos[1] && !isspace((unsigned char)pos[1]) && !strchr("(){};\"", pos[1]))
+                {
+                    pos++;
+                }
+            }
+        }
+
+        pos++;
+    } while (*pos && depth > 0);
+
+    return pos;
+}
+
+/**
+ * Reads a symbol from the header of a definition.
+ */
+static char *read_name(const char **pos)
+{
+    const char *start = *pos = skip_space(*pos);
+    while (**pos && !isspace((unsigned char)**pos) && !strchr("(){};\"", **pos))
+    {
+        (*pos)++;
+    }
+
+    return *pos > start ? strndup(start, *pos - start) : 0;
+}
+
+/**
+ * Gets the names defined by a top-level form -- all of the names of
+ * (def {names...} values...) and the first name of (defun {name args...} body).
+ * Returns 0 for any other form.
+ */
+static struct lazy_def *lazy_def_new(lenv *env, const char *src, size_t len)
+{
+    const char *pos = skip_space(src + 1);
+    bool all;
+    if (*src != '(')
+    {
+        return 0;
+    }
+    else if (!strncmp(pos, "def", 3) && isspace((unsigned char)pos[3]))
+    {
+        all = true;
+    }
+    else if (!strncmp(pos, "defun", 5) && isspace((unsigned char)pos[5]))
+    {
+        all = false;
+    }
+    else
+    {
+        return 0;
+    }
+
+    pos = skip_space(pos + (all ? 3 : 5));
+    if (*pos++ != '{')
+    {
+        return 0;
+    }
+
+    struct lazy_def *rv = calloc(1, sizeof(struct lazy_def));
+    rv->env = env;
+    rv->src = src;
+    rv->len = len;
+    rv->defun = !all;
+
+    char *name;
+    while ((name = read_name(&pos)))
+    {
+        rv->names = realloc(rv->names, sizeof(char*) * (rv->count + 1));
+        rv->names[rv->count++] = name;
+        if (!all)
+        {
+            break;
+        }
+    }
+
+    if (!rv->count || (all && *skip_space(pos) != '}'))
+    {
+        for (size_t i = 0; i < rv->count; i++)
+        {
+            free(rv->names[i]);
+        }
+
+        free(rv->names);
+        free(rv);
+        return 0;
+    }
+
+    rv->next = lazy_defs;
+    lazy_defs = rv;
+    return rv;
+}
+
+/**
+ * Binds each name of a deferred definition to a placeholder. Names already bound
+ * to a placeholder by an earlier definition are pointed at the later one.
+ */
+static void lazy_def_bind(struct lazy_def *def)
+{
+    for (size_t i = 0; i < def->count; i++)
+    {
+        lval *v;
+        if (hash_table_get(def->env->table, def->names[i], (void**)&v) == C_OK)
+        {
+            if (v->type == LVAL_LAZY)
+            {
+                v->value.lazy = def;
+            }
+
+            continue;
+        }
+
+        hash_table_add(def->env->table, strdup(def->names[i]), lval_lazy(def));
+    }
+}
+
+void lval_force(lval *v)
+{
+    if (__atomic_load_n(&v->type, __ATOMIC_ACQUIRE) != LVAL_LAZY)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&lazy_lock);
+    if (v->type != LVAL_LAZY || v->value.lazy->busy)
+    {
+        // Evaluated by another thread while waiting, or refers to itself
+        pthread_mutex_unlock(&lazy_lock);
+        return;
+    }
+
+    // A suspended or cancelled task would leave the definition half evaluated
+    lilith_task *task = task_current;
+    task_current = 0;
+
+    struct lazy_def *def = v->value.lazy;
+    def->busy = true;
+    lenv *scratch = lilith_env_fork(def->env);
+    scratch->base = true;
+    char *src = strndup(def->src, def->len);
+    lval *x = multi_eval(scratch, lilith_read_from_string(src));
+    free(src);
+
+    for (size_t i = 0; i < def->count; i++)
+    {
+        lval *p;
+        if (hash_table_get(def->env->table, def->names[i], (void**)&p) != C_OK ||
+            p->type != LVAL_LAZY || p->value.lazy != def)
+        {
+            continue;
+        }
+
+        lval *val;
+        if (x->type == LVAL_ERROR)
+        {
+            val = lval_copy(x);
+        }
+        else if (hash_table_get(scratch->table, def->names[i], (void**)&val) == C_OK)
+        {
+            val = lval_copy(val);
+        }
+        else
+        {
+            val = lval_error("standard library does not define '%s'", def->names[i]);
+        }
+
+        // Fill in the placeholder so anything holding it sees the value
+        p->value = val->value;
+        __atomic_store_n(&p->type, val->type, __ATOMIC_RELEASE);
+        free(val);
+    }
+
+    def->busy = false;
+    lval_del(x);
+    lenv_del(scratch);
+    task_current = task;
+    pthread_mutex_unlock(&lazy_lock);
+}
+
 /**
  * Loads the statically linked Lilith standard library in to the environment.
+ * Definitions are indexed by name and evaluated when first looked up; any other
+ * top-level expression is evaluated straight away.
  */
 static lval *load_std_lib(lenv *env)
 {
@@ -28,8 +348,37 @@ static lval *load_std_lib(lenv *env)
     char *stdlib = &stdlib_llth_start;
 #endif
 
-    lval *expr = lilith_read_from_string(stdlib);
-    return multi_eval(env, expr);
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&lazy_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    lval *rv = lval_sexpression();
+    for (const char *pos = skip_space(stdlib); *pos; pos = skip_space(pos))
+    {
+        const char *end = form_end(pos);
+        struct lazy_def *def = lazy_def_new(env, pos, end - pos);
+        if (def)
+        {
+            lazy_def_bind(def);
+        }
+        else
+        {
+            char *src = strndup(pos, end - pos);
+            lval_del(rv);
+            rv = multi_eval(env, lilith_read_from_string(src));
+            free(src);
+            if (rv->type == LVAL_ERROR)
+            {
+                return rv;
+            }
+        }
+
+        pos = end;
+    }
+
+    return rv;
 }
 
 lenv *lenv_new()
@@ -56,20 +405,201 @@ void lenv_del(lenv *e)
 
     clxns_iter_free(iter);
     clxns_free(e->table, 0);
+
+    if (e->modules)
+    {
+        module_registry_del(e->modules);
+    }
+
+    if (e->out)
+    {
+        lout_del(e->out);
+    }
+
+    if (e->err)
+    {
+        lout_del(e->err);
+    }
+
     free(e);
 }
 
-lval *lenv_get(lenv *e, lval *k)
+lval *lenv_find_raw(lenv *e, const char *key)
 {
     lval *rv;
-    if (hash_table_get(e->table, k->value.str_val, (void**)&rv) == C_OK)
+    for (; e; e = e->parent)
     {
-        return lval_copy(rv);
+        if (hash_table_get(e->table, key, (void**)&rv) == C_OK)
+        {
+            return rv;
+        }
+    }
+
+    return 0;
+}
+
+lval *lenv_find(lenv *e, const char *key)
+{
+    lval *rv = lenv_find_raw(e, key);
+    if (rv)
+    {
+        lval_force(rv);
+        if (rv->type == LVAL_LAZY)
+        {
+            return 0;
+        }
+    }
+
+    return rv;
+}
+
+lval *lenv_find_constant(lenv *e, const char *key, bool functions)
+{
+    lval *rv;
+    for (; e; e = e->parent)
+    {
+        if (hash_table_get(e->table, key, (void**)&rv) == C_OK)
+        {
+            break;
+        }
+    }
+
+    if (!e || !e->frozen)
+    {
+        return 0;
     }
 
-    if (e->parent)
+    // Deferred values are cheap to evaluate; deferred functions are left until called unless asked for
+    if (rv->type == LVAL_LAZY && (functions || !rv->value.lazy->defun))
     {
-        return lenv_get(e->parent, k);
+        lval_force(rv);
+    }
+
+    return rv->type == LVAL_LAZY ? 0 : rv;
+}
+
+lval *lenv_find_cell(lenv *e, const char *key, bool *shared)
+{
+    lval *rv;
+    for (; e; e = e->parent)
+    {
+        if (hash_table_get(e->table, key, (void**)&rv) == C_OK)
+        {
+            *shared = e->frozen;
+            lval_force(rv);
+            return rv->type == LVAL_LAZY ? 0 : rv;
+        }
+    }
+
+    return 0;
+}
+
+bool lenv_empty(lenv *e)
+{
+    return clxns_count(e->table) == 0;
+}
+
+size_t lenv_count(lenv *e)
+{
+    return clxns_count(e->table);
+}
+
+bool lenv_rebind(lenv *e, const char *key, lval *v)
+{
+    lval *ptr;
+    if (hash_table_get(e->table, key, (void**)&ptr) != C_OK)
+    {
+        lval_del(v);
+        return false;
+    }
+
+    // Swap the contents so the old value is freed with the holder of the new one
+    lval old = *ptr;
+    *ptr = *v;
+    *v = old;
+    lval_del(v);
+    return true;
+}
+
+static struct lenv_watch *lenv_watch_find(const char *key)
+{
+    struct lenv_watch *w = watches[lilith_hash(key, strlen(key), LILITH_HASH_SEED) % WATCH_SLOTS];
+    while (w && strcmp(w->name, key))
+    {
+        w = w->next;
+    }
+
+    return w;
+}
+
+/**
+ * Watches every name in the base environment. Called once as it is loaded, before
+ * it is shared.
+ */
+static void lenv_watch_all(lenv *base)
+{
+    void *iter = clxns_iter_new(base->table);
+    while (clxns_iter_move_next(iter))
+    {
+        kvp *val = clxns_iter_get_next(iter);
+        unsigned slot = lilith_hash(val->key, strlen(val->key), LILITH_HASH_SEED) % WATCH_SLOTS;
+        struct lenv_watch *w = malloc(sizeof(struct lenv_watch));
+        w->name = strdup(val->key);
+        w->bound = false;
+        w->next = watches[slot];
+        watches[slot] = w;
+
+        unsigned prefix = watch_prefix(val->key);
+        watch_prefixes[prefix / 8] |= 1 << (prefix % 8);
+    }
+
+    clxns_iter_free(iter);
+}
+
+/**
+ * Flags the watch on a name, if there is one, as the name is now bound outside the
+ * base environment.
+ */
+static void lenv_watch_bind(const char *key)
+{
+    unsigned prefix = watch_prefix(key);
+    if (!(watch_prefixes[prefix / 8] & (1 << (prefix % 8))))
+    {
+        return;
+    }
+
+    struct lenv_watch *w = lenv_watch_find(key);
+    if (w && !__atomic_load_n(&w->bound, __ATOMIC_RELAXED))
+    {
+        __atomic_store_n(&w->bound, true, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&bind_epoch, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+struct lenv_watch *lenv_watch(const char *key)
+{
+    // Not in the base environment, so nothing can be assumed about it
+    static struct lenv_watch unknown = { "", true, 0 };
+    struct lenv_watch *w = lenv_watch_find(key);
+    return w ? w : &unknown;
+}
+
+bool lenv_watch_bound(const struct lenv_watch *w)
+{
+    return __atomic_load_n(&w->bound, __ATOMIC_ACQUIRE);
+}
+
+unsigned lenv_bind_epoch(void)
+{
+    return __atomic_load_n(&bind_epoch, __ATOMIC_ACQUIRE);
+}
+
+lval *lenv_get(lenv *e, lval *k)
+{
+    lval *rv = lenv_find(e, k->value.str_val);
+    if (rv)
+    {
+        return lval_copy(rv);
     }
 
     return lval_error("unbound symbol '%s'", k->value.str_val);
@@ -77,23 +607,47 @@ lval *lenv_get(lenv *e, lval *k)
 
 bool lenv_put(lenv *e, lval *k, lval *v)
 {
+    if (e->frozen)
+    {
+        return true;
+    }
+
     lval *ptr;
     if (hash_table_get(e->table, k->value.str_val, (void**)&ptr) == C_OK && ptr->type == LVAL_BUILTIN_FUN)
     {
         return true;
     }
 
+    if (!e->base)
+    {
+        lenv_watch_bind(k->value.str_val);
+    }
+
     hash_table_add(e->table, strdup(k->value.str_val), lval_copy(v));
     return false;
 }
 
-bool lenv_def(lenv *e, lval *k, lval *v)
+lenv *lenv_root(lenv *e)
 {
-    while (e->parent)
+    while (e->parent && !e->overlay)
     {
         e = e->parent;
     }
 
+    return e;
+}
+
+bool lenv_def(lenv *e, lval *k, lval *v)
+{
+    e = lenv_root(e);
+
+    // Built-ins in the base of a fork cannot be shadowed
+    lval *ptr = lenv_find_raw(e, k->value.str_val);
+    if (ptr && ptr->type == LVAL_BUILTIN_FUN)
+    {
+        return true;
+    }
+
     return lenv_put(e, k, v);
 }
 
@@ -101,6 +655,13 @@ lenv *lenv_copy(lenv *e)
 {
     lenv *rv = malloc(sizeof(lenv));
     rv->parent = e->parent;
+    rv->overlay = e->overlay;
+    rv->frozen = false;
+    rv->out = 0;
+    rv->err = 0;
+    rv->modules = 0;
+    rv->module = 0;
+    rv->base = false;
     rv->table = hash_table(clxns_count(e->table));
 
     void *iter = clxns_iter_new(e->table);
@@ -114,40 +675,333 @@ lenv *lenv_copy(lenv *e)
     return rv; 
 }
 
+lenv *lenv_module_new(lenv *parent, struct module *module)
+{
+    lenv *env = lilith_env_fork(parent);
+    env->module = module;
+    return env;
+}
+
+struct module *lenv_module(lenv *e)
+{
+    return lenv_root(e)->module;
+}
+
+void **lenv_modules(lenv *e)
+{
+    // Modules belong to the interpreter, not to the namespaces of other modules
+    e = lenv_root(e);
+    while (e->module)
+    {
+        e = lenv_root(e->parent);
+    }
+
+    return &e->modules;
+}
+
+/**
+ * Defines a single binding from a module in another environment.
+ */
+static bool lenv_import_one(lenv *to, lenv *from, lval *k, lval *v)
+{
+    if (v->type != LVAL_USER_FUN)
+    {
+        return lenv_def(to, k, v);
+    }
+
+    lval *f = lval_copy(v);
+    f->value.user_fun.scope = from;
+    bool rv = lenv_def(to, k, f);
+    lval_del(f);
+    return rv;
+}
+
+lval *lenv_import(lenv *to, lenv *from, lval *names)
+{
+    lval *rv = 0;
+    if (names)
+    {
+        for (pair *ptr = names->value.list.head; ptr && !rv; ptr = ptr->next)
+        {
+            lval *v;
+            if (hash_table_get(from->table, ptr->data->value.str_val, (void**)&v) != C_OK)
+            {
+                rv = lval_error("module does not define '%s'", ptr->data->value.str_val);
+            }
+            else if (lenv_import_one(to, from, ptr->data, v))
+            {
+                rv = lval_error("symbol '%s' is a built-in", ptr->data->value.str_val);
+            }
+        }
+
+        return rv;
+    }
+
+    void *iter = clxns_iter_new(from->table);
+    while (!rv && clxns_iter_move_next(iter))
+    {
+        kvp *val = clxns_iter_get_next(iter);
+        lval *k = lval_symbol(val->key);
+        if (lenv_import_one(to, from, k, val->value))
+        {
+            rv = lval_error("symbol '%s' is a built-in", val->key);
+        }
+
+        lval_del(k);
+    }
+
+    clxns_iter_free(iter);
+    return rv;
+}
+
+lval *lenv_find_local(lenv *e, const char *key)
+{
+    lval *rv;
+    for (lenv *root = lenv_root(e); e != root; e = e->parent)
+    {
+        if (hash_table_get(e->table, key, (void**)&rv) == C_OK)
+        {
+            return rv;
+        }
+    }
+
+    return 0;
+}
+
+lval *lenv_own(lenv *e, const char *key)
+{
+    lval *rv;
+    return hash_table_get(e->table, key, (void**)&rv) == C_OK ? rv : 0;
+}
+
+
+/**
+ * Checks whether a name is bound in an environment seen before another one
+ * when listing its bindings.
+ */
+static bool lenv_shadowed(lenv *e, lenv *from, const char *key)
+{
+    lval *v;
+    for (; e != from; e = e->parent)
+    {
+        if (hash_table_get(e->table, key, (void**)&v) == C_OK)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+lval *lenv_view_find(lenv *env, const char *key)
+{
+    lval *rv;
+    for (lenv *e = env; e; e = e->overlay ? e->parent : 0)
+    {
+        if (hash_table_get(e->table, key, (void**)&rv) == C_OK)
+        {
+            return rv;
+        }
+    }
+
+    return 0;
+}
+
+lval *lenv_keys(lenv *env)
+{
+    lval *rv = lval_qexpression();
+    pair **last = &rv->value.list.head;
+
+    for (lenv *e = env; e; e = e->overlay ? e->parent : 0)
+    {
+        void *iter = clxns_iter_new(e->table);
+        while (clxns_iter_move_next(iter))
+        {
+            kvp *val = clxns_iter_get_next(iter);
+            if (e != env && lenv_shadowed(env, e, val->key))
+            {
+                continue;
+            }
+
+            *last = malloc(sizeof(pair));
+            (*last)->data = lval_string(val->key);
+            (*last)->next = 0;
+            last = &(*last)->next;
+            LVAL_EXPR_CNT(rv)++;
+        }
+
+        clxns_iter_free(iter);
+    }
+
+    return rv;
+}
+
+size_t lenv_view_count(lenv *env)
+{
+    size_t rv = clxns_count(env->table);
+    for (lenv *e = env->overlay ? env->parent : 0; e; e = e->overlay ? e->parent : 0)
+    {
+        void *iter = clxns_iter_new(e->table);
+        while (clxns_iter_move_next(iter))
+        {
+            kvp *val = clxns_iter_get_next(iter);
+            rv += !lenv_shadowed(env, e, val->key);
+        }
+
+        clxns_iter_free(iter);
+    }
+
+    return rv;
+}
+
 lval *lenv_to_lval(lenv *env)
 {
     lval *rv = lval_qexpression();
 
-    void *iter = clxns_iter_new(env->table);
-    while (clxns_iter_move_next(iter))
+    // A forked environment also sees what it was forked from
+    for (lenv *e = env; e; e = e->overlay ? e->parent : 0)
     {
-        kvp *val = clxns_iter_get_next(iter);
-        lval *pair = lval_qexpression();
-        lval_add(pair, lval_string(val->key));
-        lval_add(pair, lval_copy(val->value));
-        lval_add(rv, pair);
+        void *iter = clxns_iter_new(e->table);
+        while (clxns_iter_move_next(iter))
+        {
+            kvp *val = clxns_iter_get_next(iter);
+            if (e != env && lenv_shadowed(env, e, val->key))
+            {
+                continue;
+            }
+
+            lval *v = val->value;
+            lval_force(v);
+            if (v->type == LVAL_LAZY)
+            {
+                // Still being defined
+                continue;
+            }
+
+            lval *pair = lval_qexpression();
+            lval_add(pair, lval_string(val->key));
+            lval_add(pair, lval_copy(v));
+            lval_add(rv, pair);
+        }
+
+        clxns_iter_free(iter);
     }
 
     return rv;
 }
 
-lenv *lilith_init()
+/**
+ * Builds the shared base environment. Once loaded it is frozen so that any number
+ * of interpreters, on any number of threads, can read from it.
+ */
+static void load_base_env()
 {
     lenv *env = lenv_new();
+    env->base = true;
     lenv_add_builtins_sums(env);
     lenv_add_builtins_funcs(env);
+    lenv_add_builtins_ffi(env);
+    lenv_add_builtins_native(env);
+    lenv_add_builtins_modules(env);
+    lenv_add_builtins_cache(env);
+    lenv_add_builtins_match(env);
+    lenv_add_builtins_mutate(env);
+    lenv_add_builtins_promise(env);
+    lenv_add_builtins_group(env);
+    lenv_add_builtins_sketch(env);
+    lenv_add_builtins_sort(env);
+    lenv_add_builtins_task(env);
 
     lval *x = load_std_lib(env);
     if (x->type == LVAL_ERROR)
     {
-        lilith_println(x);
-        return 0;
+        lval_print(lout_default(true), x, 0);
+        lout_putc(lout_default(true), '\n');
+        lval_del(x);
+        lenv_del(env);
+        return;
     }
 
     lval_del(x);
+    lenv_watch_all(env);
+    env->frozen = true;
+    base_env = env;
+}
+
+lenv *lilith_init()
+{
+    pthread_once(&base_env_once, load_base_env);
+    if (!base_env)
+    {
+        return 0;
+    }
+
+    lenv *env = lilith_env_fork(base_env);
+    env->out = lout_new(0, false);
+    env->err = lout_new(0, true);
+    return env;
+}
+
+lenv *lilith_env_fork(lenv *base)
+{
+    lenv *env = lenv_new();
+    env->parent = base;
+    env->overlay = true;
     return env;
 }
 
+lout *lenv_out(lenv *e)
+{
+    for (; e; e = e->parent)
+    {
+        if (e->out)
+        {
+            return e->out;
+        }
+    }
+
+    return lout_default(false);
+}
+
+lout *lenv_err(lenv *e)
+{
+    for (; e; e = e->parent)
+    {
+        if (e->err)
+        {
+            return e->err;
+        }
+    }
+
+    return lout_default(true);
+}
+
+void lilith_set_output(lenv *env, const lilith_sink *sink)
+{
+    if (env->out)
+    {
+        lout_del(env->out);
+    }
+
+    env->out = lout_new(sink, false);
+}
+
+void lilith_set_errors(lenv *env, const lilith_sink *sink)
+{
+    if (env->err)
+    {
+        lout_del(env->err);
+    }
+
+    env->err = lout_new(sink, true);
+}
+
+void lilith_flush(lenv *env)
+{
+    lout_flush(lenv_out(env));
+    lout_flush(lenv_err(env));
+}
+
 void lilith_cleanup(lenv *env)
 {
     lenv_del(env);
@@ -1,19 +1,49 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
+
 /*
  * Lilith -- a Lisp interpreter.
  */
 
+#define LILITH_VERSION "0.3.0"
+
 struct lval;
 struct lenv;
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct lilith_task lilith_task;
 
 /**
- * Initialises a new Lilith environment.
+ * Receives the output of a Lilith environment. Output is buffered by the environment
+ * and passed to write in blocks; flush is called when the environment is flushed.
+ */
+typedef struct
+{
+    void (*write)(void *ctx, const char *data, size_t len);
+    void (*flush)(void *ctx);
+    void *ctx;
+} lilith_sink;
+
+/**
+ * Initialises a new Lilith environment. The built-ins and standard library are
+ * loaded once per process in to a shared, read-only environment; each new
+ * environment is a fork of it and holds only what is defined in it.
  */
 lenv *lilith_init();
 
+/**
+ * Creates a new environment layered over an existing one. The base environment's
+ * bindings are shared rather than copied and definitions made in the fork are kept
+ * in the fork, so forking is cheap and the base is never modified. The base must
+ * outlive the fork. Free the fork with lilith_cleanup.
+ *
+ * @param base the environment to fork
+ * @returns    a new environment
+ */
+lenv *lilith_env_fork(lenv *base);
+
 /**
  * Evaluates a Lilith value, consumes input in the process.
  * 
@@ -23,6 +53,39 @@ lenv *lilith_init();
  */
 lval *lilith_eval_expr(lenv *env, lval *input);
 
+/**
+ * Prepares an expression for step-sliced evaluation with lilith_eval_step.
+ * Consumes input in the process.
+ *
+ * @param input an lval expression
+ * @returns     a task to pass to lilith_eval_step
+ */
+lilith_task *lilith_task_new(lval *input);
+
+/**
+ * Evaluates a task for at most max_steps evaluation steps. If the evaluation
+ * has not finished the task is suspended and can be resumed by calling this
+ * function again, so long-running scripts can share a thread with other work.
+ *
+ * @param env       the environment, the same on every call for a task
+ * @param task      the task to evaluate
+ * @param max_steps the maximum number of evaluation steps to take
+ * @returns         the evaluated result once finished, 0 while unfinished or
+ *                  once the result has been returned
+ */
+lval *lilith_eval_step(lenv *env, lilith_task *task, unsigned long max_steps);
+
+/**
+ * Whether a task has finished, so lilith_eval_step has returned or will return
+ * its result.
+ */
+bool lilith_task_done(const lilith_task *task);
+
+/**
+ * Frees up a task. An unfinished evaluation is abandoned and its memory released.
+ */
+void lilith_task_del(lilith_task *task);
+
 /**
  * Reads one or more Lilith values from a string.
  *
@@ -40,11 +103,79 @@ lval *lilith_read_from_string(const char *input);
 void lilith_eval_file(lenv *env, const char *filename);
 
 /**
- * Prints the contents of a Lilith value to the screen.
+ * Writes a standalone executable made of the running interpreter and a set of
+ * scripts in compiled form. The first script is the entry point, run when the
+ * executable starts; the others are found by load and require under the names
+ * given here without searching the LILITH_PATH.
+ *
+ * @param output the path of the executable to write
+ * @param files  the paths of the scripts to bundle
+ * @param count  the number of scripts
+ * @returns      0 on success, an error otherwise
+ */
+lval *lilith_bundle(const char *output, const char **files, int count);
+
+/**
+ * Runs the entry point of the scripts bundled in to the running executable, if any.
+ *
+ * @param env the Lilith environment
+ * @returns   non-zero if the executable has bundled scripts
+ */
+int lilith_run_bundle(lenv *env);
+
+/**
+ * Translates the function definitions in a Lilith file to C. Build the output in
+ * to a shared library and load it with load-native to use the compiled functions;
+ * the file's other top-level expressions are evaluated as the library is loaded.
+ *
+ * @param filename the Lilith file to translate
+ * @param output   the path of the C file to write, or 0 for stdout
+ * @returns        0 on success, an error otherwise
+ */
+lval *lilith_emit_c(const char *filename, const char *output);
+
+/**
+ * Evaluates a Lilith file, then watches it and evaluates it again each time it
+ * changes. Only top-level expressions that are new or changed are evaluated again;
+ * the rest of the environment is kept. Does not return unless the file cannot be
+ * watched.
+ *
+ * @param env      the Lilith environment
+ * @param filename the Lilith file to watch
+ * @returns        an error if the file could not be watched
+ */
+lval *lilith_watch(lenv *env, const char *filename);
+
+/**
+ * Prints the contents of a Lilith value to the environment's output.
  * 
+ * @param env the Lilith environment
  * @param val the Lilith value to print
  */
-void lilith_println(const lval *val);
+void lilith_println(lenv *env, const lval *val);
+
+/**
+ * Sets where an environment's output is sent. Output from print and lilith_println
+ * is buffered and passed to the sink; pending output is flushed first.
+ *
+ * @param env  the Lilith environment
+ * @param sink the sink, copied by the environment, or 0 for stdout
+ */
+void lilith_set_output(lenv *env, const lilith_sink *sink);
+
+/**
+ * Sets where an environment's diagnostics, such as errors from lilith_eval_file,
+ * are sent.
+ *
+ * @param env  the Lilith environment
+ * @param sink the sink, copied by the environment, or 0 for stderr
+ */
+void lilith_set_errors(lenv *env, const lilith_sink *sink);
+
+/**
+ * Passes any buffered output and diagnostics to the environment's sinks and flushes them.
+ */
+void lilith_flush(lenv *env);
 
 /**
  * Frees up an lval.
@@ -54,6 +185,6 @@ void lilith_println(const lval *val);
 void lilith_lval_del(lval *val);
 
 /**
- * Frees up the Lilith environment.
+ * Frees up the Lilith environment. Freeing a fork leaves its base untouched.
  */
 void lilith_cleanup(lenv *env);
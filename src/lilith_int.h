@@ -4,11 +4,28 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <sys/stat.h>
 #include "lilith.h"
 
 #define LVAL_EXPR_CNT(arg) arg->value.list.count
 #define LVAL_EXPR_FIRST(arg) arg->value.list.head->data
 
+/**
+ * Buffered output to a sink.
+ */
+typedef struct lout lout;
+
+/**
+ * A growable byte buffer.
+ */
+typedef struct
+{
+    char *data;
+    size_t len;
+    size_t cap;
+} lbuf;
+
 /**
  * Pointer to a built-in function.
  */
@@ -28,9 +45,54 @@ enum
     LVAL_BUILTIN_FUN,
     LVAL_SEXPRESSION,
     LVAL_QEXPRESSION,
-    LVAL_USER_FUN
+    LVAL_USER_FUN,
+    LVAL_FFI_LIB,
+    LVAL_FFI_FUN,
+    LVAL_LAZY,
+    LVAL_PROMISE,
+    LVAL_SKETCH
 };
 
+/**
+ * A parsed foreign function signature.
+ */
+struct ffi_sig;
+
+/**
+ * A shared library opened by the FFI.
+ */
+struct ffi_lib;
+
+/**
+ * A module loaded by require.
+ */
+struct module;
+
+/**
+ * A standard library definition that is evaluated on first use.
+ */
+struct lazy_def;
+
+/**
+ * The constant-folded body of a function and what its calls need to know about it.
+ */
+struct lfun_opt;
+
+/**
+ * A name in the base environment watched for being bound elsewhere.
+ */
+struct lenv_watch;
+
+/**
+ * An expression whose evaluation is delayed until it is forced.
+ */
+struct promise;
+
+/**
+ * A HyperLogLog, t-digest or Count-Min sketch.
+ */
+struct sketch;
+
 /**
  * A node in an lval linked list.
  */
@@ -64,9 +126,31 @@ struct lval
         struct
         {
             lenv *env;
+            lenv *scope; // where free symbols are looked up, 0 for the caller's environment
             lval *formals;
             lval *body;
+            lbuiltin native; // compiled form, called with all arguments unbound, or 0
+            struct lfun_opt *opt; // folded form of the body, or 0
         } user_fun;
+
+        // foreign functions
+        struct ffi_lib *ffi_lib; // shared by copies and the functions looked up in it
+        struct
+        {
+            void *fn;
+            struct ffi_sig *sig;
+            char *name;
+            struct ffi_lib *lib; // kept open while the function is
+        } ffi_fun;
+
+        // standard library definitions not evaluated yet
+        struct lazy_def *lazy;
+
+        // delayed expressions, shared by copies
+        struct promise *promise;
+
+        // summaries of streams, shared by copies
+        struct sketch *sketch;
     } value;
     unsigned type;
 };
@@ -138,15 +222,42 @@ lval *lval_fun(lbuiltin function);
  */
 lval *lval_lambda(lval *formals, lval* body);
 
+/**
+ * Generates a new lval for a shared library opened by the FFI. Takes over the
+ * reference to the library.
+ */
+lval *lval_ffi_lib(struct ffi_lib *lib);
+
+/**
+ * Generates a new lval for a function in a shared library. Takes over the
+ * reference to the library.
+ */
+lval *lval_ffi_fun(void *fn, struct ffi_sig *sig, const char *name, struct ffi_lib *lib);
+
+/**
+ * Generates a new lval standing in for a standard library definition until it is evaluated.
+ */
+lval *lval_lazy(struct lazy_def *def);
+
+/**
+ * Generates a new lval for a promise. Takes the reference passed in.
+ */
+lval *lval_promise(struct promise *p);
+
+/**
+ * Generates a new lval for a sketch. Takes the reference passed in.
+ */
+lval *lval_sketch(struct sketch *s);
+
 /**
  * Adds an lval to an s-expression.
  */
 lval *lval_add(lval *v, lval *x);
 
 /**
- * Prints the contents of an lval to the screen.
+ * Prints the contents of an lval to an output buffer.
  */
-void lval_print(const lval *v, unsigned options);
+void lval_print(lout *out, const lval *v, unsigned options);
 
 /**
  * Perform a deep copy on an lval.
@@ -158,11 +269,84 @@ lval *lval_copy(lval *v);
  */
 bool lval_is_equal(lval *x, lval *y);
 
+/**
+ * Hashes the structure and contents of an lval, so expressions that read the same
+ * hash the same.
+ */
+uint64_t lval_hash(const lval *v, uint64_t seed);
+
 /**
  * Free an lval.
  */
 void lval_del(lval *v);
 
+/**
+ * Initialises an empty byte buffer.
+ */
+void lbuf_init(lbuf *buf);
+
+/**
+ * Appends bytes to a byte buffer.
+ */
+void lbuf_write(lbuf *buf, const void *data, size_t len);
+
+/**
+ * Frees the contents of a byte buffer.
+ */
+void lbuf_free(lbuf *buf);
+
+/**
+ * Hashes a block of bytes. Pass LILITH_HASH_SEED as the seed, or the result of a
+ * previous call to hash several blocks as one.
+ */
+uint64_t lilith_hash(const void *data, size_t len, uint64_t seed);
+
+#define LILITH_HASH_SEED 0xcbf29ce484222325ULL
+
+/**
+ * Appends the binary form of an lval to a buffer. Only values that can be read
+ * from source can be serialised -- returns false for anything else.
+ */
+bool lval_serialise(lbuf *buf, const lval *v);
+
+/**
+ * Reads an lval written by lval_serialise and advances pos past it.
+ *
+ * @param pos the position to read from
+ * @param end the end of the data
+ * @returns   the value, or 0 if the data is malformed
+ */
+lval *lval_deserialise(const char **pos, const char *end);
+
+/**
+ * Writes a sketch in binary form.
+ */
+void sketch_serialise(lbuf *buf, const struct sketch *s);
+
+/**
+ * Reads a sketch written by sketch_serialise and advances pos past it. Returns 0
+ * if it is not valid.
+ */
+struct sketch *sketch_deserialise(const char **pos, const char *end);
+
+/**
+ * Reads and parses a source file, using its compiled form if it is up to date and
+ * storing one if not.
+ *
+ * @param path the path to the file
+ * @param fn   the file's details
+ * @returns    the parsed expressions, or 0 if the file could not be read
+ */
+lval *read_source_file(const char *path, struct stat *fn);
+
+/**
+ * Gets the parsed form of a script bundled in to the running executable.
+ *
+ * @param name the name the script was bundled under
+ * @returns    the shared parsed script, which must not be changed, or 0 if not bundled
+ */
+const lval *bundle_get(const char *name);
+
 /**
  * Initialises a new instance of lenv;
  */
@@ -178,6 +362,161 @@ void lenv_set_parent(lenv *env, lenv *parent);
  */
 void lenv_del(lenv *e);
 
+/**
+ * Evaluates a deferred standard library definition, replacing the value in place.
+ * Does nothing for any other value.
+ */
+void lval_force(lval *v);
+
+/**
+ * Looks up a symbol from the environment without copying it. Returns 0 if unbound.
+ */
+lval *lenv_find(lenv *e, const char *key);
+
+/**
+ * Looks up a symbol without copying it or evaluating deferred definitions.
+ */
+lval *lenv_find_raw(lenv *e, const char *key);
+
+/**
+ * Looks up a symbol that is bound in the shared base environment and not shadowed.
+ * Returns 0 otherwise, or if it is a standard library function not yet evaluated
+ * and functions is not set.
+ */
+lval *lenv_find_constant(lenv *e, const char *key, bool functions);
+
+/**
+ * Looks up a symbol's value for updating in place. Returns 0 if unbound. Sets
+ * shared if it is bound in a frozen environment, where it must not be changed.
+ */
+lval *lenv_find_cell(lenv *e, const char *key, bool *shared);
+
+/**
+ * Checks whether an environment has no bindings of its own.
+ */
+bool lenv_empty(lenv *e);
+
+/**
+ * Gets the number of bindings an environment has of its own.
+ */
+size_t lenv_count(lenv *e);
+
+/**
+ * Replaces the value of a symbol bound in an environment, rather than in one of
+ * its parents, in place. Consumes the value. Returns false if the symbol is not bound.
+ */
+bool lenv_rebind(lenv *e, const char *key, lval *v);
+
+/**
+ * Gets the watch on a name bound in the base environment, flagged once the name is
+ * bound anywhere else, by a definition or as a parameter. Every caller watching the
+ * same name shares the watch, which lasts for the life of the process.
+ */
+struct lenv_watch *lenv_watch(const char *key);
+
+/**
+ * Checks whether a watched name has been bound outside the base environment.
+ */
+bool lenv_watch_bound(const struct lenv_watch *w);
+
+/**
+ * Gets the number of times a watched name has first been bound outside the base
+ * environment. Code that checked its watches at one count needs only check them
+ * again once it changes.
+ */
+unsigned lenv_bind_epoch(void);
+
+/**
+ * The type of a parameter or result with no annotation, and of an annotation that
+ * is not a type.
+ */
+#define LTYPE_ANY -1
+#define LTYPE_INVALID -2
+
+/**
+ * Reads the type annotation of a parameter, name:type.
+ *
+ * @param formal the parameter
+ * @param len    set to the length of the name
+ * @returns      the type, LTYPE_ANY if there is no annotation or LTYPE_INVALID
+ */
+int lfun_parse_formal(const char *formal, size_t *len);
+
+/**
+ * Removes the type annotations from the parameters of a new function and records
+ * the result type. Returns an error if an annotation is invalid, otherwise 0.
+ */
+lval *lfun_annotate(lval *func);
+
+/**
+ * Folds constants in to the body of a new function, keeping the original body
+ * for when the bindings folded in are shadowed, and records its parameters.
+ */
+void lfun_fold(lenv *env, lval *func);
+
+/**
+ * Gets the body to evaluate for a call to a function with its arguments bound --
+ * the folded body if the bindings it was folded with are still in place.
+ */
+lval *lfun_body(lval *func);
+
+/**
+ * Gets all of the parameters of a function, bound or not, or 0 if a call to the
+ * function in tail position of its own body cannot reuse the environment.
+ */
+const lval *lfun_formals(const lval *func);
+
+/**
+ * Checks a function's result against a type, or LTYPE_ANY. Consumes the result and
+ * returns it, or an error if it is of another type.
+ */
+lval *lfun_check_type(int type, lval *rv);
+
+/**
+ * Checks the result of a function against its annotated type.
+ */
+lval *lfun_return(const lval *func, lval *rv);
+
+/**
+ * Takes another reference to a folded body.
+ */
+struct lfun_opt *lfun_opt_ref(struct lfun_opt *opt);
+
+/**
+ * Releases a reference to a folded body.
+ */
+void lfun_opt_del(struct lfun_opt *opt);
+
+/**
+ * Takes another reference to a promise.
+ */
+struct promise *promise_ref(struct promise *p);
+
+/**
+ * Releases a reference to a promise.
+ */
+void promise_del(struct promise *p);
+
+/**
+ * Takes another reference to a sketch.
+ */
+struct sketch *sketch_ref(struct sketch *s);
+
+/**
+ * Releases a reference to a sketch.
+ */
+void sketch_del(struct sketch *s);
+
+/**
+ * Prints a description of a sketch.
+ */
+void sketch_print(lout *out, const struct sketch *s);
+
+/**
+ * Compares the contents of two sketches.
+ */
+bool sketch_is_equal(const struct sketch *x, const struct sketch *y);
+
 /**
  * Looks up a symbol from the environment.
  */
@@ -198,6 +537,145 @@ bool lenv_put(lenv *e, lval *k, lval *v);
  */
 bool lenv_def(lenv *e, lval *k, lval *v);
 
+/**
+ * Gets the environment that definitions made in e are added to.
+ */
+lenv *lenv_root(lenv *e);
+
+/**
+ * Creates the namespace environment for a module. Definitions made while loading
+ * the module are kept in it; lookups fall through to parent.
+ */
+lenv *lenv_module_new(lenv *parent, struct module *module);
+
+/**
+ * Gets the module whose namespace e belongs to, or 0 if none.
+ */
+struct module *lenv_module(lenv *e);
+
+/**
+ * Gets the slot holding the modules loaded by the interpreter that e belongs to.
+ */
+void **lenv_modules(lenv *e);
+
+/**
+ * Defines bindings from a module's namespace in another environment. Functions
+ * keep looking up their free symbols in the module.
+ *
+ * @param to    the environment to define the bindings in
+ * @param from  the module's namespace
+ * @param names a q-expression of the symbols to import, or 0 for all of them
+ * @returns     0 on success, an error otherwise
+ */
+lval *lenv_import(lenv *to, lenv *from, lval *names);
+
+/**
+ * Add built-in module functions to the environment.
+ */
+void lenv_add_builtins_modules(lenv *e);
+
+/**
+ * Add the built-in result cache function to the environment.
+ */
+void lenv_add_builtins_cache(lenv *e);
+
+/**
+ * Add the built-in pattern matching function to the environment.
+ */
+void lenv_add_builtins_match(lenv *e);
+
+/**
+ * Add in-place mutation built-in functions to the environment.
+ */
+void lenv_add_builtins_mutate(lenv *e);
+
+/**
+ * Add delay and force built-in functions to the environment.
+ */
+void lenv_add_builtins_promise(lenv *e);
+
+/**
+ * Add group-by and the other aggregation built-in functions to the environment.
+ */
+void lenv_add_builtins_group(lenv *e);
+
+/**
+ * Add the sketch built-in functions to the environment.
+ */
+void lenv_add_builtins_sketch(lenv *e);
+
+/**
+ * Add the external-sort built-in function to the environment.
+ */
+void lenv_add_builtins_sort(lenv *e);
+
+/**
+ * Add the eval-steps built-in function to the environment.
+ */
+void lenv_add_builtins_task(lenv *e);
+
+/**
+ * Finds the value bound to the symbol in the first argument, a q-expression
+ * holding one symbol, for a built-in that changes it in place, and checks it can
+ * be changed. Returns an error, deleting the arguments, or 0.
+ */
+lval *mutate_find(lenv *env, lval *args, const char *symbol, lval **cell);
+
+/**
+ * Frees the modules loaded by an interpreter.
+ */
+void module_registry_del(void *registry);
+
+/**
+ * Gets the output buffer of an environment, or of its nearest ancestor with one.
+ */
+lout *lenv_out(lenv *e);
+
+/**
+ * Gets the diagnostic output buffer of an environment, or of its nearest ancestor with one.
+ */
+lout *lenv_err(lenv *e);
+
+/**
+ * Creates a new output buffer for a sink, or for stdout / stderr if sink is 0.
+ */
+lout *lout_new(const lilith_sink *sink, bool errors);
+
+/**
+ * Gets an unbuffered output to stdout or stderr.
+ */
+lout *lout_default(bool errors);
+
+/**
+ * Flushes and frees an output buffer.
+ */
+void lout_del(lout *out);
+
+/**
+ * Writes bytes to an output buffer.
+ */
+void lout_write(lout *out, const char *data, size_t len);
+
+/**
+ * Writes a character to an output buffer.
+ */
+void lout_putc(lout *out, char c);
+
+/**
+ * Writes a string to an output buffer.
+ */
+void lout_puts(lout *out, const char *str);
+
+/**
+ * Writes formatted text to an output buffer.
+ */
+void lout_printf(lout *out, const char *fmt, ...);
+
+/**
+ * Passes buffered bytes to the sink and flushes it.
+ */
+void lout_flush(lout *out);
+
 /**
  * Add built-in arithmetic functions to the environment.
  */
@@ -208,21 +686,118 @@ void lenv_add_builtins_sums(lenv *e);
  */
 void lenv_add_builtins_funcs(lenv *e);
 
+/**
+ * Add built-in functions for loading compiled Lilith code to the environment.
+ */
+void lenv_add_builtins_native(lenv *e);
+
+/**
+ * Add built-in foreign function interface functions to the environment.
+ */
+void lenv_add_builtins_ffi(lenv *e);
+
+/**
+ * Calls a foreign function with a list of arguments. Consumes the arguments.
+ */
+lval *ffi_call(lval *func, lval *args);
+
+/**
+ * Gets the description a foreign function signature was parsed from.
+ */
+const char *ffi_sig_desc(const struct ffi_sig *sig);
+
+/**
+ * Takes another reference to a shared library.
+ */
+struct ffi_lib *ffi_lib_ref(struct ffi_lib *lib);
+
+/**
+ * Releases a reference to a shared library, closing it with the last one.
+ */
+void ffi_lib_del(struct ffi_lib *lib);
+
+/**
+ * Gets the name a shared library was opened with.
+ */
+const char *ffi_lib_name(const struct ffi_lib *lib);
+
+/**
+ * Checks whether two shared libraries are the same library.
+ */
+bool ffi_lib_is_equal(const struct ffi_lib *x, const struct ffi_lib *y);
+
 /**
  * Performs a deep copy of the environment.
  */
 lenv *lenv_copy(lenv *e);
 
 /**
- * Converts an lenv to an lval.
+ * Converts an lenv to an lval. A forked environment also includes the bindings
+ * of the one it was forked from that it does not shadow.
  */
 lval *lenv_to_lval(lenv *env);
 
+/**
+ * Looks up a symbol bound in an environment or its parents below the root, such
+ * as a function's parameters, without copying it. Returns 0 if it is not bound there.
+ */
+lval *lenv_find_local(lenv *e, const char *key);
+
+/**
+ * Looks up a symbol bound in an environment, rather than in one of its parents,
+ * without copying it. Returns 0 if unbound.
+ */
+lval *lenv_own(lenv *e, const char *key);
+
+/**
+ * Looks up a symbol among the bindings lenv_to_lval would list, without copying
+ * it or evaluating a deferred definition. Returns 0 if unbound.
+ */
+lval *lenv_view_find(lenv *env, const char *key);
+
+/**
+ * Gets the names lenv_to_lval would list, as strings in a q-expression, without
+ * copying their values.
+ */
+lval *lenv_keys(lenv *env);
+
+/**
+ * Counts the bindings lenv_to_lval would list without copying them.
+ */
+size_t lenv_view_count(lenv *env);
+
 /**
  * Convert a type in to a user-friendly name.
  */
 char *ltype_name(unsigned type);
 
+/**
+ * The task being evaluated by lilith_eval_step on this thread, if any.
+ */
+extern _Thread_local lilith_task *task_current;
+
+/**
+ * Counts an evaluation step of the current task, suspending it when its budget
+ * is used up. Returns false if the task has been cancelled.
+ */
+bool task_step();
+
+/**
+ * Calls a function with a list of evaluated arguments. Consumes the arguments.
+ */
+lval *lval_call(lenv *env, lval *func, lval *args);
+
+/**
+ * Calls the function at the head of an s-expression whose elements have already
+ * been evaluated. Consumes the s-expression.
+ */
+lval *lval_apply(lenv *env, lval *val);
+
+/**
+ * Checks whether a value is the if built-in.
+ */
+bool lval_is_if(const lval *v);
+
 /**
  * Evaluates all of the expressions in a parsed result.
  */
@@ -0,0 +1,167 @@
+#pragma once
+
+/*
+ * Runtime support for the C generated by lilith --emit-c. Generated code calls
+ * the interpreter directly, so the shared library it is built in to must be
+ * loaded by the lilith executable it was generated with.
+ */
+
+#include <limits.h>
+#include "lilith_int.h"
+#include "builtin_symbols.h"
+
+/**
+ * Operations with a fast path when both arguments are integers.
+ */
+enum
+{
+    NATIVE_ADD,
+    NATIVE_SUB,
+    NATIVE_MUL,
+    NATIVE_DIV,
+    NATIVE_MOD,
+    NATIVE_MAX,
+    NATIVE_MIN,
+    NATIVE_GT,
+    NATIVE_LT,
+    NATIVE_GTE,
+    NATIVE_LTE,
+    NATIVE_EQ
+};
+
+/**
+ * A top-level expression of a compiled file -- the expression in binary form and,
+ * for function definitions, the compiled function.
+ */
+typedef struct
+{
+    const char *name;
+    lbuiltin fn;
+    const unsigned char *expr;
+    size_t len;
+} native_def;
+
+/**
+ * Temporary values for passing unboxed results to functions expecting an lval.
+ * They live until the end of the enclosing block and must not be freed.
+ */
+#define native_long_ref(x) (&(lval){ .value.num_l = (x), .type = LVAL_LONG })
+#define native_double_ref(x) (&(lval){ .value.num_d = (x), .type = LVAL_DOUBLE })
+#define native_bool_ref(x) (&(lval){ .value.bval = (x), .type = LVAL_BOOL })
+
+/**
+ * Counts an evaluation step on entry to a compiled function, as the interpreter
+ * does for each expression, so compiled code can be suspended and cancelled.
+ */
+#define NATIVE_ENTER(args)                              \
+    do                                                  \
+    {                                                   \
+        if (task_current && !task_step())               \
+        {                                               \
+            lval_del(args);                             \
+            return lval_error("evaluation cancelled");  \
+        }                                               \
+    } while (0)
+
+/**
+ * Looks up a symbol by name.
+ */
+lval *native_get(lenv *env, const char *name);
+
+/**
+ * Binds a value to a symbol in a compiled function's environment. The value is copied.
+ */
+void native_bind(lenv *env, const char *name, lval *val);
+
+/**
+ * Performs an operation by calling the built-in function. Arguments flagged in
+ * owned (bit 0 for x, bit 1 for y) are consumed, the others copied.
+ */
+lval *native_op_slow(lenv *env, int op, lval *x, lval *y, unsigned owned);
+
+/**
+ * Calls a function compiled in the same file, or whatever the name is bound to
+ * if it has been redefined. Consumes the arguments.
+ */
+lval *native_call_known(lenv *env, const char *name, lbuiltin fn, lval *args);
+
+/**
+ * Evaluates a compiled file's top-level expressions in order and attaches the
+ * compiled functions to the definitions they were compiled from.
+ */
+lval *native_load(lenv *env, const native_def *defs, size_t count);
+
+static inline long native_max_l(long x, long y) { return x > y ? x : y; }
+static inline long native_min_l(long x, long y) { return x < y ? x : y; }
+static inline double native_max_d(double x, double y) { return x > y ? x : y; }
+static inline double native_min_d(double x, double y) { return x < y ? x : y; }
+
+/**
+ * Performs an operation on two values. Integers are handled inline; anything else
+ * goes through the built-in function so results and errors match the interpreter.
+ */
+static inline lval *native_op(lenv *env, int op, lval *x, lval *y, unsigned owned)
+{
+    if (x->type == LVAL_LONG && y->type == LVAL_LONG)
+    {
+        long a = x->value.num_l;
+        long b = y->value.num_l;
+        lval *rv = 0;
+        switch (op)
+        {
+        case NATIVE_ADD: rv = lval_long(a + b); break;
+        case NATIVE_SUB: rv = lval_long(a - b); break;
+        case NATIVE_MUL: rv = lval_long(a * b); break;
+        case NATIVE_DIV: rv = b ? lval_double(a / (double)b) : 0; break;
+        case NATIVE_MOD: rv = b ? lval_long(a % b) : 0; break;
+        case NATIVE_MAX: rv = lval_long(native_max_l(a, b)); break;
+        case NATIVE_MIN: rv = lval_long(native_min_l(a, b)); break;
+        case NATIVE_GT:  rv = lval_bool(a > b); break;
+        case NATIVE_LT:  rv = lval_bool(a < b); break;
+        case NATIVE_GTE: rv = lval_bool(a >= b); break;
+        case NATIVE_LTE: rv = lval_bool(a <= b); break;
+        case NATIVE_EQ:  rv = lval_bool(a == b); break;
+        }
+
+        if (rv)
+        {
+            if (owned & 1)
+            {
+                lval_del(x);
+            }
+
+            if (owned & 2)
+            {
+                lval_del(y);
+            }
+
+            return rv;
+        }
+    }
+
+    return native_op_slow(env, op, x, y, owned);
+}
+
+/**
+ * Tests the condition of an if. Returns 1 or 0 and frees the condition, or -1 and
+ * replaces the condition with the error to return.
+ */
+static inline int native_test(lval **cond)
+{
+    if ((*cond)->type == LVAL_BOOL)
+    {
+        int rv = (*cond)->value.bval;
+        lval_del(*cond);
+        return rv;
+    }
+
+    if ((*cond)->type != LVAL_ERROR)
+    {
+        lval *err = lval_error("function '%s' type mismatch - expected %s, received %s",
+            BUILTIN_SYM_IF, ltype_name(LVAL_BOOL), ltype_name((*cond)->type));
+        lval_del(*cond);
+        *cond = err;
+    }
+
+    return -1;
+}
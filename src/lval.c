@@ -15,39 +15,39 @@ static lval *lval_init(unsigned type)
     return v;
 }
 
-static void lval_expr_print(const lval *v, char open, char close, unsigned options)
+static void lval_expr_print(lout *out, const lval *v, char open, char close, unsigned options)
 {
-    putchar(open);
+    lout_putc(out, open);
     for (pair *ptr = v->value.list.head; ptr; ptr = ptr->next)
     {
         if (ptr != v->value.list.head)
         {
-            putchar(' ');
+            lout_putc(out, ' ');
         }
 
-        lval_print(ptr->data, options);
+        lval_print(out, ptr->data, options);
     }
 
-    putchar(close);
+    lout_putc(out, close);
 }
 
-static void lval_print_string(const lval *str_val)
+static void lval_print_string(lout *out, const lval *str_val)
 {
-    putchar('"');
+    lout_putc(out, '"');
     size_t len = strlen(str_val->value.str_val);
     for (size_t i = 0; i < len; i++)
     {
         if (is_escapable(str_val->value.str_val[i]))
         {
-            printf("%s", char_escape(str_val->value.str_val[i]));
+            lout_puts(out, char_escape(str_val->value.str_val[i]));
         }
         else
         {
-            putchar(str_val->value.str_val[i]);
+            lout_putc(out, str_val->value.str_val[i]);
         }
     }
 
-    putchar('"');
+    lout_putc(out, '"');
 }
 
 lval *lval_expr_item(lval *val, unsigned i)
@@ -183,6 +183,9 @@ lval *lval_lambda(lval *formals, lval* body)
 
     // Build new environment
     rv->value.user_fun.env = lenv_new();
+    rv->value.user_fun.scope = 0;
+    rv->value.user_fun.native = 0;
+    rv->value.user_fun.opt = 0;
 
     // Set formals and body
     rv->value.user_fun.formals = formals;
@@ -190,6 +193,44 @@ lval *lval_lambda(lval *formals, lval* body)
     return rv;
 }
 
+lval *lval_ffi_lib(struct ffi_lib *lib)
+{
+    lval *rv = lval_init(LVAL_FFI_LIB);
+    rv->value.ffi_lib = lib;
+    return rv;
+}
+
+lval *lval_ffi_fun(void *fn, struct ffi_sig *sig, const char *name, struct ffi_lib *lib)
+{
+    lval *rv = lval_init(LVAL_FFI_FUN);
+    rv->value.ffi_fun.fn = fn;
+    rv->value.ffi_fun.sig = sig;
+    rv->value.ffi_fun.name = strdup(name);
+    rv->value.ffi_fun.lib = lib;
+    return rv;
+}
+
+lval *lval_lazy(struct lazy_def *def)
+{
+    lval *rv = lval_init(LVAL_LAZY);
+    rv->value.lazy = def;
+    return rv;
+}
+
+lval *lval_promise(struct promise *p)
+{
+    lval *rv = lval_init(LVAL_PROMISE);
+    rv->value.promise = p;
+    return rv;
+}
+
+lval *lval_sketch(struct sketch *s)
+{
+    lval *rv = lval_init(LVAL_SKETCH);
+    rv->value.sketch = s;
+    return rv;
+}
+
 lval *lval_add(lval *v, lval *x)
 {
     v->value.list.count++;
@@ -205,50 +246,62 @@ lval *lval_add(lval *v, lval *x)
     return v;
 }
 
-void lval_print(const lval *v, unsigned options)
+void lval_print(lout *out, const lval *v, unsigned options)
 {
     switch (v->type)
     {
     case LVAL_LONG:
-        printf("%li", v->value.num_l);
+        lout_printf(out, "%li", v->value.num_l);
         break;
     case LVAL_DOUBLE:
-        printf("%f", v->value.num_d);
+        lout_printf(out, "%f", v->value.num_d);
         break;
     case LVAL_BOOL:
-        printf("%s", v->value.bval ? "#t" : "#f");
+        lout_printf(out, "%s", v->value.bval ? "#t" : "#f");
         break;
     case LVAL_STRING:
         if (!options)
         {
-            lval_print_string(v);
+            lval_print_string(out, v);
         }
         else
         {
-            printf("%s", v->value.str_val);
+            lout_puts(out, v->value.str_val);
         }
         break;
     case LVAL_SYMBOL:
-        printf("%s", v->value.str_val);
+        lout_puts(out, v->value.str_val);
         break;
     case LVAL_ERROR:
-        printf("Error: %s", v->value.str_val);
+        lout_printf(out, "Error: %s", v->value.str_val);
         break;
     case LVAL_BUILTIN_FUN:
-        printf("<builtin>");
+        lout_puts(out, "<builtin>");
         break;
     case LVAL_SEXPRESSION:
-        lval_expr_print(v, '(', ')', options);
+        lval_expr_print(out, v, '(', ')', options);
         break;
     case LVAL_QEXPRESSION:
-        lval_expr_print(v, '{', '}', options);
+        lval_expr_print(out, v, '{', '}', options);
         break;
     case LVAL_USER_FUN:
-        printf("(\\ ");
-        lval_print(v->value.user_fun.formals, options);
-        putchar(' ');
-        lval_print(v->value.user_fun.body, options);
-        putchar(')');
+        lout_puts(out, "(\\ ");
+        lval_print(out, v->value.user_fun.formals, options);
+        lout_putc(out, ' ');
+        lval_print(out, v->value.user_fun.body, options);
+        lout_putc(out, ')');
+        break;
+    case LVAL_FFI_LIB:
+        lout_printf(out, "<library %s>", ffi_lib_name(v->value.ffi_lib));
+        break;
+    case LVAL_FFI_FUN:
+        lout_printf(out, "<foreign %s %s>", v->value.ffi_fun.name, ffi_sig_desc(v->value.ffi_fun.sig));
+        break;
+    case LVAL_PROMISE:
+        lout_puts(out, "<promise>");
+        break;
+    case LVAL_SKETCH:
+        sketch_print(out, v->value.sketch);
         break;
     }
 }
@@ -286,6 +339,14 @@ bool lval_is_equal(lval *x, lval *y)
     case LVAL_USER_FUN:
         return lval_is_equal(x->value.user_fun.formals, y->value.user_fun.formals) &&
             lval_is_equal(x->value.user_fun.body, y->value.user_fun.body);
+    case LVAL_FFI_LIB:
+        return ffi_lib_is_equal(x->value.ffi_lib, y->value.ffi_lib);
+    case LVAL_FFI_FUN:
+        return x->value.ffi_fun.fn == y->value.ffi_fun.fn && x->value.ffi_fun.sig == y->value.ffi_fun.sig;
+    case LVAL_PROMISE:
+        return x->value.promise == y->value.promise;
+    case LVAL_SKETCH:
+        return sketch_is_equal(x->value.sketch, y->value.sketch);
     case LVAL_QEXPRESSION:
     case LVAL_SEXPRESSION:
         if (LVAL_EXPR_CNT(x) != LVAL_EXPR_CNT(y))
@@ -293,7 +354,7 @@ bool lval_is_equal(lval *x, lval *y)
             return false;
         }
 
-        for (pair *ptrx = x->value.list.head, *ptry = x->value.list.head;
+        for (pair *ptrx = x->value.list.head, *ptry = y->value.list.head;
              ptrx && ptry;
              ptrx = ptrx->next, ptry = ptry->next)
         {
@@ -309,6 +370,43 @@ bool lval_is_equal(lval *x, lval *y)
     return false; 
 }
 
+uint64_t lval_hash(const lval *v, uint64_t seed)
+{
+    unsigned char type = v->type;
+    uint64_t rv = lilith_hash(&type, 1, seed);
+
+    switch (v->type)
+    {
+    case LVAL_LONG:
+        return lilith_hash(&v->value.num_l, sizeof(long), rv);
+    case LVAL_DOUBLE:
+        return lilith_hash(&v->value.num_d, sizeof(double), rv);
+    case LVAL_BOOL:
+        return lilith_hash(&v->value.bval, sizeof(bool), rv);
+    case LVAL_STRING:
+    case LVAL_ERROR:
+    case LVAL_SYMBOL:
+        return lilith_hash(v->value.str_val, strlen(v->value.str_val) + 1, rv);
+    case LVAL_BUILTIN_FUN:
+        return lilith_hash(&v->value.builtin, sizeof(lbuiltin), rv);
+    case LVAL_USER_FUN:
+        rv = lval_hash(v->value.user_fun.formals, rv);
+        return lval_hash(v->value.user_fun.body, rv);
+    case LVAL_SEXPRESSION:
+    case LVAL_QEXPRESSION:
+        // The count keeps (a (b) c) and (a (b c)) apart
+        rv = lilith_hash(&LVAL_EXPR_CNT(v), sizeof(LVAL_EXPR_CNT(v)), rv);
+        for (pair *ptr = v->value.list.head; ptr; ptr = ptr->next)
+        {
+            rv = lval_hash(ptr->data, rv);
+        }
+
+        return rv;
+    }
+
+    return rv;
+}
+
 void lval_del(lval *v)
 {
     pair *tmp, *ptr;
@@ -319,6 +417,7 @@ void lval_del(lval *v)
     case LVAL_DOUBLE:
     case LVAL_BUILTIN_FUN:
     case LVAL_BOOL:
+    case LVAL_LAZY:
         break;
     case LVAL_STRING:
     case LVAL_ERROR:
@@ -340,6 +439,23 @@ void lval_del(lval *v)
         lenv_del(v->value.user_fun.env);
         lval_del(v->value.user_fun.formals);
         lval_del(v->value.user_fun.body);
+        if (v->value.user_fun.opt)
+        {
+            lfun_opt_del(v->value.user_fun.opt);
+        }
+        break;
+    case LVAL_FFI_LIB:
+        ffi_lib_del(v->value.ffi_lib);
+        break;
+    case LVAL_FFI_FUN:
+        free(v->value.ffi_fun.name);
+        ffi_lib_del(v->value.ffi_fun.lib);
+        break;
+    case LVAL_PROMISE:
+        promise_del(v->value.promise);
+        break;
+    case LVAL_SKETCH:
+        sketch_del(v->value.sketch);
         break;
     }
 
@@ -348,6 +464,9 @@ void lval_del(lval *v)
 
 lval *lval_copy(lval *v)
 {
+    // Deferred definitions are only copied once they have a value
+    lval_force(v);
+
     lval *rv = lval_init(v->type);
 
     switch (v->type)
@@ -381,8 +500,26 @@ lval *lval_copy(lval *v)
         break;
     case LVAL_USER_FUN:
         rv->value.user_fun.env = lenv_copy(v->value.user_fun.env);
+        rv->value.user_fun.scope = v->value.user_fun.scope;
         rv->value.user_fun.formals = lval_copy(v->value.user_fun.formals);
         rv->value.user_fun.body = lval_copy(v->value.user_fun.body);
+        rv->value.user_fun.native = v->value.user_fun.native;
+        rv->value.user_fun.opt = v->value.user_fun.opt ? lfun_opt_ref(v->value.user_fun.opt) : 0;
+        break;
+    case LVAL_FFI_LIB:
+        rv->value.ffi_lib = ffi_lib_ref(v->value.ffi_lib);
+        break;
+    case LVAL_FFI_FUN:
+        rv->value.ffi_fun.fn = v->value.ffi_fun.fn;
+        rv->value.ffi_fun.sig = v->value.ffi_fun.sig;
+        rv->value.ffi_fun.name = strdup(v->value.ffi_fun.name);
+        rv->value.ffi_fun.lib = ffi_lib_ref(v->value.ffi_fun.lib);
+        break;
+    case LVAL_PROMISE:
+        rv->value.promise = promise_ref(v->value.promise);
+        break;
+    case LVAL_SKETCH:
+        rv->value.sketch = sketch_ref(v->value.sketch);
         break;
     }
 
@@ -395,7 +532,14 @@ char *ltype_name(unsigned type)
     {
         case LVAL_BUILTIN_FUN:
         case LVAL_USER_FUN:
+        case LVAL_FFI_FUN:
             return "Function";
+        case LVAL_FFI_LIB:
+            return "Library";
+        case LVAL_PROMISE:
+            return "Promise";
+        case LVAL_SKETCH:
+            return "Sketch";
         case LVAL_LONG:
             return "Number";
         case LVAL_DOUBLE:
@@ -417,10 +561,11 @@ char *ltype_name(unsigned type)
     }
 }
 
-void lilith_println(const lval *val)
+void lilith_println(lenv *env, const lval *val)
 {
-    lval_print(val, 0);
-    putchar('\n');
+    lout *out = lenv_out(env);
+    lval_print(out, val, 0);
+    lout_putc(out, '\n');
 }
 
 void lilith_lval_del(lval *val)
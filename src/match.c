@@ -0,0 +1,644 @@
+/*
+ * Pattern matching. (match x {pattern body} ...) evaluates the body of the first
+ * clause whose pattern matches x, with the variables in the pattern bound to the
+ * parts of x they match. Patterns are numbers, strings and booleans, which match
+ * equal values, _ which matches anything, symbols which match anything and bind
+ * it, and q-expressions of patterns which match q-expressions item by item -- with
+ * & followed by a symbol binding the remaining items.
+ *
+ * The patterns are compiled in to a decision tree the first time they are seen and
+ * the tree is kept, by a hash of the patterns, for the next time. The bodies play
+ * no part in it, so they are neither hashed nor compared on each call but taken
+ * from the clauses the call was given. Runs of clauses
+ * matching integers close together become a jump table and runs matching strings a
+ * hash table, so they are dispatched in one step rather than tested in turn.
+ */
+
+#include <limits.h>
+#include <pthread.h>
+#include <collections.h>
+
+#include "lilith_int.h"
+#include "builtin_symbols.h"
+
+#define MATCH_CACHE_SLOTS 256  // compiled clauses kept, by hash
+#define MATCH_TABLE_MIN 3      // fewest clauses worth a jump or hash table
+#define MATCH_TABLE_SPREAD 4   // the most jump table entries per clause
+
+typedef enum
+{
+    MATCH_ANY,   // _
+    MATCH_BIND,  // a symbol
+    MATCH_VALUE, // a number, string or boolean
+    MATCH_LIST   // a q-expression of patterns
+} match_kind;
+
+typedef struct match_pat
+{
+    match_kind kind;
+    const lval *value;      // the literal or, for a binding, the symbol
+    struct match_pat *items;
+    size_t count;
+    const char *rest;       // bound to the items after count, or 0 if there must be none
+} match_pat;
+
+typedef enum
+{
+    NODE_TEST,    // tries a single clause
+    NODE_INTS,    // jump table of integer literals
+    NODE_STRINGS  // hash table of string literals
+} node_kind;
+
+typedef struct
+{
+    node_kind kind;
+    size_t clause;  // the clause tested, or the first in the table
+    long min;
+    size_t span;
+    int *table;     // NODE_INTS: clause for each value from min, -1 for none
+    void *strings;  // NODE_STRINGS: clause + 1 for each string
+} match_node;
+
+typedef struct
+{
+    unsigned refs;
+    uint64_t hash;
+    lval *patterns; // owns the values the compiled patterns refer to
+    match_pat *pats;
+    size_t count;
+    match_node *nodes;
+    size_t node_count;
+} matcher;
+
+/**
+ * A value bound by a pattern. Values for & are built while matching so are owned.
+ */
+typedef struct
+{
+    const char *name;
+    lval *value;
+    bool owned;
+} match_bind;
+
+typedef struct
+{
+    match_bind *binds;
+    size_t count;
+    size_t cap;
+} match_binds;
+
+static matcher *match_cache[MATCH_CACHE_SLOTS];
+static pthread_mutex_t match_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void match_pat_free(match_pat *pat)
+{
+    for (size_t i = 0; i < pat->count; i++)
+    {
+        match_pat_free(&pat->items[i]);
+    }
+
+    free(pat->items);
+}
+
+static void matcher_del(matcher *m)
+{
+    if (__atomic_sub_fetch(&m->refs, 1, __ATOMIC_ACQ_REL))
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < m->count; i++)
+    {
+        match_pat_free(&m->pats[i]);
+    }
+
+    for (size_t i = 0; i < m->node_count; i++)
+    {
+        free(m->nodes[i].table);
+        if (m->nodes[i].strings)
+        {
+            clxns_free(m->nodes[i].strings, 0);
+        }
+    }
+
+    lval_del(m->patterns);
+    free(m->pats);
+    free(m->nodes);
+    free(m);
+}
+
+/**
+ * Checks a pattern does not bind a name twice.
+ */
+static bool match_binds_once(const match_pat *pat, const char **names, size_t *count)
+{
+    const char *name = pat->kind == MATCH_BIND ? pat->value->value.str_val : pat->rest;
+    if (name)
+    {
+        for (size_t i = 0; i < *count; i++)
+        {
+            if (!strcmp(names[i], name))
+            {
+                return false;
+            }
+        }
+
+        names[(*count)++] = name;
+    }
+
+    for (size_t i = 0; i < pat->count; i++)
+    {
+        if (!match_binds_once(&pat->items[i], names, count))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static size_t match_size(const lval *x)
+{
+    size_t rv = 1;
+    if (x->type == LVAL_QEXPRESSION || x->type == LVAL_SEXPRESSION)
+    {
+        for (pair *ptr = x->value.list.head; ptr; ptr = ptr->next)
+        {
+            rv += match_size(ptr->data);
+        }
+    }
+
+    return rv;
+}
+
+/**
+ * Compiles a pattern. Returns an error for anything that is not a pattern.
+ */
+static lval *match_compile_pat(match_pat *pat, const lval *x)
+{
+    memset(pat, 0, sizeof(match_pat));
+    switch (x->type)
+    {
+    case LVAL_SYMBOL:
+        if (!strcmp(x->value.str_val, "&"))
+        {
+            return lval_error("function '%s' pattern invalid - symbol '&' not in a list", BUILTIN_SYM_MATCH);
+        }
+
+        pat->kind = strcmp(x->value.str_val, "_") ? MATCH_BIND : MATCH_ANY;
+        pat->value = x;
+        return 0;
+    case LVAL_LONG:
+    case LVAL_DOUBLE:
+    case LVAL_STRING:
+    case LVAL_BOOL:
+        pat->kind = MATCH_VALUE;
+        pat->value = x;
+        return 0;
+    case LVAL_QEXPRESSION:
+        break;
+    default:
+        return lval_error("function '%s' pattern invalid - %s", BUILTIN_SYM_MATCH, ltype_name(x->type));
+    }
+
+    pat->kind = MATCH_LIST;
+    pat->items = calloc(LVAL_EXPR_CNT(x) + 1, sizeof(match_pat));
+    for (pair *ptr = x->value.list.head; ptr; ptr = ptr->next)
+    {
+        if (ptr->data->type == LVAL_SYMBOL && !strcmp(ptr->data->value.str_val, "&"))
+        {
+            if (!ptr->next || ptr->next->next || ptr->next->data->type != LVAL_SYMBOL)
+            {
+                return lval_error("function '%s' pattern invalid - symbol '&' not followed by single symbol",
+                    BUILTIN_SYM_MATCH);
+            }
+
+            pat->rest = ptr->next->data->value.str_val;
+            break;
+        }
+
+        lval *err = match_compile_pat(&pat->items[pat->count++], ptr->data);
+        if (err)
+        {
+            return err;
+        }
+    }
+
+    return 0;
+}
+
+static bool match_is_int(const match_pat *pat)
+{
+    return pat->kind == MATCH_VALUE && pat->value->type == LVAL_LONG;
+}
+
+static bool match_is_string(const match_pat *pat)
+{
+    return pat->kind == MATCH_VALUE && pat->value->type == LVAL_STRING;
+}
+
+/**
+ * Adds a node for a run of integer literals starting at a clause if they are close
+ * enough together for a jump table. Returns the number of clauses it covers.
+ */
+static size_t match_compile_ints(matcher *m, size_t first)
+{
+    size_t last = first;
+    long min = m->pats[first].value->value.num_l, max = min;
+    for (; last < m->count && match_is_int(&m->pats[last]); last++)
+    {
+        long v = m->pats[last].value->value.num_l;
+        min = v < min ? v : min;
+        max = v > max ? v : max;
+    }
+
+    size_t count = last - first;
+    unsigned long span = (unsigned long)max - (unsigned long)min + 1;
+    if (count < MATCH_TABLE_MIN || span == 0 || span > count * MATCH_TABLE_SPREAD)
+    {
+        return 0;
+    }
+
+    match_node *node = &m->nodes[m->node_count++];
+    *node = (match_node){ NODE_INTS, first, min, span, malloc(sizeof(int) * span), 0 };
+    for (size_t i = 0; i < span; i++)
+    {
+        node->table[i] = -1;
+    }
+
+    // The first clause for a value is the one that matches
+    for (size_t i = last; i-- > first; )
+    {
+        node->table[m->pats[i].value->value.num_l - min] = (int)i;
+    }
+
+    return count;
+}
+
+/**
+ * Adds a node for a run of string literals starting at a clause. Returns the
+ * number of clauses it covers.
+ */
+static size_t match_compile_strings(matcher *m, size_t first)
+{
+    size_t last = first;
+    while (last < m->count && match_is_string(&m->pats[last]))
+    {
+        last++;
+    }
+
+    size_t count = last - first;
+    if (count < MATCH_TABLE_MIN)
+    {
+        return 0;
+    }
+
+    match_node *node = &m->nodes[m->node_count++];
+    *node = (match_node){ NODE_STRINGS, first, 0, 0, 0, hash_table(count * 2 + 1) };
+    for (size_t i = first; i < last; i++)
+    {
+        // Keys belong to the compiled clauses
+        char *key = m->pats[i].value->value.str_val;
+        void *existing;
+        if (hash_table_get(node->strings, key, &existing) != C_OK)
+        {
+            hash_table_add(node->strings, key, (void*)(uintptr_t)(i + 1));
+        }
+    }
+
+    return count;
+}
+
+/**
+ * Compiles a list of patterns in to a decision tree. Consumes the patterns.
+ */
+static lval *match_compile(lval *patterns, uint64_t hash, matcher **rv)
+{
+    matcher *m = calloc(1, sizeof(matcher));
+    m->refs = 1;
+    m->hash = hash;
+    m->patterns = patterns;
+    m->count = LVAL_EXPR_CNT(patterns);
+    m->pats = calloc(m->count + 1, sizeof(match_pat));
+    m->nodes = calloc(m->count + 1, sizeof(match_node));
+
+    size_t i = 0;
+    for (pair *ptr = patterns->value.list.head; ptr; ptr = ptr->next, i++)
+    {
+        lval *err = match_compile_pat(&m->pats[i], ptr->data);
+        size_t count = 0;
+        const char **names = malloc(sizeof(char*) * match_size(ptr->data));
+        if (!err && !match_binds_once(&m->pats[i], names, &count))
+        {
+            err = lval_error("function '%s' pattern invalid - a symbol is bound more than once", BUILTIN_SYM_MATCH);
+        }
+
+        free(names);
+        if (err)
+        {
+            matcher_del(m);
+            return err;
+        }
+    }
+
+    for (i = 0; i < m->count; )
+    {
+        size_t count = 0;
+        if (match_is_int(&m->pats[i]))
+        {
+            count = match_compile_ints(m, i);
+        }
+        else if (match_is_string(&m->pats[i]))
+        {
+            count = match_compile_strings(m, i);
+        }
+
+        if (!count)
+        {
+            m->nodes[m->node_count++] = (match_node){ NODE_TEST, i, 0, 0, 0, 0 };
+            count = 1;
+        }
+
+        i += count;
+    }
+
+    *rv = m;
+    return 0;
+}
+
+/**
+ * Checks the patterns of a list of clauses are those a decision tree was compiled from.
+ */
+static bool match_same_patterns(const lval *patterns, const lval *clauses)
+{
+    pair *ptr = patterns->value.list.head;
+    for (pair *clause = clauses->value.list.head; clause; clause = clause->next, ptr = ptr->next)
+    {
+        if (!lval_is_equal(ptr->data, LVAL_EXPR_FIRST(clause->data)))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Gets the decision tree for the patterns of a list of clauses, compiling them if
+ * they have not been seen recently.
+ */
+static lval *match_get(lval *clauses, matcher **rv)
+{
+    uint64_t hash = lilith_hash(&LVAL_EXPR_CNT(clauses), sizeof(LVAL_EXPR_CNT(clauses)), LILITH_HASH_SEED);
+    for (pair *ptr = clauses->value.list.head; ptr; ptr = ptr->next)
+    {
+        lval *clause = ptr->data;
+        if (clause->type != LVAL_QEXPRESSION || LVAL_EXPR_CNT(clause) != 2)
+        {
+            return lval_error("function '%s' clause invalid - expected {pattern body}", BUILTIN_SYM_MATCH);
+        }
+
+        hash = lval_hash(LVAL_EXPR_FIRST(clause), hash);
+    }
+
+    size_t slot = hash % MATCH_CACHE_SLOTS;
+    pthread_mutex_lock(&match_lock);
+    matcher *m = match_cache[slot];
+    // The hash only picks the slot -- different patterns may have the same one
+    if (m && m->hash == hash && m->count == LVAL_EXPR_CNT(clauses) && match_same_patterns(m->patterns, clauses))
+    {
+        __atomic_add_fetch(&m->refs, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&match_lock);
+        *rv = m;
+        return 0;
+    }
+
+    pthread_mutex_unlock(&match_lock);
+    lval *patterns = lval_qexpression();
+    for (pair *ptr = clauses->value.list.head; ptr; ptr = ptr->next)
+    {
+        lval_add(patterns, lval_copy(LVAL_EXPR_FIRST(ptr->data)));
+    }
+
+    lval *err = match_compile(patterns, hash, &m);
+    if (err)
+    {
+        return err;
+    }
+
+    // Replaces whatever was in the slot; anyone still using it holds a reference
+    __atomic_add_fetch(&m->refs, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&match_lock);
+    matcher *old = match_cache[slot];
+    match_cache[slot] = m;
+    pthread_mutex_unlock(&match_lock);
+    if (old)
+    {
+        matcher_del(old);
+    }
+
+    *rv = m;
+    return 0;
+}
+
+static void match_bind_add(match_binds *binds, const char *name, lval *value, bool owned)
+{
+    if (binds->count == binds->cap)
+    {
+        binds->cap = binds->cap ? binds->cap * 2 : 8;
+        binds->binds = realloc(binds->binds, sizeof(match_bind) * binds->cap);
+    }
+
+    binds->binds[binds->count++] = (match_bind){ name, value, owned };
+}
+
+/**
+ * Removes the bindings made since a pattern started to match.
+ */
+static void match_binds_reset(match_binds *binds, size_t count)
+{
+    while (binds->count > count)
+    {
+        match_bind *bind = &binds->binds[--binds->count];
+        if (bind->owned)
+        {
+            lval_del(bind->value);
+        }
+    }
+}
+
+static bool match_pat_test(const match_pat *pat, lval *x, match_binds *binds)
+{
+    switch (pat->kind)
+    {
+    case MATCH_ANY:
+        return true;
+    case MATCH_BIND:
+        match_bind_add(binds, pat->value->value.str_val, x, false);
+        return true;
+    case MATCH_VALUE:
+        // Numbers match numbers of either type, as with =
+        return (x->type == pat->value->type ||
+                ((x->type == LVAL_LONG || x->type == LVAL_DOUBLE) &&
+                 (pat->value->type == LVAL_LONG || pat->value->type == LVAL_DOUBLE))) &&
+            lval_is_equal((lval*)pat->value, x);
+    case MATCH_LIST:
+        break;
+    }
+
+    if (x->type != LVAL_QEXPRESSION ||
+        (pat->rest ? LVAL_EXPR_CNT(x) < pat->count : LVAL_EXPR_CNT(x) != pat->count))
+    {
+        return false;
+    }
+
+    pair *ptr = x->value.list.head;
+    for (size_t i = 0; i < pat->count; i++, ptr = ptr->next)
+    {
+        if (!match_pat_test(&pat->items[i], ptr->data, binds))
+        {
+            return false;
+        }
+    }
+
+    if (pat->rest)
+    {
+        lval *rest = lval_qexpression();
+        for (; ptr; ptr = ptr->next)
+        {
+            lval_add(rest, lval_copy(ptr->data));
+        }
+
+        match_bind_add(binds, pat->rest, rest, true);
+    }
+
+    return true;
+}
+
+/**
+ * Finds the first clause matching a value, or -1 if there is none.
+ */
+static long match_find(const matcher *m, lval *x, match_binds *binds)
+{
+    for (size_t i = 0; i < m->node_count; i++)
+    {
+        const match_node *node = &m->nodes[i];
+        switch (node->kind)
+        {
+        case NODE_TEST:
+            if (match_pat_test(&m->pats[node->clause], x, binds))
+            {
+                return node->clause;
+            }
+
+            match_binds_reset(binds, 0);
+            break;
+        case NODE_INTS:
+        {
+            long v;
+            if (x->type == LVAL_LONG)
+            {
+                v = x->value.num_l;
+            }
+            else if (x->type == LVAL_DOUBLE && x->value.num_d >= LONG_MIN && x->value.num_d < LONG_MAX &&
+                     x->value.num_d == (long)x->value.num_d)
+            {
+                v = (long)x->value.num_d;
+            }
+            else
+            {
+                break;
+            }
+
+            unsigned long offset = (unsigned long)v - (unsigned long)node->min;
+            if (offset < node->span && node->table[offset] >= 0)
+            {
+                return node->table[offset];
+            }
+
+            break;
+        }
+        case NODE_STRINGS:
+        {
+            void *clause;
+            if (x->type == LVAL_STRING && hash_table_get(node->strings, x->value.str_val, &clause) == C_OK)
+            {
+                return (long)(uintptr_t)clause - 1;
+            }
+
+            break;
+        }
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Built-in function to evaluate the body of the first clause whose pattern matches
+ * a value.
+ */
+static lval *builtin_match(lenv *env, lval *args)
+{
+    LASSERT_ENV(args, env, BUILTIN_SYM_MATCH);
+    LASSERT_NO_ERROR(args);
+    LASSERT(args, LVAL_EXPR_CNT(args) >= 1, "function '%s' expects at least 1 argument, received %d",
+        BUILTIN_SYM_MATCH, LVAL_EXPR_CNT(args));
+
+    lval *x = lval_pop(args);
+    matcher *m = 0;
+    lval *err = match_get(args, &m);
+    if (err)
+    {
+        lval_del(x);
+        lval_del(args);
+        return err;
+    }
+
+    match_binds binds = { 0 };
+    long clause = match_find(m, x, &binds);
+    lval *rv;
+    if (clause < 0)
+    {
+        rv = lval_error("function '%s' no match found - no clause matches the %s", BUILTIN_SYM_MATCH,
+            ltype_name(x->type));
+    }
+    else
+    {
+        // The clauses are ours, so the body is taken rather than copied
+        lval *body = lval_expr_item(args, clause);
+        lval_del(lval_pop(body));
+        body = lval_pop(body);
+        if (!binds.count)
+        {
+            rv = lilith_eval_expr(env, body);
+        }
+        else
+        {
+            // The body sees the bindings in front of the caller's environment, as with let
+            lenv *nenv = lenv_new();
+            lenv_set_parent(nenv, env);
+            for (size_t i = 0; i < binds.count; i++)
+            {
+                lval *sym = lval_symbol(binds.binds[i].name);
+                lenv_put(nenv, sym, binds.binds[i].value);
+                lval_del(sym);
+            }
+
+            rv = lilith_eval_expr(nenv, body);
+            lenv_del(nenv);
+        }
+    }
+
+    match_binds_reset(&binds, 0);
+    free(binds.binds);
+    matcher_del(m);
+    lval_del(x);
+    lval_del(args);
+    return rv;
+}
+
+void lenv_add_builtins_match(lenv *e)
+{
+    lenv_add_builtin(e, BUILTIN_SYM_MATCH, builtin_match);
+}
@@ -0,0 +1,241 @@
+/*
+ * Modules -- Lilith files loaded once per interpreter by require. Each module is
+ * evaluated in its own namespace and only the symbols it provides are defined in
+ * the environment that requires it.
+ */
+
+#include <sys/stat.h>
+#include <collections.h>
+
+#include "lilith_int.h"
+#include "builtin_symbols.h"
+
+char *lookup_load_path(const char *filename, struct stat *fn);
+
+struct module
+{
+    char *path;             // resolved path of the module's file
+    time_t mtime;           // modification time of the file when loaded
+    off_t size;             // size of the file when loaded
+    lenv *env;              // the module's namespace
+    lval *exports;          // symbols named by provide, or 0 to export everything
+    struct module *retired; // the version this replaced, kept alive for functions imported from it
+};
+
+/**
+ * The latest version of the module loaded from a path.
+ */
+typedef struct
+{
+    struct module *module;
+} module_slot;
+
+/**
+ * The modules loaded by an interpreter.
+ */
+typedef struct
+{
+    void *paths;   // requested names to resolved paths
+    void *modules; // resolved paths to module slots
+} module_registry;
+
+static void module_del(struct module *m)
+{
+    while (m)
+    {
+        struct module *next = m->retired;
+        free(m->path);
+        lenv_del(m->env);
+        if (m->exports)
+        {
+            lval_del(m->exports);
+        }
+
+        free(m);
+        m = next;
+    }
+}
+
+void module_registry_del(void *registry)
+{
+    module_registry *reg = registry;
+    void *iter = clxns_iter_new(reg->paths);
+    while (clxns_iter_move_next(iter))
+    {
+        kvp *val = clxns_iter_get_next(iter);
+        free(val->key);
+        free(val->value);
+    }
+
+    clxns_iter_free(iter);
+    clxns_free(reg->paths, 0);
+
+    iter = clxns_iter_new(reg->modules);
+    while (clxns_iter_move_next(iter))
+    {
+        kvp *val = clxns_iter_get_next(iter);
+        module_slot *slot = val->value;
+        free(val->key);
+        module_del(slot->module);
+        free(slot);
+    }
+
+    clxns_iter_free(iter);
+    clxns_free(reg->modules, 0);
+    free(reg);
+}
+
+static module_registry *module_registry_get(lenv *env)
+{
+    void **slot = lenv_modules(env);
+    if (!*slot)
+    {
+        module_registry *reg = malloc(sizeof(module_registry));
+        reg->paths = hash_table(31);
+        reg->modules = hash_table(31);
+        *slot = reg;
+    }
+
+    return *slot;
+}
+
+/**
+ * Evaluates a module's parsed file in a new namespace.
+ *
+ * @param env  the environment of the interpreter loading the module
+ * @param path the resolved path of the file
+ * @param fn   the file's details
+ * @param expr the parsed file
+ * @param rv   populated with the new module on success
+ * @returns    0 on success, an error otherwise
+ */
+static lval *module_load(lenv *env, const char *path, struct stat *fn, lval *expr, struct module **rv)
+{
+    struct module *m = calloc(1, sizeof(struct module));
+    m->path = strdup(path);
+    m->mtime = fn->st_mtime;
+    m->size = fn->st_size;
+    m->env = lenv_module_new(env, m);
+
+    lval *x = multi_eval(m->env, expr);
+    if (x->type == LVAL_ERROR)
+    {
+        module_del(m);
+        return x;
+    }
+
+    lval_del(x);
+    *rv = m;
+    return 0;
+}
+
+/**
+ * Built-in function to load a module. The module's file is evaluated the first time
+ * it is required and again only if the file has changed. Its provided symbols are
+ * defined in the requiring environment.
+ */
+static lval *builtin_require(lenv *env, lval *args)
+{
+    LASSERT_ENV(args, env, BUILTIN_SYM_REQUIRE);
+    LASSERT_NO_ERROR(args);
+    LASSERT(args, LVAL_EXPR_CNT(args) == 1, "function '%s' expects 1 argument, received %d",
+        BUILTIN_SYM_REQUIRE, LVAL_EXPR_CNT(args));
+    LASSERT(args, LVAL_EXPR_FIRST(args)->type == LVAL_STRING,
+        "function '%s' type mismatch - expected %s, received %s",
+        BUILTIN_SYM_REQUIRE, ltype_name(LVAL_STRING), ltype_name(LVAL_EXPR_FIRST(args)->type));
+
+    module_registry *reg = module_registry_get(env);
+    const char *name = LVAL_EXPR_FIRST(args)->value.str_val;
+
+    // Bundled modules never change and are registered under their bundled name
+    struct stat fn = { 0 };
+    const lval *bundled = bundle_get(name);
+    char *path = (char*)name;
+    if (!bundled)
+    {
+        // Only search the LILITH_PATH the first time a name is required
+        if (hash_table_get(reg->paths, name, (void**)&path) == C_OK)
+        {
+            LASSERT(args, stat(path, &fn) == 0, "File not found %s", path);
+        }
+        else
+        {
+            path = lookup_load_path(name, &fn);
+            LASSERT(args, path, "File not found %s", name);
+            hash_table_add(reg->paths, strdup(name), path);
+        }
+    }
+
+    module_slot *slot;
+    if (hash_table_get(reg->modules, path, (void**)&slot) != C_OK)
+    {
+        slot = calloc(1, sizeof(module_slot));
+        hash_table_add(reg->modules, strdup(path), slot);
+    }
+
+    struct module *m = slot->module;
+    if (!m || m->mtime != fn.st_mtime || m->size != fn.st_size)
+    {
+        lval *expr = bundled ? lval_copy((lval*)bundled) : read_source_file(path, &fn);
+        LASSERT(args, expr, "unable to read module %s", path);
+
+        lval *err = module_load(lenv_root(env), path, &fn, expr, &m);
+        if (err)
+        {
+            lval_del(args);
+            return err;
+        }
+
+        m->retired = slot->module;
+        slot->module = m;
+    }
+
+    lval *err = lenv_import(env, m->env, m->exports);
+    lval_del(args);
+    return err ? err : lval_sexpression();
+}
+
+/**
+ * Built-in function to name the symbols a module defines in environments that require it.
+ */
+static lval *builtin_provide(lenv *env, lval *args)
+{
+    LASSERT_ENV(args, env, BUILTIN_SYM_PROVIDE);
+    LASSERT_NO_ERROR(args);
+    LASSERT(args, LVAL_EXPR_CNT(args) == 1, "function '%s' expects 1 argument, received %d",
+        BUILTIN_SYM_PROVIDE, LVAL_EXPR_CNT(args));
+    LASSERT(args, LVAL_EXPR_FIRST(args)->type == LVAL_QEXPRESSION,
+        "function '%s' type mismatch - expected %s, received %s",
+        BUILTIN_SYM_PROVIDE, ltype_name(LVAL_QEXPRESSION), ltype_name(LVAL_EXPR_FIRST(args)->type));
+
+    lval *syms = LVAL_EXPR_FIRST(args);
+    for (pair *ptr = syms->value.list.head; ptr; ptr = ptr->next)
+    {
+        LASSERT(args, ptr->data->type == LVAL_SYMBOL,
+            "function '%s' type mismatch - expected %s, received %s",
+            BUILTIN_SYM_PROVIDE, ltype_name(LVAL_SYMBOL), ltype_name(ptr->data->type));
+    }
+
+    struct module *m = lenv_module(env);
+    LASSERT(args, m, "function '%s' used outside of a module", BUILTIN_SYM_PROVIDE);
+
+    syms = lval_take(args, 0);
+    if (!m->exports)
+    {
+        m->exports = lval_qexpression();
+    }
+
+    while (LVAL_EXPR_CNT(syms))
+    {
+        lval_add(m->exports, lval_pop(syms));
+    }
+
+    lval_del(syms);
+    return lval_sexpression();
+}
+
+void lenv_add_builtins_modules(lenv *e)
+{
+    lenv_add_builtin(e, BUILTIN_SYM_REQUIRE, builtin_require);
+    lenv_add_builtin(e, BUILTIN_SYM_PROVIDE, builtin_provide);
+}
@@ -0,0 +1,173 @@
+/*
+ * In-place mutation. Every other update creates a new value, and looking a symbol
+ * up copies its value, so these take the symbol rather than the value, as def
+ * does, and change the value it is bound to directly. (set! {x} v) rebinds the
+ * nearest x; append!, set-nth! and reverse! change the q-expression bound to a
+ * symbol without copying it. Bindings in a shared environment, such as the
+ * standard library, are seen by every interpreter and other code may have been
+ * folded against them, so they cannot be changed.
+ */
+
+#include "lilith_int.h"
+#include "builtin_symbols.h"
+
+lval *mutate_find(lenv *env, lval *args, const char *symbol, lval **cell)
+{
+    LASSERT_ENV(args, env, symbol);
+    LASSERT_NO_ERROR(args);
+    LASSERT(args, LVAL_EXPR_CNT(args) > 0, "function '%s' expects at least 1 argument, received %d",
+        symbol, LVAL_EXPR_CNT(args));
+
+    lval *sym = LVAL_EXPR_FIRST(args);
+    LASSERT(args, sym->type == LVAL_QEXPRESSION && LVAL_EXPR_CNT(sym) == 1 &&
+        LVAL_EXPR_FIRST(sym)->type == LVAL_SYMBOL,
+        "function '%s' expects a q-expression holding one symbol", symbol);
+
+    const char *name = LVAL_EXPR_FIRST(sym)->value.str_val;
+    bool shared = false;
+    *cell = lenv_find_cell(env, name, &shared);
+    LASSERT(args, *cell, "unbound symbol '%s'", name);
+    LASSERT(args, !shared && (*cell)->type != LVAL_BUILTIN_FUN,
+        "function '%s' cannot modify '%s' - it is shared", symbol, name);
+
+    return 0;
+}
+
+/**
+ * As mutate_find, also checking the value is a q-expression.
+ */
+static lval *mutate_find_list(lenv *env, lval *args, const char *symbol, lval **cell)
+{
+    lval *err = mutate_find(env, args, symbol, cell);
+    if (err)
+    {
+        return err;
+    }
+
+    LASSERT(args, (*cell)->type == LVAL_QEXPRESSION, "function '%s' type mismatch - expected %s, received %s",
+        symbol, ltype_name(LVAL_QEXPRESSION), ltype_name((*cell)->type));
+
+    return 0;
+}
+
+/**
+ * Built-in function to replace the value of the nearest binding of a symbol.
+ */
+static lval *builtin_set(lenv *env, lval *args)
+{
+    lval *cell;
+    lval *err = mutate_find(env, args, BUILTIN_SYM_SET, &cell);
+    if (err)
+    {
+        return err;
+    }
+
+    LASSERT(args, LVAL_EXPR_CNT(args) == 2, "function '%s' expects 2 arguments, received %d",
+        BUILTIN_SYM_SET, LVAL_EXPR_CNT(args));
+
+    // Swap the contents so the old value is freed with the holder of the new one
+    lval *v = lval_take(args, 1);
+    lval old = *cell;
+    *cell = *v;
+    *v = old;
+    lval_del(v);
+    return lval_sexpression();
+}
+
+/**
+ * Built-in function to add values to the end of the q-expression bound to a symbol.
+ */
+static lval *builtin_append(lenv *env, lval *args)
+{
+    lval *cell;
+    lval *err = mutate_find_list(env, args, BUILTIN_SYM_APPEND, &cell);
+    if (err)
+    {
+        return err;
+    }
+
+    lval_del(lval_pop(args));
+    pair **last = &cell->value.list.head;
+    while (*last)
+    {
+        last = &(*last)->next;
+    }
+
+    // The argument list's items are linked on as they are
+    *last = args->value.list.head;
+    LVAL_EXPR_CNT(cell) += LVAL_EXPR_CNT(args);
+    args->value.list.head = 0;
+    LVAL_EXPR_CNT(args) = 0;
+    lval_del(args);
+    return lval_sexpression();
+}
+
+/**
+ * Built-in function to replace an item, counting from 0, of the q-expression
+ * bound to a symbol.
+ */
+static lval *builtin_set_nth(lenv *env, lval *args)
+{
+    lval *cell;
+    lval *err = mutate_find_list(env, args, BUILTIN_SYM_SET_NTH, &cell);
+    if (err)
+    {
+        return err;
+    }
+
+    LASSERT(args, LVAL_EXPR_CNT(args) == 3, "function '%s' expects 3 arguments, received %d",
+        BUILTIN_SYM_SET_NTH, LVAL_EXPR_CNT(args));
+
+    lval *n = lval_expr_item(args, 1);
+    LASSERT(args, n->type == LVAL_LONG, "function '%s' type mismatch - expected %s, received %s",
+        BUILTIN_SYM_SET_NTH, ltype_name(LVAL_LONG), ltype_name(n->type));
+    LASSERT(args, n->value.num_l >= 0 && (size_t)n->value.num_l < LVAL_EXPR_CNT(cell),
+        "function '%s' index %ld out of range", BUILTIN_SYM_SET_NTH, n->value.num_l);
+
+    pair *ptr = cell->value.list.head;
+    for (long i = n->value.num_l; i > 0; i--)
+    {
+        ptr = ptr->next;
+    }
+
+    lval_del(ptr->data);
+    ptr->data = lval_take(args, 2);
+    return lval_sexpression();
+}
+
+/**
+ * Built-in function to reverse the q-expression bound to a symbol.
+ */
+static lval *builtin_reverse(lenv *env, lval *args)
+{
+    lval *cell;
+    lval *err = mutate_find_list(env, args, BUILTIN_SYM_REVERSE, &cell);
+    if (err)
+    {
+        return err;
+    }
+
+    LASSERT(args, LVAL_EXPR_CNT(args) == 1, "function '%s' expects 1 argument, received %d",
+        BUILTIN_SYM_REVERSE, LVAL_EXPR_CNT(args));
+
+    pair *rv = 0;
+    for (pair *ptr = cell->value.list.head; ptr; )
+    {
+        pair *next = ptr->next;
+        ptr->next = rv;
+        rv = ptr;
+        ptr = next;
+    }
+
+    cell->value.list.head = rv;
+    lval_del(args);
+    return lval_sexpression();
+}
+
+void lenv_add_builtins_mutate(lenv *e)
+{
+    lenv_add_builtin(e, BUILTIN_SYM_SET, builtin_set);
+    lenv_add_builtin(e, BUILTIN_SYM_APPEND, builtin_append);
+    lenv_add_builtin(e, BUILTIN_SYM_SET_NTH, builtin_set_nth);
+    lenv_add_builtin(e, BUILTIN_SYM_REVERSE, builtin_reverse);
+}
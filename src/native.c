@@ -0,0 +1,945 @@
+/*
+ * Native code. Translates the functions defined in a Lilith file to C, and loads
+ * the shared library built from the result. A compiled function stays a normal
+ * Lilith function -- the interpreter calls the compiled form whenever it is called
+ * with all of its arguments -- so compiled and interpreted code call each other
+ * through the environment and either can be redefined.
+ */
+
+#include <stdarg.h>
+#include <dlfcn.h>
+
+#include "lilith_native.h"
+
+#define BUILTIN_SYM_LOAD_NATIVE "load-native"
+#define NATIVE_INIT "lilith_native_init"
+#define NATIVE_VERSION "lilith_native_version"
+
+/**
+ * The built-in function for each operation.
+ */
+static const char *native_op_syms[] =
+{
+    "+", "-", "*", "/", "%", "max", "min", ">", "<", ">=", "<=", BUILTIN_SYM_EQ
+};
+
+/**
+ * The name of each operation in generated code.
+ */
+static const char *native_op_names[] =
+{
+    "NATIVE_ADD", "NATIVE_SUB", "NATIVE_MUL", "NATIVE_DIV", "NATIVE_MOD", "NATIVE_MAX",
+    "NATIVE_MIN", "NATIVE_GT", "NATIVE_LT", "NATIVE_GTE", "NATIVE_LTE", "NATIVE_EQ"
+};
+
+/**
+ * The name in generated code of each type a function can be annotated with.
+ */
+static const char *native_type_names[] =
+{
+    [LVAL_LONG] = "LVAL_LONG", [LVAL_DOUBLE] = "LVAL_DOUBLE", [LVAL_BOOL] = "LVAL_BOOL",
+    [LVAL_STRING] = "LVAL_STRING", [LVAL_QEXPRESSION] = "LVAL_QEXPRESSION"
+};
+
+lval *native_get(lenv *env, const char *name)
+{
+    lval *rv = lenv_find(env, name);
+    return rv ? lval_copy(rv) : lval_error("unbound symbol '%s'", name);
+}
+
+void native_bind(lenv *env, const char *name, lval *val)
+{
+    lval *k = lval_symbol(name);
+    lenv_put(env, k, val);
+    lval_del(k);
+}
+
+lval *native_op_slow(lenv *env, int op, lval *x, lval *y, unsigned owned)
+{
+    lval *args = lval_sexpression();
+    lval_add(args, (owned & 1) ? x : lval_copy(x));
+    lval_add(args, (owned & 2) ? y : lval_copy(y));
+    return call_builtin(env, (char*)native_op_syms[op], args);
+}
+
+lval *native_call_known(lenv *env, const char *name, lbuiltin fn, lval *args)
+{
+    lval *f = lenv_find(env, name);
+    if (f && f->type == LVAL_USER_FUN && f->value.user_fun.native == fn)
+    {
+        return fn(f->value.user_fun.scope ? f->value.user_fun.scope : env, args);
+    }
+
+    // Redefined since it was compiled
+    lval *call = lval_add(lval_sexpression(), f ? lval_copy(f) : lval_error("unbound symbol '%s'", name));
+    while (LVAL_EXPR_CNT(args))
+    {
+        lval_add(call, lval_pop(args));
+    }
+
+    lval_del(args);
+    return lval_apply(env, call);
+}
+
+lval *native_load(lenv *env, const native_def *defs, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        const char *pos = (const char*)defs[i].expr;
+        lval *expr = lval_deserialise(&pos, pos + defs[i].len);
+        if (!expr)
+        {
+            return lval_error("compiled expression %zu is invalid", i);
+        }
+
+        lval *x = multi_eval(env, lval_add(lval_sexpression(), expr));
+        if (x->type == LVAL_ERROR)
+        {
+            return x;
+        }
+
+        lval_del(x);
+        if (defs[i].fn)
+        {
+            lval *f = lenv_find(env, defs[i].name);
+            if (f && f->type == LVAL_USER_FUN)
+            {
+                f->value.user_fun.native = defs[i].fn;
+            }
+        }
+    }
+
+    return lval_sexpression();
+}
+
+/**
+ * Built-in function to load a shared library built from the output of --emit-c.
+ */
+static lval *builtin_load_native(lenv *env, lval *args)
+{
+    LASSERT_ENV(args, env, BUILTIN_SYM_LOAD_NATIVE);
+    LASSERT_NO_ERROR(args);
+    LASSERT(args, LVAL_EXPR_CNT(args) == 1, "function '%s' expects 1 argument, received %d",
+        BUILTIN_SYM_LOAD_NATIVE, LVAL_EXPR_CNT(args));
+    LASSERT(args, LVAL_EXPR_FIRST(args)->type == LVAL_STRING,
+        "function '%s' type mismatch - expected %s, received %s",
+        BUILTIN_SYM_LOAD_NATIVE, ltype_name(LVAL_STRING), ltype_name(LVAL_EXPR_FIRST(args)->type));
+
+    const char *path = LVAL_EXPR_FIRST(args)->value.str_val;
+    void *handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    LASSERT(args, handle, "unable to load %s: %s", path, dlerror());
+
+    // Compiled code depends on the layout of the interpreter's values
+    const char *version = dlsym(handle, NATIVE_VERSION);
+    lval *(*init)(lenv*) = (lval *(*)(lenv*))dlsym(handle, NATIVE_INIT);
+    if (!version || !init || strcmp(version, LILITH_VERSION))
+    {
+        dlclose(handle);
+        LASSERT(args, false, "%s was not compiled for Lilith " LILITH_VERSION, path);
+    }
+
+    // The library stays loaded for as long as its functions might be called
+    lval_del(args);
+    return init(env);
+}
+
+void lenv_add_builtins_native(lenv *e)
+{
+    lenv_add_builtin(e, BUILTIN_SYM_LOAD_NATIVE, builtin_load_native);
+}
+
+/*
+ * The compiler. Each expression is translated to a C expression of one of the
+ * kinds below. Sub-expressions that are evaluated in order are wrapped in GNU
+ * statement expressions.
+ */
+
+enum
+{
+    K_LONG,   // a C long -- the value is known to be an integer
+    K_DOUBLE, // a C double -- the value is known to be a decimal
+    K_COND,   // a C int -- the value is known to be a boolean
+    K_BORROW, // an lval that must not be freed, such as an argument
+    K_OWNED   // a new lval
+};
+
+typedef struct
+{
+    int kind;
+    bool pure; // has no side effects, so can be evaluated out of order
+    char *code;
+} frag;
+
+/**
+ * A function being compiled.
+ */
+typedef struct
+{
+    char *name;    // Lilith name
+    char *cname;   // C name
+    lval *formals; // argument symbols
+    lval *body;    // body q-expression
+    int *types;    // the annotated type of each argument
+    int ret;       // the annotated result type
+} native_fn;
+
+typedef struct
+{
+    native_fn *fns;
+    size_t count;
+    native_fn *current;
+    bool needs_env; // the current function quotes code, which may refer to its arguments
+    bool uses_env;  // the code generated for the current function refers to e
+    bool unboxed;   // the arguments are known to be of their annotated types
+    unsigned temps;
+} native_ctx;
+
+static char *strf(const char *fmt, ...)
+{
+    va_list va;
+    va_start(va, fmt);
+    int len = vsnprintf(0, 0, fmt, va);
+    va_end(va);
+
+    char *rv = malloc(len + 1);
+    va_start(va, fmt);
+    vsnprintf(rv, len + 1, fmt, va);
+    va_end(va);
+    return rv;
+}
+
+/**
+ * Quotes a string as a C string literal.
+ */
+static char *c_string(const char *str)
+{
+    lbuf buf;
+    lbuf_init(&buf);
+    lbuf_write(&buf, "\"", 1);
+    for (const unsigned char *ptr = (const unsigned char*)str; *ptr; ptr++)
+    {
+        char esc[8];
+        if (*ptr == '"' || *ptr == '\\')
+        {
+            sprintf(esc, "\\%c", *ptr);
+        }
+        else if (*ptr < ' ' || *ptr > '~')
+        {
+            // Octal escapes so following characters are not taken as part of the escape
+            sprintf(esc, "\\%03o", *ptr);
+        }
+        else
+        {
+            sprintf(esc, "%c", *ptr);
+        }
+
+        lbuf_write(&buf, esc, strlen(esc));
+    }
+
+    lbuf_write(&buf, "\"", 2);
+    return buf.data;
+}
+
+static char *c_long(long num)
+{
+    return num == LONG_MIN ? strdup("LONG_MIN") : strf("%ldL", num);
+}
+
+static frag frag_new(int kind, bool pure, char *code)
+{
+    frag rv = { kind, pure, code };
+    return rv;
+}
+
+/**
+ * Converts a fragment to code for a new lval.
+ */
+static char *frag_owned(frag f)
+{
+    char *rv;
+    switch (f.kind)
+    {
+    case K_LONG:   rv = strf("lval_long(%s)", f.code); break;
+    case K_DOUBLE: rv = strf("lval_double(%s)", f.code); break;
+    case K_COND:   rv = strf("lval_bool(%s)", f.code); break;
+    case K_BORROW: rv = strf("lval_copy(%s)", f.code); break;
+    default:       return f.code;
+    }
+
+    free(f.code);
+    return rv;
+}
+
+/**
+ * Converts a fragment to code for an lval that may or may not need freeing.
+ */
+static char *frag_ref(frag f, bool *owned)
+{
+    char *rv;
+    *owned = false;
+    switch (f.kind)
+    {
+    case K_LONG: rv = strf("native_long_ref(%s)", f.code); break;
+    case K_DOUBLE: rv = strf("native_double_ref(%s)", f.code); break;
+    case K_COND: rv = strf("native_bool_ref(%s)", f.code); break;
+    case K_BORROW: return f.code;
+    default:
+        *owned = true;
+        return f.code;
+    }
+
+    free(f.code);
+    return rv;
+}
+
+static int formal_index(native_ctx *ctx, const char *sym)
+{
+    int i = 0;
+    for (pair *ptr = ctx->current->formals->value.list.head; ptr; ptr = ptr->next, i++)
+    {
+        if (!strcmp(ptr->data->value.str_val, sym))
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Gets the kind of an argument -- unboxed when compiling for arguments of the
+ * annotated types.
+ */
+static int formal_kind(native_ctx *ctx, int i)
+{
+    if (i < 0 || !ctx->unboxed)
+    {
+        return K_BORROW;
+    }
+
+    switch (ctx->current->types[i])
+    {
+    case LVAL_LONG:   return K_LONG;
+    case LVAL_DOUBLE: return K_DOUBLE;
+    case LVAL_BOOL:   return K_COND;
+    default:          return K_BORROW;
+    }
+}
+
+/**
+ * Generates code constructing a copy of a quoted value.
+ */
+static char *compile_quote(const lval *v)
+{
+    switch (v->type)
+    {
+    case LVAL_LONG:
+    {
+        char *num = c_long(v->value.num_l);
+        char *rv = strf("lval_long(%s)", num);
+        free(num);
+        return rv;
+    }
+    case LVAL_DOUBLE:
+        return strf("lval_double(%a)", v->value.num_d);
+    case LVAL_BOOL:
+        return strf("lval_bool(%d)", v->value.bval);
+    case LVAL_STRING:
+    case LVAL_SYMBOL:
+    {
+        char *str = c_string(v->value.str_val);
+        char *rv = strf(v->type == LVAL_STRING ? "lval_string(%s)" : "lval_symbol(%s)", str);
+        free(str);
+        return rv;
+    }
+    }
+
+    char *rv = strdup(v->type == LVAL_SEXPRESSION ? "lval_sexpression()" : "lval_qexpression()");
+    for (pair *ptr = v->value.list.head; ptr; ptr = ptr->next)
+    {
+        char *item = compile_quote(ptr->data);
+        char *next = strf("lval_add(%s, %s)", rv, item);
+        free(item);
+        free(rv);
+        rv = next;
+    }
+
+    return rv;
+}
+
+static frag compile_expr(native_ctx *ctx, lval *v);
+static frag compile_sexpr(native_ctx *ctx, lval *v);
+
+/**
+ * Generates code building an s-expression from a list of values, in order.
+ */
+static char *compile_list(native_ctx *ctx, pair *items)
+{
+    unsigned l = ctx->temps++;
+    char *rv = strf("({ lval *_l%u = lval_sexpression(); ", l);
+    for (pair *ptr = items; ptr; ptr = ptr->next)
+    {
+        char *item = frag_owned(compile_expr(ctx, ptr->data));
+        char *next = strf("%slval_add(_l%u, %s); ", rv, l, item);
+        free(item);
+        free(rv);
+        rv = next;
+    }
+
+    char *next = strf("%s_l%u; })", rv, l);
+    free(rv);
+    return next;
+}
+
+/**
+ * Generates a call to native_op, keeping the order of evaluation of the arguments.
+ */
+static frag compile_op(native_ctx *ctx, int op, frag x, frag y)
+{
+    bool x_owned, y_owned;
+    bool seq = !x.pure && !y.pure;
+    char *xc = frag_ref(x, &x_owned);
+    char *yc = frag_ref(y, &y_owned);
+    unsigned owned = (x_owned ? 1 : 0) | (y_owned ? 2 : 0);
+
+    char *rv;
+    ctx->uses_env = true;
+    if (seq)
+    {
+        unsigned t = ctx->temps++;
+        rv = strf("({ lval *_x%u = %s; native_op(e, %s, _x%u, %s, %u); })", t, xc, native_op_names[op], t, yc, owned);
+    }
+    else
+    {
+        rv = strf("native_op(e, %s, %s, %s, %u)", native_op_names[op], xc, yc, owned);
+    }
+
+    free(xc);
+    free(yc);
+    return frag_new(K_OWNED, false, rv);
+}
+
+static bool is_number(frag f)
+{
+    return f.kind == K_LONG || f.kind == K_DOUBLE;
+}
+
+/**
+ * Arithmetic on numbers is done unboxed -- in longs until a decimal is reached, as
+ * the built-in functions do, then in doubles. Otherwise pairs of values go through
+ * native_op and longer argument lists through the built-in function.
+ */
+static frag compile_arith(native_ctx *ctx, int op, lval *v)
+{
+    size_t argc = LVAL_EXPR_CNT(v) - 1;
+    frag args[argc];
+    bool all_numbers = true;
+
+    size_t i = 0;
+    for (pair *ptr = v->value.list.head->next; ptr; ptr = ptr->next, i++)
+    {
+        args[i] = compile_expr(ctx, ptr->data);
+        all_numbers = all_numbers && is_number(args[i]);
+    }
+
+    if (all_numbers && op != NATIVE_DIV && op != NATIVE_MOD && (argc > 1 || op == NATIVE_SUB))
+    {
+        int kind = args[0].kind;
+        char *rv = argc == 1 ? strf("(-(%s))", args[0].code) : strdup(args[0].code);
+        free(args[0].code);
+        for (i = 1; i < argc; i++)
+        {
+            kind = kind == K_LONG && args[i].kind == K_LONG ? K_LONG : K_DOUBLE;
+            const char *cast = kind == K_DOUBLE ? "(double)" : "";
+            char *next;
+            switch (op)
+            {
+            case NATIVE_ADD: next = strf("(%s%s + %s)", cast, rv, args[i].code); break;
+            case NATIVE_SUB: next = strf("(%s%s - %s)", cast, rv, args[i].code); break;
+            case NATIVE_MUL: next = strf("(%s%s * %s)", cast, rv, args[i].code); break;
+            case NATIVE_MAX:
+                next = strf(kind == K_LONG ? "native_max_l(%s, %s)" : "native_max_d(%s, %s)", rv, args[i].code);
+                break;
+            default:
+                next = strf(kind == K_LONG ? "native_min_l(%s, %s)" : "native_min_d(%s, %s)", rv, args[i].code);
+                break;
+            }
+
+            free(rv);
+            free(args[i].code);
+            rv = next;
+        }
+
+        return frag_new(kind, true, rv);
+    }
+
+    if (argc == 2)
+    {
+        return compile_op(ctx, op, args[0], args[1]);
+    }
+
+    for (i = 0; i < argc; i++)
+    {
+        free(args[i].code);
+    }
+
+    char *sym = c_string(native_op_syms[op]);
+    char *list = compile_list(ctx, v->value.list.head->next);
+    char *rv = strf("call_builtin(e, %s, %s)", sym, list);
+    ctx->uses_env = true;
+    free(sym);
+    free(list);
+    return frag_new(K_OWNED, false, rv);
+}
+
+static frag compile_compare(native_ctx *ctx, int op, lval *v)
+{
+    frag x = compile_expr(ctx, lval_expr_item(v, 1));
+    frag y = compile_expr(ctx, lval_expr_item(v, 2));
+    // A long compared with a double is converted, as the built-in functions do
+    if ((is_number(x) && is_number(y)) || (op == NATIVE_EQ && x.kind == K_COND && y.kind == K_COND))
+    {
+        static const char *ops[] = { [NATIVE_GT] = ">", [NATIVE_LT] = "<", [NATIVE_GTE] = ">=",
+                                     [NATIVE_LTE] = "<=", [NATIVE_EQ] = "==" };
+        char *rv = strf("(%s %s %s)", x.code, ops[op], y.code);
+        free(x.code);
+        free(y.code);
+        return frag_new(K_COND, true, rv);
+    }
+
+    return compile_op(ctx, op, x, y);
+}
+
+/**
+ * An if with literal branches evaluates the chosen branch inline. When both
+ * branches give unboxed values of the same kind the result stays unboxed.
+ */
+static frag compile_if(native_ctx *ctx, lval *v)
+{
+    frag cond = compile_expr(ctx, lval_expr_item(v, 1));
+    frag x = compile_sexpr(ctx, lval_expr_item(v, 2));
+    frag y = compile_sexpr(ctx, lval_expr_item(v, 3));
+    if (cond.kind == K_COND && x.kind == y.kind && x.kind <= K_COND)
+    {
+        char *rv = strf("((%s) ? %s : %s)", cond.code, x.code, y.code);
+        bool pure = cond.pure && x.pure && y.pure;
+        free(cond.code);
+        free(x.code);
+        free(y.code);
+        return frag_new(x.kind, pure, rv);
+    }
+
+    char *br_true = frag_owned(x);
+    char *br_false = frag_owned(y);
+    char *rv;
+    if (cond.kind == K_COND)
+    {
+        rv = strf("((%s) ? %s : %s)", cond.code, br_true, br_false);
+        free(cond.code);
+    }
+    else
+    {
+        unsigned t = ctx->temps++;
+        char *c = frag_owned(cond);
+        rv = strf("({ lval *_c%u = %s; int _t%u = native_test(&_c%u); _t%u < 0 ? _c%u : _t%u ? %s : %s; })",
+            t, c, t, t, t, t, t, br_true, br_false);
+        free(c);
+    }
+
+    free(br_true);
+    free(br_false);
+    return frag_new(K_OWNED, false, rv);
+}
+
+static native_fn *find_fn(native_ctx *ctx, const char *name)
+{
+    for (size_t i = 0; i < ctx->count; i++)
+    {
+        if (!strcmp(ctx->fns[i].name, name))
+        {
+            return &ctx->fns[i];
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Translates an s-expression, or the contents of a q-expression evaluated as one.
+ */
+static frag compile_sexpr(native_ctx *ctx, lval *v)
+{
+    size_t cnt = LVAL_EXPR_CNT(v);
+    if (cnt == 0)
+    {
+        return frag_new(K_OWNED, true, strdup("lval_sexpression()"));
+    }
+
+    lval *head = LVAL_EXPR_FIRST(v);
+
+    // A single value that cannot be a function is the result
+    if (cnt == 1 && ((head->type != LVAL_SYMBOL && head->type != LVAL_SEXPRESSION) ||
+        (head->type == LVAL_SYMBOL && formal_kind(ctx, formal_index(ctx, head->value.str_val)) != K_BORROW)))
+    {
+        return compile_expr(ctx, head);
+    }
+
+    // Built-ins cannot be redefined, so calls to them can be compiled inline
+    if (head->type == LVAL_SYMBOL && formal_index(ctx, head->value.str_val) < 0)
+    {
+        const char *sym = head->value.str_val;
+        if (!strcmp(sym, BUILTIN_SYM_IF) && cnt == 4 &&
+            lval_expr_item(v, 2)->type == LVAL_QEXPRESSION && lval_expr_item(v, 3)->type == LVAL_QEXPRESSION)
+        {
+            return compile_if(ctx, v);
+        }
+
+        for (int op = NATIVE_ADD; op <= NATIVE_EQ; op++)
+        {
+            if (!strcmp(sym, native_op_syms[op]))
+            {
+                if (op >= NATIVE_GT && cnt == 3)
+                {
+                    return compile_compare(ctx, op, v);
+                }
+                else if (op < NATIVE_GT && cnt >= 2)
+                {
+                    return compile_arith(ctx, op, v);
+                }
+            }
+        }
+
+        native_fn *fn = find_fn(ctx, sym);
+        if (fn && cnt > 1 && cnt - 1 == LVAL_EXPR_CNT(fn->formals))
+        {
+            char *name = c_string(sym);
+            char *list = compile_list(ctx, v->value.list.head->next);
+            char *rv = strf("native_call_known(e, %s, %s, %s)", name, fn->cname, list);
+            ctx->uses_env = true;
+            free(name);
+            free(list);
+            return frag_new(K_OWNED, false, rv);
+        }
+    }
+
+    char *list = compile_list(ctx, v->value.list.head);
+    char *rv = strf("lval_apply(e, %s)", list);
+    ctx->uses_env = true;
+    free(list);
+    return frag_new(K_OWNED, false, rv);
+}
+
+static frag compile_expr(native_ctx *ctx, lval *v)
+{
+    switch (v->type)
+    {
+    case LVAL_LONG:
+        return frag_new(K_LONG, true, c_long(v->value.num_l));
+    case LVAL_BOOL:
+        return frag_new(K_COND, true, strdup(v->value.bval ? "1" : "0"));
+    case LVAL_DOUBLE:
+        return frag_new(K_DOUBLE, true, strf("%a", v->value.num_d));
+    case LVAL_STRING:
+        return frag_new(K_OWNED, true, compile_quote(v));
+    case LVAL_SYMBOL:
+    {
+        int i = formal_index(ctx, v->value.str_val);
+        int kind = formal_kind(ctx, i);
+        if (kind != K_BORROW)
+        {
+            return frag_new(kind, true, strf("u%d", i));
+        }
+
+        if (i >= 0)
+        {
+            return frag_new(K_BORROW, true, strf("a%d", i));
+        }
+
+        char *name = c_string(v->value.str_val);
+        char *rv = strf("native_get(e, %s)", name);
+        ctx->uses_env = true;
+        free(name);
+        return frag_new(K_OWNED, false, rv);
+    }
+    case LVAL_SEXPRESSION:
+        return compile_sexpr(ctx, v);
+    }
+
+    // Quoted code is evaluated by something else and may refer to the arguments by name
+    ctx->needs_env = true;
+    return frag_new(K_OWNED, true, compile_quote(v));
+}
+
+/**
+ * Checks for a function definition the compiler can translate, i.e.
+ * (defun {name args...} {body}) where none of the arguments are variadic.
+ */
+static bool is_compilable(const lval *v)
+{
+    if (v->type != LVAL_SEXPRESSION || LVAL_EXPR_CNT(v) != 3)
+    {
+        return false;
+    }
+
+    const lval *sym = lval_expr_item((lval*)v, 0);
+    const lval *args = lval_expr_item((lval*)v, 1);
+    const lval *body = lval_expr_item((lval*)v, 2);
+    if (sym->type != LVAL_SYMBOL || strcmp(sym->value.str_val, "defun") ||
+        args->type != LVAL_QEXPRESSION || !LVAL_EXPR_CNT(args) || body->type != LVAL_QEXPRESSION)
+    {
+        return false;
+    }
+
+    // Invalid annotations are left to the interpreter to report
+    for (pair *ptr = args->value.list.head; ptr; ptr = ptr->next)
+    {
+        size_t len;
+        if (ptr->data->type != LVAL_SYMBOL || !strcmp(ptr->data->value.str_val, "&") ||
+            lfun_parse_formal(ptr->data->value.str_val, &len) == LTYPE_INVALID ||
+            (!len && ptr->next))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void emit(FILE *out, const char *str)
+{
+    fputs(str, out);
+}
+
+/**
+ * Generates the code for a function's result, checked against its annotated type
+ * unless the kind of the value shows it has that type.
+ */
+static char *compile_body(native_ctx *ctx, native_fn *fn)
+{
+    frag f = compile_sexpr(ctx, fn->body);
+    bool proven = (f.kind == K_LONG && fn->ret == LVAL_LONG) || (f.kind == K_DOUBLE && fn->ret == LVAL_DOUBLE) ||
+        (f.kind == K_COND && fn->ret == LVAL_BOOL);
+
+    char *body = frag_owned(f);
+    if (fn->ret == LTYPE_ANY || proven)
+    {
+        return body;
+    }
+
+    char *rv = strf("lfun_check_type(%s, %s)", native_type_names[fn->ret], body);
+    free(body);
+    return rv;
+}
+
+static void compile_fn(native_ctx *ctx, native_fn *fn, FILE *out)
+{
+    ctx->current = fn;
+    ctx->needs_env = false;
+    ctx->uses_env = false;
+    ctx->unboxed = false;
+    ctx->temps = 0;
+    char *body = compile_body(ctx, fn);
+
+    // Arguments of the annotated types are unboxed in a second version of the body
+    size_t argc = LVAL_EXPR_CNT(fn->formals);
+    char *unboxed = 0;
+    for (size_t i = 0; i < argc && !unboxed; i++)
+    {
+        ctx->unboxed = true;
+        if (formal_kind(ctx, i) != K_BORROW)
+        {
+            unboxed = compile_body(ctx, fn);
+        }
+    }
+
+    ctx->unboxed = unboxed != 0;
+
+    fprintf(out, "\n// %s\nstatic lval *%s(lenv *env, lval *args)\n{\n", fn->name, fn->cname);
+    emit(out, "    NATIVE_ENTER(args);\n");
+    for (size_t i = 0; i < argc; i++)
+    {
+        fprintf(out, "    lval *a%zu = lval_pop(args);\n", i);
+    }
+
+    emit(out, "    lval_del(args);\n");
+    if (ctx->needs_env)
+    {
+        emit(out, "    lenv *e = lenv_new();\n    lenv_set_parent(e, env);\n");
+        size_t i = 0;
+        for (pair *ptr = fn->formals->value.list.head; ptr; ptr = ptr->next, i++)
+        {
+            char *name = c_string(ptr->data->value.str_val);
+            fprintf(out, "    native_bind(e, %s, a%zu);\n", name, i);
+            free(name);
+        }
+    }
+    else if (ctx->uses_env)
+    {
+        emit(out, "    lenv *e = env;\n");
+    }
+
+    if (unboxed)
+    {
+        // Guarded by the types of the arguments, falling back to the general version
+        static const char *ctypes[] = { [K_LONG] = "long", [K_DOUBLE] = "double", [K_COND] = "int" };
+        static const char *fields[] = { [K_LONG] = "num_l", [K_DOUBLE] = "num_d", [K_COND] = "bval" };
+
+        const char *sep = "    lval *rv;\n    if (";
+        for (size_t i = 0; i < argc; i++)
+        {
+            if (formal_kind(ctx, i) != K_BORROW)
+            {
+                fprintf(out, "%sa%zu->type == %s", sep, i, native_type_names[fn->types[i]]);
+                sep = " && ";
+            }
+        }
+
+        emit(out, ")\n    {\n");
+        for (size_t i = 0; i < argc; i++)
+        {
+            int kind = formal_kind(ctx, i);
+            if (kind != K_BORROW)
+            {
+                fprintf(out, "        %s u%zu = a%zu->value.%s;\n", ctypes[kind], i, i, fields[kind]);
+            }
+        }
+
+        fprintf(out, "        rv = %s;\n    }\n    else\n    {\n        rv = %s;\n    }\n\n", unboxed, body);
+    }
+    else
+    {
+        fprintf(out, "    lval *rv = %s;\n", body);
+    }
+
+    for (size_t i = 0; i < argc; i++)
+    {
+        fprintf(out, "    lval_del(a%zu);\n", i);
+    }
+
+    if (ctx->needs_env)
+    {
+        emit(out, "    lenv_del(e);\n");
+    }
+
+    emit(out, "    return rv;\n}\n");
+    free(unboxed);
+    free(body);
+}
+
+lval *lilith_emit_c(const char *filename, const char *output)
+{
+    struct stat fn;
+    lval *exprs = stat(filename, &fn) == 0 ? read_source_file(filename, &fn) : 0;
+    if (!exprs || exprs->type == LVAL_ERROR)
+    {
+        return exprs ? exprs : lval_error("File not found %s", filename);
+    }
+
+    FILE *out = output ? fopen(output, "w") : stdout;
+    if (!out)
+    {
+        lval_del(exprs);
+        return lval_error("unable to create %s", output);
+    }
+
+    // Every definition is known before any body is compiled so they can call each other directly
+    native_ctx ctx = { calloc(LVAL_EXPR_CNT(exprs) + 1, sizeof(native_fn)), 0, 0, false, false, false, 0 };
+    for (pair *ptr = exprs->value.list.head; ptr; ptr = ptr->next)
+    {
+        if (is_compilable(ptr->data))
+        {
+            lval *args = lval_expr_item(ptr->data, 1);
+            native_fn *f = &ctx.fns[ctx.count];
+            f->name = LVAL_EXPR_FIRST(args)->value.str_val;
+            f->cname = strf("native_fn_%zu", ctx.count);
+            f->formals = lval_qexpression();
+            f->types = malloc(sizeof(int) * LVAL_EXPR_CNT(args));
+            f->ret = LTYPE_ANY;
+            for (pair *arg = args->value.list.head->next; arg; arg = arg->next)
+            {
+                // The annotations are removed, as the interpreter does
+                size_t len;
+                int type = lfun_parse_formal(arg->data->value.str_val, &len);
+                if (!len)
+                {
+                    f->ret = type;
+                    continue;
+                }
+
+                lval *sym = lval_copy(arg->data);
+                sym->value.str_val[len] = 0;
+                f->types[LVAL_EXPR_CNT(f->formals)] = type;
+                lval_add(f->formals, sym);
+            }
+
+            f->body = lval_expr_item(ptr->data, 2);
+            ctx.count++;
+        }
+    }
+
+    fprintf(out, "/*\n * Generated by lilith --emit-c from %s. Build with e.g.\n"
+        " *   cc -O2 -shared -fPIC -I<lilith>/src -o file.so file.c\n"
+        " * and load in to Lilith with (load-native \"file.so\").\n */\n\n"
+        "#include \"lilith_native.h\"\n\n"
+        "const char " NATIVE_VERSION "[] = LILITH_VERSION;\n", filename);
+
+    for (size_t i = 0; i < ctx.count; i++)
+    {
+        compile_fn(&ctx, &ctx.fns[i], out);
+    }
+
+    // Every top-level expression, in binary form
+    size_t i = 0;
+    for (pair *ptr = exprs->value.list.head; ptr; ptr = ptr->next, i++)
+    {
+        lbuf buf;
+        lbuf_init(&buf);
+        lval_serialise(&buf, ptr->data);
+        fprintf(out, "\nstatic const unsigned char expr_%zu[] =\n{", i);
+        for (size_t j = 0; j < buf.len; j++)
+        {
+            fprintf(out, "%s0x%02x,", j % 16 ? " " : "\n    ", (unsigned char)buf.data[j]);
+        }
+
+        emit(out, "\n};\n");
+        lbuf_free(&buf);
+    }
+
+    emit(out, "\nstatic const native_def defs[] =\n{\n");
+    size_t f = 0;
+    i = 0;
+    for (pair *ptr = exprs->value.list.head; ptr; ptr = ptr->next, i++)
+    {
+        if (is_compilable(ptr->data))
+        {
+            char *name = c_string(ctx.fns[f].name);
+            fprintf(out, "    { %s, %s, expr_%zu, sizeof(expr_%zu) },\n", name, ctx.fns[f].cname, i, i);
+            free(name);
+            f++;
+        }
+        else
+        {
+            fprintf(out, "    { 0, 0, expr_%zu, sizeof(expr_%zu) },\n", i, i);
+        }
+    }
+
+    emit(out, "};\n\nlval *" NATIVE_INIT "(lenv *env)\n{\n"
+        "    return native_load(env, defs, sizeof(defs) / sizeof(defs[0]));\n}\n");
+
+    bool ok = !ferror(out);
+    if (output)
+    {
+        ok = (fclose(out) == 0) && ok;
+    }
+
+    for (i = 0; i < ctx.count; i++)
+    {
+        free(ctx.fns[i].cname);
+        free(ctx.fns[i].types);
+        lval_del(ctx.fns[i].formals);
+    }
+
+    free(ctx.fns);
+    lval_del(exprs);
+    return ok ? 0 : lval_error("unable to write %s", output ? output : "output");
+}
@@ -0,0 +1,154 @@
+/*
+ * Buffered output. Text printed by Lilith is collected in a buffer and handed to
+ * a host-supplied sink when the buffer fills or is flushed.
+ */
+
+#include <stdarg.h>
+#include "lilith_int.h"
+
+#define LOUT_BUF_SIZE 4096
+
+struct lout
+{
+    lilith_sink sink; // where the output ends up
+    char *buf;        // pending output
+    size_t len;       // number of bytes pending
+    size_t cap;       // size of the buffer -- zero for unbuffered output
+};
+
+static void stdout_write(void *ctx, const char *data, size_t len)
+{
+    fwrite(data, 1, len, stdout);
+}
+
+static void stdout_flush(void *ctx)
+{
+    fflush(stdout);
+}
+
+static void stderr_write(void *ctx, const char *data, size_t len)
+{
+    fwrite(data, 1, len, stderr);
+}
+
+static void stderr_flush(void *ctx)
+{
+    fflush(stderr);
+}
+
+/**
+ * Unbuffered output used when an environment has no sink of its own.
+ */
+static lout stdout_direct = { { stdout_write, stdout_flush, 0 }, 0, 0, 0 };
+static lout stderr_direct = { { stderr_write, stderr_flush, 0 }, 0, 0, 0 };
+
+lout *lout_new(const lilith_sink *sink, bool errors)
+{
+    lout *rv = malloc(sizeof(lout));
+    if (sink)
+    {
+        rv->sink = *sink;
+    }
+    else
+    {
+        rv->sink = errors ? stderr_direct.sink : stdout_direct.sink;
+    }
+
+    rv->buf = malloc(LOUT_BUF_SIZE);
+    rv->len = 0;
+    rv->cap = LOUT_BUF_SIZE;
+    return rv;
+}
+
+lout *lout_default(bool errors)
+{
+    return errors ? &stderr_direct : &stdout_direct;
+}
+
+void lout_del(lout *out)
+{
+    lout_flush(out);
+    free(out->buf);
+    free(out);
+}
+
+/**
+ * Hands the buffered bytes to the sink without asking it to flush.
+ */
+static void lout_drain(lout *out)
+{
+    if (out->len)
+    {
+        out->sink.write(out->sink.ctx, out->buf, out->len);
+        out->len = 0;
+    }
+}
+
+void lout_write(lout *out, const char *data, size_t len)
+{
+    if (!len)
+    {
+        return;
+    }
+
+    if (out->len + len > out->cap)
+    {
+        lout_drain(out);
+        if (len > out->cap)
+        {
+            // Too big to buffer, pass straight through
+            out->sink.write(out->sink.ctx, data, len);
+            return;
+        }
+    }
+
+    memcpy(out->buf + out->len, data, len);
+    out->len += len;
+}
+
+void lout_putc(lout *out, char c)
+{
+    lout_write(out, &c, 1);
+}
+
+void lout_puts(lout *out, const char *str)
+{
+    lout_write(out, str, strlen(str));
+}
+
+void lout_printf(lout *out, const char *fmt, ...)
+{
+    char buf[128];
+    va_list va;
+    va_start(va, fmt);
+    int len = vsnprintf(buf, sizeof(buf), fmt, va);
+    va_end(va);
+
+    // An encoding error, so there is nothing to write
+    if (len < 0)
+    {
+        return;
+    }
+
+    if (len < (int)sizeof(buf))
+    {
+        lout_write(out, buf, len);
+        return;
+    }
+
+    char *big = malloc(len + 1);
+    va_start(va, fmt);
+    vsnprintf(big, len + 1, fmt, va);
+    va_end(va);
+    lout_write(out, big, len);
+    free(big);
+}
+
+void lout_flush(lout *out)
+{
+    lout_drain(out);
+    if (out->sink.flush)
+    {
+        out->sink.flush(out->sink.ctx);
+    }
+}
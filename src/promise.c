@@ -0,0 +1,149 @@
+/*
+ * Promises. (delay {expression}) returns a promise to evaluate the expression
+ * later; (force promise) evaluates it the first time and returns the kept result
+ * after that. Copies of a promise share it, so a promise is only ever evaluated
+ * once. Rather than copying the environment, a promise keeps copies of just the
+ * local bindings -- parameters and let bindings -- the expression uses, as those
+ * go when the function returns. Other symbols are looked up where it is forced, as
+ * they would be for a function.
+ */
+
+#include "lilith_int.h"
+#include "builtin_symbols.h"
+
+struct promise
+{
+    unsigned refs;
+    lval *expr;  // the expression, or 0 once forced
+    lenv *env;   // the local bindings the expression uses, or 0 once forced
+    lval *value; // the result, or 0 until forced
+    bool busy;   // being forced
+};
+
+/**
+ * Copies the local bindings of the symbols in an expression.
+ */
+static void promise_capture(lenv *env, const lval *expr, lenv *to)
+{
+    if (expr->type == LVAL_SEXPRESSION || expr->type == LVAL_QEXPRESSION)
+    {
+        for (pair *ptr = expr->value.list.head; ptr; ptr = ptr->next)
+        {
+            promise_capture(env, ptr->data, to);
+        }
+    }
+    else if (expr->type == LVAL_SYMBOL && !lenv_own(to, expr->value.str_val))
+    {
+        lval *v = lenv_find_local(env, expr->value.str_val);
+        if (v)
+        {
+            lenv_put(to, (lval*)expr, v);
+        }
+    }
+}
+
+struct promise *promise_ref(struct promise *p)
+{
+    __atomic_add_fetch(&p->refs, 1, __ATOMIC_RELAXED);
+    return p;
+}
+
+void promise_del(struct promise *p)
+{
+    if (__atomic_sub_fetch(&p->refs, 1, __ATOMIC_ACQ_REL))
+    {
+        return;
+    }
+
+    if (p->expr)
+    {
+        lval_del(p->expr);
+        lenv_del(p->env);
+    }
+
+    if (p->value)
+    {
+        lval_del(p->value);
+    }
+
+    free(p);
+}
+
+/**
+ * Built-in function to delay the evaluation of an expression.
+ */
+static lval *builtin_delay(lenv *env, lval *args)
+{
+    LASSERT_ENV(args, env, BUILTIN_SYM_DELAY);
+    LASSERT_NO_ERROR(args);
+    LASSERT(args, LVAL_EXPR_CNT(args) == 1, "function '%s' expects 1 argument, received %d",
+        BUILTIN_SYM_DELAY, LVAL_EXPR_CNT(args));
+    LASSERT(args, LVAL_EXPR_FIRST(args)->type == LVAL_QEXPRESSION,
+        "function '%s' type mismatch - expected %s, received %s",
+        BUILTIN_SYM_DELAY, ltype_name(LVAL_QEXPRESSION), ltype_name(LVAL_EXPR_FIRST(args)->type));
+
+    struct promise *p = calloc(1, sizeof(struct promise));
+    p->refs = 1;
+    p->expr = lval_take(args, 0);
+    p->expr->type = LVAL_SEXPRESSION;
+    p->env = lenv_new();
+    promise_capture(env, p->expr, p->env);
+    return lval_promise(p);
+}
+
+/**
+ * Built-in function to get the result of a promise, evaluating it the first time.
+ * Any other value is returned as it is. Errors are not kept, so forcing again
+ * evaluates the expression again.
+ */
+static lval *builtin_force(lenv *env, lval *args)
+{
+    LASSERT_ENV(args, env, BUILTIN_SYM_FORCE);
+    LASSERT_NO_ERROR(args);
+    LASSERT(args, LVAL_EXPR_CNT(args) == 1, "function '%s' expects 1 argument, received %d",
+        BUILTIN_SYM_FORCE, LVAL_EXPR_CNT(args));
+
+    lval *x = lval_take(args, 0);
+    if (x->type != LVAL_PROMISE)
+    {
+        return x;
+    }
+
+    struct promise *p = x->value.promise;
+    if (!p->value)
+    {
+        if (p->busy)
+        {
+            lval_del(x);
+            return lval_error("function '%s' promise forced while it is being forced", BUILTIN_SYM_FORCE);
+        }
+
+        // Other symbols are looked up where the promise is forced
+        p->busy = true;
+        lenv_set_parent(p->env, env);
+        lval *rv = lilith_eval_expr(p->env, lval_copy(p->expr));
+        lenv_set_parent(p->env, 0);
+        p->busy = false;
+        if (rv->type == LVAL_ERROR)
+        {
+            lval_del(x);
+            return rv;
+        }
+
+        p->value = rv;
+        lval_del(p->expr);
+        lenv_del(p->env);
+        p->expr = 0;
+        p->env = 0;
+    }
+
+    lval *rv = lval_copy(p->value);
+    lval_del(x);
+    return rv;
+}
+
+void lenv_add_builtins_promise(lenv *e)
+{
+    lenv_add_builtin(e, BUILTIN_SYM_DELAY, builtin_delay);
+    lenv_add_builtin(e, BUILTIN_SYM_FORCE, builtin_force);
+}
@@ -5,6 +5,7 @@
 #include <errno.h>
 
 #include "lilith_int.h"
+#include "builtin_symbols.h"
 #include "tokeniser.h"
 
 static lval *token_symbol(const char *val)
@@ -66,24 +67,105 @@ static lval *read_element(const tokeniser *tok, const token *t)
     }
 }
 
-static lval *read_list(tokeniser *tok, lval *list)
+static lval *read_list(tokeniser *tok, lval *list, lval *unquoted);
+static lval *read_expr(tokeniser *tok, const token *t, lval *unquoted);
+
+/**
+ * Reads a quasiquoted template, `{...}. Compiled to (quasiquote {template} exprs...)
+ * where each unquote in the template is left as a marker and its expression passed
+ * as an argument, so the result is built by filling the template in one pass.
+ */
+static lval *read_quasiquote(tokeniser *tok)
+{
+    token t;
+    if (!get_next_token(tok, &t) || t.type != TOK_LIST_BEGIN || *t.token != '{')
+    {
+        return lval_error("at %d:%d - quasiquote expects a q-expression", get_line_number(tok), get_position(tok));
+    }
+
+    lval *exprs = lval_sexpression();
+    lval *template = read_list(tok, lval_qexpression(), exprs);
+    if (template->type == LVAL_ERROR)
+    {
+        lval_del(exprs);
+        return template;
+    }
+
+    lval *rv = lval_add(lval_sexpression(), lval_symbol(BUILTIN_SYM_QUASIQUOTE));
+    lval_add(rv, template);
+    while (LVAL_EXPR_CNT(exprs))
+    {
+        lval_add(rv, lval_pop(exprs));
+    }
+
+    lval_del(exprs);
+    return rv;
+}
+
+/**
+ * Reads an unquote, ,x or ,@x, inside a quasiquoted template. The expression is
+ * added to those to evaluate and a marker returned in its place.
+ */
+static lval *read_unquote(tokeniser *tok, const token *t, lval *unquoted)
+{
+    if (!unquoted)
+    {
+        return lval_error("at %d:%d - unquote outside quasiquote", get_line_number(tok), get_position(tok));
+    }
+
+    const char *marker = t->type == TOK_SPLICE ? QUASI_SPLICE : QUASI_UNQUOTE;
+
+    // The marker is a token of its own, so the expression is read like any other
+    token next;
+    lval *x = get_next_token(tok, &next)
+        ? read_expr(tok, &next, 0)
+        : lval_error("at %d:%d - unquote expects an expression", get_line_number(tok), get_position(tok));
+
+    if (x->type == LVAL_ERROR)
+    {
+        return x;
+    }
+
+    lval_add(unquoted, x);
+    return lval_symbol(marker);
+}
+
+/**
+ * Reads an expression starting with the given token. Unquoted expressions are
+ * added to unquoted when reading a quasiquoted template, otherwise it is 0.
+ */
+static lval *read_expr(tokeniser *tok, const token *t, lval *unquoted)
+{
+    if (t->type == TOK_LIST_BEGIN)
+    {
+        return read_list(tok, (*t->token == '(') ? lval_sexpression() : lval_qexpression(), unquoted);
+    }
+
+    if (t->type == TOK_SYMBOL && !strcmp(t->token, QUASI_QUOTE))
+    {
+        return read_quasiquote(tok);
+    }
+
+    if (t->type == TOK_UNQUOTE || t->type == TOK_SPLICE)
+    {
+        return read_unquote(tok, t, unquoted);
+    }
+
+    if (t->type == TOK_LIST_END)
+    {
+        return lval_error("at %d:%d - unexpected '%s'", get_line_number(tok), get_position(tok), t->token);
+    }
+
+    return read_element(tok, t);
+}
+
+static lval *read_list(tokeniser *tok, lval *list, lval *unquoted)
 {
     token t;
     lval *rv = list;
     while (get_next_token(tok, &t))
     {
-        if (t.type == TOK_LIST_BEGIN)
-        {
-            lval *x = read_list(tok, (*t.token == '(') ? lval_sexpression() : lval_qexpression());
-            if (x->type == LVAL_ERROR)
-            {
-                lval_del(rv);
-                return x;
-            }
-
-            lval_add(rv, x);
-        }
-        else if (t.type == TOK_LIST_END)
+        if (t.type == TOK_LIST_END)
         {
             if ((rv->type == LVAL_SEXPRESSION && !strcmp(t.token, "}")) ||
                 (rv->type == LVAL_QEXPRESSION && !strcmp(t.token, ")")))
@@ -94,17 +176,15 @@ static lval *read_list(tokeniser *tok, lval *list)
 
             return rv;
         }
-        else
-        {
-            lval *x = read_element(tok, &t);
-            if (x->type == LVAL_ERROR)
-            {
-                lval_del(rv);
-                return x;
-            }
 
-            lval_add(rv, x);
+        lval *x = read_expr(tok, &t, unquoted);
+        if (x->type == LVAL_ERROR)
+        {
+            lval_del(rv);
+            return x;
         }
+
+        lval_add(rv, x);
     }
 
     lval_del(rv);
@@ -121,34 +201,17 @@ lval *lilith_read_from_string(const char *input)
     token t;
     while (get_next_token(tok, &t))
     {
-        lval *next;
-        if (t.type == TOK_LIST_BEGIN)
+        lval *next = read_expr(tok, &t, 0);
+        if (next->type == LVAL_ERROR)
         {
-            next = read_list(tok, (*t.token == '(') ? lval_sexpression() : lval_qexpression());
-            if (next->type == LVAL_ERROR)
-            {
-                lval_del(rv);
-                rv = next;
-                goto END;
-            }
-
-            lval_add(rv, next);
+            lval_del(rv);
+            rv = next;
+            break;
         }
-        else
-        {
-            next = read_element(tok, &t);
-            if (next->type == LVAL_ERROR)
-            {
-                lval_del(rv);
-                rv = next;
-                goto END;
-            }
 
-            lval_add(rv, next);
-        }
+        lval_add(rv, next);
     }
 
-END:
     free_tokeniser(tok);
     return rv;
 }
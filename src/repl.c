@@ -15,16 +15,22 @@
 
 static void version()
 {
-    printf("Lilith Lisp v0.3.0\n");
+    printf("Lilith Lisp v" LILITH_VERSION "\n");
 }
 
 static void usage()
 {
     version();
     printf("usage: lilith [-h] [-v] [-l] file...\n");
+    printf("       lilith -b output file...\n");
+    printf("       lilith --emit-c file [output]\n");
+    printf("       lilith --watch file\n");
     printf("  -h : display this help message\n");
     printf("  -v : display version number\n");
     printf("  -l : load and evaluate file(s) and enter interpreter\n");
+    printf("  -b : bundle file(s) in to a standalone executable, the first file is run on start\n");
+    printf("  --emit-c : translate the functions defined in a file to C for load-native\n");
+    printf("  --watch : evaluate a file and re-evaluate the expressions changed each time it is saved\n");
     printf("Additional arguments read as files and evaluated\n");
 }
 
@@ -38,7 +44,13 @@ int main(int argc, char *argv[])
         return 1;
     }
 
-    if (argc > 1)
+    if (lilith_run_bundle(env))
+    {
+        // A standalone application -- only run its scripts
+        lilith_flush(env);
+        running = false;
+    }
+    else if (argc > 1)
     {
         if (strcmp(argv[1], "-h") == 0)
         {
@@ -50,6 +62,63 @@ int main(int argc, char *argv[])
             version();
             running = false;
         }
+        else if (strcmp(argv[1], "--emit-c") == 0)
+        {
+            running = false;
+            if (argc < 3 || argc > 4)
+            {
+                usage();
+            }
+            else
+            {
+                lval *err = lilith_emit_c(argv[2], argc == 4 ? argv[3] : 0);
+                if (err)
+                {
+                    lilith_println(env, err);
+                    lilith_flush(env);
+                    lilith_lval_del(err);
+                    lilith_cleanup(env);
+                    return 1;
+                }
+            }
+        }
+        else if (strcmp(argv[1], "--watch") == 0)
+        {
+            running = false;
+            if (argc != 3)
+            {
+                usage();
+            }
+            else
+            {
+                lval *err = lilith_watch(env, argv[2]);
+                lilith_println(env, err);
+                lilith_flush(env);
+                lilith_lval_del(err);
+                lilith_cleanup(env);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[1], "-b") == 0)
+        {
+            running = false;
+            if (argc < 4)
+            {
+                usage();
+            }
+            else
+            {
+                lval *err = lilith_bundle(argv[2], (const char**)argv + 3, argc - 3);
+                if (err)
+                {
+                    lilith_println(env, err);
+                    lilith_flush(env);
+                    lilith_lval_del(err);
+                    lilith_cleanup(env);
+                    return 1;
+                }
+            }
+        }
         else
         {
             running = (strcmp(argv[1], "-l") == 0);
@@ -60,6 +129,8 @@ int main(int argc, char *argv[])
                     lilith_eval_file(env, argv[i]);
                 }
             }
+
+            lilith_flush(env);
         }
     }
 
@@ -83,7 +154,8 @@ int main(int argc, char *argv[])
             else
             {
                 lval *result = lilith_eval_expr(env, lilith_read_from_string(input));
-                lilith_println(result);
+                lilith_println(env, result);
+                lilith_flush(env);
                 lilith_lval_del(result);
             }
 
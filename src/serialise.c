@@ -0,0 +1,189 @@
+/*
+ * Binary serialisation of Lisp Values. Used to store parsed scripts so they can be
+ * loaded again without going through the tokeniser and reader.
+ */
+
+#include "lilith_int.h"
+
+#define LBUF_INITIAL_SIZE 256
+
+void lbuf_init(lbuf *buf)
+{
+    buf->data = malloc(LBUF_INITIAL_SIZE);
+    buf->len = 0;
+    buf->cap = LBUF_INITIAL_SIZE;
+}
+
+void lbuf_write(lbuf *buf, const void *data, size_t len)
+{
+    if (buf->len + len > buf->cap)
+    {
+        while (buf->len + len > buf->cap)
+        {
+            buf->cap *= 2;
+        }
+
+        buf->data = realloc(buf->data, buf->cap);
+    }
+
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+}
+
+void lbuf_free(lbuf *buf)
+{
+    free(buf->data);
+    buf->data = 0;
+    buf->len = buf->cap = 0;
+}
+
+uint64_t lilith_hash(const void *data, size_t len, uint64_t seed)
+{
+    // FNV-1a
+    const unsigned char *ptr = data;
+    uint64_t rv = seed;
+    for (size_t i = 0; i < len; i++)
+    {
+        rv ^= ptr[i];
+        rv *= 0x100000001b3ULL;
+    }
+
+    return rv;
+}
+
+static void lbuf_write_u32(lbuf *buf, uint32_t val)
+{
+    lbuf_write(buf, &val, sizeof(val));
+}
+
+bool lval_serialise(lbuf *buf, const lval *v)
+{
+    unsigned char type = v->type;
+    switch (v->type)
+    {
+    case LVAL_LONG:
+        lbuf_write(buf, &type, 1);
+        lbuf_write(buf, &v->value.num_l, sizeof(long));
+        return true;
+    case LVAL_DOUBLE:
+        lbuf_write(buf, &type, 1);
+        lbuf_write(buf, &v->value.num_d, sizeof(double));
+        return true;
+    case LVAL_BOOL:
+        type |= v->value.bval ? 0x80 : 0;
+        lbuf_write(buf, &type, 1);
+        return true;
+    case LVAL_STRING:
+    case LVAL_SYMBOL:
+    {
+        // Keep the terminator so strings can be used in place when read back
+        size_t len = strlen(v->value.str_val) + 1;
+        lbuf_write(buf, &type, 1);
+        lbuf_write_u32(buf, len);
+        lbuf_write(buf, v->value.str_val, len);
+        return true;
+    }
+    case LVAL_SEXPRESSION:
+    case LVAL_QEXPRESSION:
+        lbuf_write(buf, &type, 1);
+        lbuf_write_u32(buf, LVAL_EXPR_CNT(v));
+        for (pair *ptr = v->value.list.head; ptr; ptr = ptr->next)
+        {
+            if (!lval_serialise(buf, ptr->data))
+            {
+                return false;
+            }
+        }
+
+        return true;
+    case LVAL_SKETCH:
+        lbuf_write(buf, &type, 1);
+        sketch_serialise(buf, v->value.sketch);
+        return true;
+    }
+
+    // Functions, errors and foreign values only make sense in the running process
+    return false;
+}
+
+static bool read_bytes(const char **pos, const char *end, void *dest, size_t len)
+{
+    if ((size_t)(end - *pos) < len)
+    {
+        return false;
+    }
+
+    memcpy(dest, *pos, len);
+    *pos += len;
+    return true;
+}
+
+lval *lval_deserialise(const char **pos, const char *end)
+{
+    unsigned char type;
+    if (!read_bytes(pos, end, &type, 1))
+    {
+        return 0;
+    }
+
+    switch (type & 0x7f)
+    {
+    case LVAL_LONG:
+    {
+        long num;
+        return read_bytes(pos, end, &num, sizeof(num)) ? lval_long(num) : 0;
+    }
+    case LVAL_DOUBLE:
+    {
+        double num;
+        return read_bytes(pos, end, &num, sizeof(num)) ? lval_double(num) : 0;
+    }
+    case LVAL_BOOL:
+        return lval_bool(type & 0x80);
+    case LVAL_STRING:
+    case LVAL_SYMBOL:
+    {
+        uint32_t len;
+        if (!read_bytes(pos, end, &len, sizeof(len)) || !len ||
+            (size_t)(end - *pos) < len || (*pos)[len - 1])
+        {
+            return 0;
+        }
+
+        const char *str = *pos;
+        *pos += len;
+        return type == LVAL_STRING ? lval_string(str) : lval_symbol(str);
+    }
+    case LVAL_SEXPRESSION:
+    case LVAL_QEXPRESSION:
+    {
+        uint32_t cnt;
+        if (!read_bytes(pos, end, &cnt, sizeof(cnt)))
+        {
+            return 0;
+        }
+
+        lval *rv = type == LVAL_SEXPRESSION ? lval_sexpression() : lval_qexpression();
+        while (cnt--)
+        {
+            lval *x = lval_deserialise(pos, end);
+            if (!x)
+            {
+                lval_del(rv);
+                return 0;
+            }
+
+            lval_add(rv, x);
+        }
+
+        return rv;
+    }
+    case LVAL_SKETCH:
+    {
+        struct sketch *s = sketch_deserialise(pos, end);
+        return s ? lval_sketch(s) : 0;
+    }
+    }
+
+    return 0;
+}
@@ -0,0 +1,1100 @@
+/*
+ * Sketches -- fixed size summaries of streams too large to keep. A HyperLogLog
+ * estimates how many distinct values were added, a t-digest estimates quantiles of
+ * the numbers added and a Count-Min sketch estimates how often each value was
+ * added. Sketches of the same kind and size can be merged, so a stream can be split
+ * between workers and the partial sketches combined.
+ *
+ * A sketch is shared by its copies, as looking a symbol up copies its value, and is
+ * never changed while shared: sketch-add returns a new sketch, and sketch-add!
+ * adds to the sketch bound to a symbol in place, copying it first only if it is
+ * shared. Sketches can be serialised, and sketch-encode and sketch-decode turn them
+ * in to and out of strings.
+ */
+
+#include <math.h>
+
+#include "lilith_int.h"
+#include "builtin_symbols.h"
+
+#define SKETCH_HLL_PRECISION 14       // 2^14 registers, about 0.8% error
+#define SKETCH_HLL_MIN_PRECISION 4
+#define SKETCH_HLL_MAX_PRECISION 18
+#define SKETCH_TD_COMPRESSION 100     // roughly the number of centroids kept
+#define SKETCH_TD_MIN_COMPRESSION 10
+#define SKETCH_TD_MAX_COMPRESSION 10000
+#define SKETCH_CMS_WIDTH 2048         // counters per row, error about total * e / width
+#define SKETCH_CMS_DEPTH 5            // rows, error bound fails with probability e^-depth
+#define SKETCH_CMS_MAX_SIZE (1 << 24)
+#define SKETCH_CMS_MAX_DEPTH 16
+
+enum
+{
+    SKETCH_HLL,
+    SKETCH_TDIGEST,
+    SKETCH_CMS
+};
+
+/**
+ * A t-digest centroid -- the mean of a number of nearby values.
+ */
+typedef struct
+{
+    double mean;
+    double weight;
+} td_centroid;
+
+struct sketch
+{
+    unsigned refs;
+    int kind;
+    union
+    {
+        struct
+        {
+            unsigned precision;
+            unsigned char *regs; // the longest run of zeros seen for each 2^precision hashes
+        } hll;
+
+        struct
+        {
+            double compression;
+            td_centroid *c; // merged centroids, sorted by mean, then values not merged yet
+            size_t merged;
+            size_t count;
+            size_t cap;
+            double total;
+            double min;
+            double max;
+        } td;
+
+        struct
+        {
+            unsigned width;
+            unsigned depth;
+            uint64_t total;
+            uint64_t *counts; // depth rows of width counters
+        } cms;
+    };
+};
+
+/**
+ * Hashes a value for a sketch. Mixes the bits of lval_hash, whose high bits vary
+ * little for short inputs.
+ */
+static uint64_t sketch_hash(const lval *v, uint64_t seed)
+{
+    uint64_t h = lval_hash(v, seed);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static size_t sketch_hll_size(const struct sketch *s)
+{
+    return (size_t)1 << s->hll.precision;
+}
+
+static size_t sketch_cms_size(const struct sketch *s)
+{
+    return (size_t)s->cms.width * s->cms.depth;
+}
+
+static struct sketch *sketch_new(int kind)
+{
+    struct sketch *s = calloc(1, sizeof(struct sketch));
+    s->refs = 1;
+    s->kind = kind;
+    return s;
+}
+
+static struct sketch *sketch_hll_new(unsigned precision)
+{
+    struct sketch *s = sketch_new(SKETCH_HLL);
+    s->hll.precision = precision;
+    s->hll.regs = calloc(sketch_hll_size(s), 1);
+    return s;
+}
+
+static struct sketch *sketch_td_new(double compression)
+{
+    struct sketch *s = sketch_new(SKETCH_TDIGEST);
+    s->td.compression = compression;
+    s->td.cap = (size_t)ceil(compression) * 6 + 16;
+    s->td.c = malloc(sizeof(td_centroid) * s->td.cap);
+    s->td.min = INFINITY;
+    s->td.max = -INFINITY;
+    return s;
+}
+
+static struct sketch *sketch_cms_new(unsigned width, unsigned depth)
+{
+    struct sketch *s = sketch_new(SKETCH_CMS);
+    s->cms.width = width;
+    s->cms.depth = depth;
+    s->cms.counts = calloc(sketch_cms_size(s), sizeof(uint64_t));
+    return s;
+}
+
+/**
+ * Makes an unshared copy of a sketch.
+ */
+static struct sketch *sketch_clone(const struct sketch *s)
+{
+    struct sketch *rv = malloc(sizeof(struct sketch));
+    *rv = *s;
+    rv->refs = 1;
+    switch (s->kind)
+    {
+    case SKETCH_HLL:
+        rv->hll.regs = malloc(sketch_hll_size(s));
+        memcpy(rv->hll.regs, s->hll.regs, sketch_hll_size(s));
+        break;
+    case SKETCH_TDIGEST:
+        rv->td.c = malloc(sizeof(td_centroid) * s->td.cap);
+        memcpy(rv->td.c, s->td.c, sizeof(td_centroid) * s->td.count);
+        break;
+    case SKETCH_CMS:
+        rv->cms.counts = malloc(sizeof(uint64_t) * sketch_cms_size(s));
+        memcpy(rv->cms.counts, s->cms.counts, sizeof(uint64_t) * sketch_cms_size(s));
+        break;
+    }
+
+    return rv;
+}
+
+struct sketch *sketch_ref(struct sketch *s)
+{
+    __atomic_add_fetch(&s->refs, 1, __ATOMIC_RELAXED);
+    return s;
+}
+
+void sketch_del(struct sketch *s)
+{
+    if (__atomic_sub_fetch(&s->refs, 1, __ATOMIC_ACQ_REL))
+    {
+        return;
+    }
+
+    switch (s->kind)
+    {
+    case SKETCH_HLL:
+        free(s->hll.regs);
+        break;
+    case SKETCH_TDIGEST:
+        free(s->td.c);
+        break;
+    case SKETCH_CMS:
+        free(s->cms.counts);
+        break;
+    }
+
+    free(s);
+}
+
+static int td_compare(const void *x, const void *y)
+{
+    double a = ((const td_centroid*)x)->mean, b = ((const td_centroid*)y)->mean;
+    return a < b ? -1 : a > b;
+}
+
+/**
+ * The t-digest scale function, k1 -- centroids near the ends cover fewer values,
+ * so the extreme quantiles are the most accurate.
+ */
+static double td_scale(double q, double compression)
+{
+    return compression / (2 * M_PI) * asin(2 * q - 1);
+}
+
+static double td_scale_inverse(double k, double compression)
+{
+    return (sin(k * 2 * M_PI / compression) + 1) / 2;
+}
+
+/**
+ * The most weight a centroid starting at the given weight may reach -- one more k
+ * than the start, or everything once past the top of the scale, where the inverse
+ * would wrap round and shrink again.
+ */
+static double td_limit(double before, double total, double compression)
+{
+    double k = td_scale(before / total, compression) + 1;
+    return k >= compression / 4 ? total : total * td_scale_inverse(k, compression);
+}
+
+/**
+ * Sorts centroids and merges neighbours while the merged centroid stays within
+ * the size the scale function allows at its quantile. Returns the number left.
+ */
+static size_t td_merge(td_centroid *c, size_t count, double total, double compression)
+{
+    if (!count)
+    {
+        return 0;
+    }
+
+    qsort(c, count, sizeof(td_centroid), td_compare);
+    size_t n = 0;
+    double before = 0;
+    double limit = td_limit(0, total, compression);
+    for (size_t i = 1; i < count; i++)
+    {
+        if (before + c[n].weight + c[i].weight <= limit)
+        {
+            c[n].weight += c[i].weight;
+            c[n].mean += (c[i].mean - c[n].mean) * c[i].weight / c[n].weight;
+            continue;
+        }
+
+        before += c[n].weight;
+        limit = td_limit(before, total, compression);
+        c[++n] = c[i];
+    }
+
+    return n + 1;
+}
+
+static void td_compress(struct sketch *s)
+{
+    s->td.count = s->td.merged = td_merge(s->td.c, s->td.count, s->td.total, s->td.compression);
+}
+
+/**
+ * Gets the merged centroids of a t-digest without changing it, as it may be
+ * shared. The result is freed by the caller.
+ */
+static td_centroid *td_centroids(const struct sketch *s, size_t *count)
+{
+    td_centroid *rv = malloc(sizeof(td_centroid) * (s->td.count ? s->td.count : 1));
+    memcpy(rv, s->td.c, sizeof(td_centroid) * s->td.count);
+    *count = s->td.merged == s->td.count ? s->td.count :
+        td_merge(rv, s->td.count, s->td.total, s->td.compression);
+    return rv;
+}
+
+static void td_add(struct sketch *s, double mean, double weight)
+{
+    if (s->td.count == s->td.cap)
+    {
+        td_compress(s);
+        if (s->td.count == s->td.cap)
+        {
+            s->td.cap *= 2;
+            s->td.c = realloc(s->td.c, sizeof(td_centroid) * s->td.cap);
+        }
+    }
+
+    s->td.c[s->td.count++] = (td_centroid){ mean, weight };
+    s->td.total += weight;
+}
+
+/**
+ * Adds a value to a sketch that is not shared. Returns an error, or 0.
+ */
+static lval *sketch_add_value(struct sketch *s, const lval *v, const char *symbol)
+{
+    switch (s->kind)
+    {
+    case SKETCH_HLL:
+    {
+        // The first bits pick the register, which keeps the longest run of zeros seen after them
+        uint64_t h = sketch_hash(v, LILITH_HASH_SEED);
+        size_t reg = h >> (64 - s->hll.precision);
+        uint64_t rest = (h << s->hll.precision) | ((uint64_t)1 << (s->hll.precision - 1));
+        unsigned char rank = __builtin_clzll(rest) + 1;
+        if (rank > s->hll.regs[reg])
+        {
+            s->hll.regs[reg] = rank;
+        }
+
+        return 0;
+    }
+    case SKETCH_TDIGEST:
+    {
+        if (v->type != LVAL_LONG && v->type != LVAL_DOUBLE)
+        {
+            return lval_error("function '%s' type mismatch - expected %s, received %s",
+                symbol, ltype_name(LVAL_DOUBLE), ltype_name(v->type));
+        }
+
+        double x = v->type == LVAL_LONG ? v->value.num_l : v->value.num_d;
+        if (isnan(x))
+        {
+            return lval_error("function '%s' cannot add NaN to a t-digest", symbol);
+        }
+
+        s->td.min = fmin(s->td.min, x);
+        s->td.max = fmax(s->td.max, x);
+        td_add(s, x, 1);
+        return 0;
+    }
+    case SKETCH_CMS:
+    {
+        // Each row is indexed by a different combination of two hashes
+        uint64_t h1 = sketch_hash(v, LILITH_HASH_SEED), h2 = sketch_hash(v, h1) | 1;
+        for (unsigned row = 0; row < s->cms.depth; row++)
+        {
+            s->cms.counts[row * s->cms.width + (h1 + row * h2) % s->cms.width]++;
+        }
+
+        s->cms.total++;
+        return 0;
+    }
+    }
+
+    return 0;
+}
+
+/**
+ * Merges one sketch into another that is not shared. Returns false if they are
+ * not of the same kind and size.
+ */
+static bool sketch_merge_into(struct sketch *s, const struct sketch *from)
+{
+    if (s->kind != from->kind)
+    {
+        return false;
+    }
+
+    switch (s->kind)
+    {
+    case SKETCH_HLL:
+        if (s->hll.precision != from->hll.precision)
+        {
+            return false;
+        }
+
+        for (size_t i = 0; i < sketch_hll_size(s); i++)
+        {
+            if (from->hll.regs[i] > s->hll.regs[i])
+            {
+                s->hll.regs[i] = from->hll.regs[i];
+            }
+        }
+
+        return true;
+    case SKETCH_TDIGEST:
+        for (size_t i = 0; i < from->td.count; i++)
+        {
+            td_add(s, from->td.c[i].mean, from->td.c[i].weight);
+        }
+
+        s->td.min = fmin(s->td.min, from->td.min);
+        s->td.max = fmax(s->td.max, from->td.max);
+        td_compress(s);
+        return true;
+    case SKETCH_CMS:
+        if (s->cms.width != from->cms.width || s->cms.depth != from->cms.depth)
+        {
+            return false;
+        }
+
+        for (size_t i = 0; i < sketch_cms_size(s); i++)
+        {
+            s->cms.counts[i] += from->cms.counts[i];
+        }
+
+        s->cms.total += from->cms.total;
+        return true;
+    }
+
+    return false;
+}
+
+/**
+ * Estimates the number of distinct values added to a HyperLogLog.
+ */
+static double sketch_hll_estimate(const struct sketch *s)
+{
+    size_t m = sketch_hll_size(s), zeros = 0;
+    double sum = 0;
+    for (size_t i = 0; i < m; i++)
+    {
+        sum += ldexp(1, -s->hll.regs[i]);
+        zeros += !s->hll.regs[i];
+    }
+
+    double alpha = m == 16 ? 0.673 : m == 32 ? 0.697 : m == 64 ? 0.709 : 0.7213 / (1 + 1.079 / m);
+    double estimate = alpha * m * m / sum;
+
+    // Small cardinalities are estimated better from the registers still empty
+    if (estimate <= 2.5 * m && zeros)
+    {
+        estimate = m * log((double)m / zeros);
+    }
+
+    return estimate;
+}
+
+/**
+ * Estimates the value at a quantile, from 0 to 1, of the numbers added to a
+ * t-digest, interpolating between the centres of the centroids either side.
+ */
+static double sketch_td_quantile(const struct sketch *s, double q)
+{
+    size_t n;
+    td_centroid *c = td_centroids(s, &n);
+    double total = s->td.total, target = q * total, rv = s->td.max;
+    if (n == 1 || target <= c[0].weight / 2)
+    {
+        rv = n == 1 || c[0].weight <= 1 ? c[0].mean :
+            s->td.min + (c[0].mean - s->td.min) * target / (c[0].weight / 2);
+        free(c);
+        return rv;
+    }
+
+    double before = 0;
+    for (size_t i = 0; i + 1 < n; i++)
+    {
+        double left = before + c[i].weight / 2, right = before + c[i].weight + c[i + 1].weight / 2;
+        if (target <= right)
+        {
+            rv = c[i].mean + (c[i + 1].mean - c[i].mean) * (target - left) / (right - left);
+            free(c);
+            return rv;
+        }
+
+        before += c[i].weight;
+    }
+
+    double left = total - c[n - 1].weight / 2;
+    if (c[n - 1].weight > 1 && target < total)
+    {
+        rv = c[n - 1].mean + (s->td.max - c[n - 1].mean) * (target - left) / (total - left);
+    }
+
+    free(c);
+    return rv;
+}
+
+/**
+ * Estimates how many times a value was added to a Count-Min sketch. Never less
+ * than the true count.
+ */
+static uint64_t sketch_cms_estimate(const struct sketch *s, const lval *v)
+{
+    uint64_t h1 = sketch_hash(v, LILITH_HASH_SEED), h2 = sketch_hash(v, h1) | 1, rv = UINT64_MAX;
+    for (unsigned row = 0; row < s->cms.depth; row++)
+    {
+        uint64_t count = s->cms.counts[row * s->cms.width + (h1 + row * h2) % s->cms.width];
+        rv = count < rv ? count : rv;
+    }
+
+    return rv;
+}
+
+void sketch_print(lout *out, const struct sketch *s)
+{
+    switch (s->kind)
+    {
+    case SKETCH_HLL:
+        lout_printf(out, "<hyperloglog %u>", s->hll.precision);
+        break;
+    case SKETCH_TDIGEST:
+        lout_printf(out, "<t-digest %g>", s->td.compression);
+        break;
+    case SKETCH_CMS:
+        lout_printf(out, "<count-min %ux%u>", s->cms.width, s->cms.depth);
+        break;
+    }
+}
+
+static void lbuf_write_varint(lbuf *buf, uint64_t val)
+{
+    unsigned char bytes[10];
+    size_t n = 0;
+    do
+    {
+        bytes[n++] = (val & 0x7f) | (val > 0x7f ? 0x80 : 0);
+        val >>= 7;
+    } while (val);
+
+    lbuf_write(buf, bytes, n);
+}
+
+static bool read_varint(const char **pos, const char *end, uint64_t *val)
+{
+    *val = 0;
+    for (unsigned shift = 0; *pos < end && shift < 64; shift += 7)
+    {
+        unsigned char byte = *(*pos)++;
+        *val |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool read_double(const char **pos, const char *end, double *val)
+{
+    if ((size_t)(end - *pos) < sizeof(double))
+    {
+        return false;
+    }
+
+    memcpy(val, *pos, sizeof(double));
+    *pos += sizeof(double);
+    return true;
+}
+
+void sketch_serialise(lbuf *buf, const struct sketch *s)
+{
+    unsigned char kind = s->kind;
+    lbuf_write(buf, &kind, 1);
+    switch (s->kind)
+    {
+    case SKETCH_HLL:
+    {
+        // Registers that are set, as the gap from the one before and the value, or every register once most are set
+        lbuf_write_varint(buf, s->hll.precision);
+        size_t set = 0;
+        for (size_t i = 0; i < sketch_hll_size(s); i++)
+        {
+            set += s->hll.regs[i] != 0;
+        }
+
+        lbuf_write_varint(buf, set);
+        if (set * 2 >= sketch_hll_size(s))
+        {
+            lbuf_write(buf, s->hll.regs, sketch_hll_size(s));
+            break;
+        }
+
+        for (size_t i = 0, last = 0; i < sketch_hll_size(s); i++)
+        {
+            if (s->hll.regs[i])
+            {
+                lbuf_write_varint(buf, i - last);
+                lbuf_write(buf, &s->hll.regs[i], 1);
+                last = i;
+            }
+        }
+
+        break;
+    }
+    case SKETCH_TDIGEST:
+    {
+        size_t n;
+        td_centroid *c = td_centroids(s, &n);
+        lbuf_write(buf, &s->td.compression, sizeof(double));
+        lbuf_write(buf, &s->td.min, sizeof(double));
+        lbuf_write(buf, &s->td.max, sizeof(double));
+        lbuf_write_varint(buf, n);
+        for (size_t i = 0; i < n; i++)
+        {
+            lbuf_write(buf, &c[i].mean, sizeof(double));
+            lbuf_write(buf, &c[i].weight, sizeof(double));
+        }
+
+        free(c);
+        break;
+    }
+    case SKETCH_CMS:
+        lbuf_write_varint(buf, s->cms.width);
+        lbuf_write_varint(buf, s->cms.depth);
+        for (size_t i = 0; i < sketch_cms_size(s); i++)
+        {
+            lbuf_write_varint(buf, s->cms.counts[i]);
+        }
+
+        break;
+    }
+}
+
+struct sketch *sketch_deserialise(const char **pos, const char *end)
+{
+    if (*pos >= end)
+    {
+        return 0;
+    }
+
+    struct sketch *rv = 0;
+    uint64_t a, b;
+    switch (*(*pos)++)
+    {
+    case SKETCH_HLL:
+    {
+        if (!read_varint(pos, end, &a) || a < SKETCH_HLL_MIN_PRECISION || a > SKETCH_HLL_MAX_PRECISION ||
+            !read_varint(pos, end, &b) || b > ((uint64_t)1 << a))
+        {
+            return 0;
+        }
+
+        rv = sketch_hll_new(a);
+        if (b * 2 >= sketch_hll_size(rv))
+        {
+            if ((size_t)(end - *pos) < sketch_hll_size(rv))
+            {
+                sketch_del(rv);
+                return 0;
+            }
+
+            memcpy(rv->hll.regs, *pos, sketch_hll_size(rv));
+            *pos += sketch_hll_size(rv);
+            return rv;
+        }
+
+        for (size_t i = 0, reg = 0; i < b; i++)
+        {
+            uint64_t gap;
+            if (!read_varint(pos, end, &gap) || gap >= sketch_hll_size(rv) - reg || *pos >= end)
+            {
+                sketch_del(rv);
+                return 0;
+            }
+
+            reg += gap;
+            rv->hll.regs[reg] = *(*pos)++;
+        }
+
+        return rv;
+    }
+    case SKETCH_TDIGEST:
+    {
+        double compression, min, max;
+        if (!read_double(pos, end, &compression) || !(compression >= SKETCH_TD_MIN_COMPRESSION) ||
+            compression > SKETCH_TD_MAX_COMPRESSION || !read_double(pos, end, &min) ||
+            !read_double(pos, end, &max) || !read_varint(pos, end, &a) ||
+            a > (uint64_t)(end - *pos) / (2 * sizeof(double)))
+        {
+            return 0;
+        }
+
+        // An empty digest has no smallest or largest value; otherwise they bound every centroid
+        if (a ? !isfinite(min) || !isfinite(max) || min > max : min != INFINITY || max != -INFINITY)
+        {
+            return 0;
+        }
+
+        rv = sketch_td_new(compression);
+        rv->td.min = min;
+        rv->td.max = max;
+        for (size_t i = 0; i < a; i++)
+        {
+            double mean, weight;
+            read_double(pos, end, &mean);
+            read_double(pos, end, &weight);
+            if (!(mean >= min && mean <= max) || !(weight > 0) || !isfinite(weight))
+            {
+                sketch_del(rv);
+                return 0;
+            }
+
+            td_add(rv, mean, weight);
+        }
+
+        td_compress(rv);
+        return rv;
+    }
+    case SKETCH_CMS:
+    {
+        if (!read_varint(pos, end, &a) || !read_varint(pos, end, &b) || !a || !b ||
+            a > SKETCH_CMS_MAX_SIZE || b > SKETCH_CMS_MAX_DEPTH || a * b > SKETCH_CMS_MAX_SIZE)
+        {
+            return 0;
+        }
+
+        rv = sketch_cms_new(a, b);
+        for (size_t i = 0; i < sketch_cms_size(rv); i++)
+        {
+            if (!read_varint(pos, end, &rv->cms.counts[i]))
+            {
+                sketch_del(rv);
+                return 0;
+            }
+        }
+
+        // Every row counts every value once
+        for (unsigned i = 0; i < rv->cms.width; i++)
+        {
+            rv->cms.total += rv->cms.counts[i];
+        }
+
+        return rv;
+    }
+    }
+
+    return 0;
+}
+
+bool sketch_is_equal(const struct sketch *x, const struct sketch *y)
+{
+    if (x == y)
+    {
+        return true;
+    }
+
+    lbuf a, b;
+    lbuf_init(&a);
+    lbuf_init(&b);
+    sketch_serialise(&a, x);
+    sketch_serialise(&b, y);
+    bool rv = a.len == b.len && !memcmp(a.data, b.data, a.len);
+    lbuf_free(&a);
+    lbuf_free(&b);
+    return rv;
+}
+
+/**
+ * Reads an optional whole number argument, checking it is within a range.
+ * Returns false if it is given and is not.
+ */
+static bool sketch_param(lval *args, size_t n, long def, long min, long max, long *rv)
+{
+    *rv = def;
+    if (LVAL_EXPR_CNT(args) <= n)
+    {
+        return true;
+    }
+
+    lval *v = lval_expr_item(args, n);
+    *rv = v->type == LVAL_LONG ? v->value.num_l : min - 1;
+    return *rv >= min && *rv <= max;
+}
+
+/**
+ * Built-in function to create an empty HyperLogLog, optionally with the number of
+ * bits of each hash that pick a register.
+ */
+static lval *builtin_sketch_hll(lenv *env, lval *args)
+{
+    LASSERT_ENV(args, env, BUILTIN_SYM_SKETCH_HLL);
+    LASSERT_NO_ERROR(args);
+    LASSERT(args, LVAL_EXPR_CNT(args) <= 1, "function '%s' expects at most 1 argument, received %d",
+        BUILTIN_SYM_SKETCH_HLL, LVAL_EXPR_CNT(args));
+
+    long precision;
+    LASSERT(args, sketch_param(args, 0, SKETCH_HLL_PRECISION, SKETCH_HLL_MIN_PRECISION,
+        SKETCH_HLL_MAX_PRECISION, &precision), "function '%s' expects a precision from %d to %d",
+        BUILTIN_SYM_SKETCH_HLL, SKETCH_HLL_MIN_PRECISION, SKETCH_HLL_MAX_PRECISION);
+
+    lval_del(args);
+    return lval_sketch(sketch_hll_new(precision));
+}
+
+/**
+ * Built-in function to create an empty t-digest, optionally with its compression.
+ */
+static lval *builtin_sketch_tdigest(lenv *env, lval *args)
+{
+    LASSERT_ENV(args, env, BUILTIN_SYM_SKETCH_TDIGEST);
+    LASSERT_NO_ERROR(args);
+    LASSERT(args, LVAL_EXPR_CNT(args) <= 1, "function '%s' expects at most 1 argument, received %d",
+        BUILTIN_SYM_SKETCH_TDIGEST, LVAL_EXPR_CNT(args));
+
+    long compression;
+    LASSERT(args, sketch_param(args, 0, SKETCH_TD_COMPRESSION, SKETCH_TD_MIN_COMPRESSION,
+        SKETCH_TD_MAX_COMPRESSION, &compression), "function '%s' expects a compression from %d to %d",
+        BUILTIN_SYM_SKETCH_TDIGEST, SKETCH_TD_MIN_COMPRESSION, SKETCH_TD_MAX_COMPRESSION);
+
+    lval_del(args);
+    return lval_sketch(sketch_td_new(compression));
+}
+
+/**
+ * Built-in function to create an empty Count-Min sketch, optionally with its
+ * width and depth.
+ */
+static lval *builtin_sketch_cms(lenv *env, lval *args)
+{
+    LASSERT_ENV(args, env, BUILTIN_SYM_SKETCH_CMS);
+    LASSERT_NO_ERROR(args);
+    LASSERT(args, LVAL_EXPR_CNT(args) <= 2, "function '%s' expects at most 2 arguments, received %d",
+        BUILTIN_SYM_SKETCH_CMS, LVAL_EXPR_CNT(args));
+
+    long width, depth;
+    LASSERT(args, sketch_param(args, 0, SKETCH_CMS_WIDTH, 1, SKETCH_CMS_MAX_SIZE, &width) &&
+        sketch_param(args, 1, SKETCH_CMS_DEPTH, 1, SKETCH_CMS_MAX_DEPTH, &depth) &&
+        width * depth <= SKETCH_CMS_MAX_SIZE, "function '%s' expects a width and depth of at most %d counters",
+        BUILTIN_SYM_SKETCH_CMS, SKETCH_CMS_MAX_SIZE);
+
+    lval_del(args);
+    return lval_sketch(sketch_cms_new(width, depth));
+}
+
+/**
+ * Adds the rest of the arguments to a sketch that is not shared. Returns an
+ * error, deleting the arguments, or 0.
+ */
+static lval *sketch_add_args(struct sketch *s, lval *args, const char *symbol)
+{
+    for (pair *ptr = args->value.list.head->next; ptr; ptr = ptr->next)
+    {
+        lval *err = sketch_add_value(s, ptr->data, symbol);
+        if (err)
+        {
+            lval_del(args);
+            return err;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Built-in function to add values to a sketch, returning the new sketch.
+ */
+static lval *builtin_sketch_add(lenv *env, lval *args)
+{
+    LASSERT_ENV(args, env, BUILTIN_SYM_SKETCH_ADD);
+    LASSERT_NO_ERROR(args);
+    LASSERT(args, LVAL_EXPR_CNT(args) > 0, "function '%s' expects at least 1 argument, received %d",
+        BUILTIN_SYM_SKETCH_ADD, LVAL_EXPR_CNT(args));
+    LASSERT(args, LVAL_EXPR_FIRST(args)->type == LVAL_SKETCH, "function '%s' type mismatch - expected %s, received %s",
+        BUILTIN_SYM_SKETCH_ADD, ltype_name(LVAL_SKETCH), ltype_name(LVAL_EXPR_FIRST(args)->type));
+
+    struct sketch *s = sketch_clone(LVAL_EXPR_FIRST(args)->value.sketch);
+    lval *err = sketch_add_args(s, args, BUILTIN_SYM_SKETCH_ADD);
+    if (err)
+    {
+        sketch_del(s);
+        return err;
+    }
+
+    lval_del(args);
+    return lval_sketch(s);
+}
+
+/**
+ * Built-in function to add values to the sketch bound to a symbol, in place.
+ */
+static lval *builtin_sketch_add_bang(lenv *env, lval *args)
+{
+    lval *cell;
+    lval *err = mutate_find(env, args, BUILTIN_SYM_SKETCH_ADD_BANG, &cell);
+    if (err)
+    {
+        return err;
+    }
+
+    LASSERT(args, cell->type == LVAL_SKETCH, "function '%s' type mismatch - expected %s, received %s",
+        BUILTIN_SYM_SKETCH_ADD_BANG, ltype_name(LVAL_SKETCH), ltype_name(cell->type));
+
+    // Copies of the value keep the sketch as it was
+    struct sketch *s = cell->value.sketch;
+    if (__atomic_load_n(&s->refs, __ATOMIC_ACQUIRE) > 1)
+    {
+        cell->value.sketch = sketch_clone(s);
+        sketch_del(s);
+    }
+
+    err = sketch_add_args(cell->value.sketch, args, BUILTIN_SYM_SKETCH_ADD_BANG);
+    if (err)
+    {
+        return err;
+    }
+
+    lval_del(args);
+    return lval_sexpression();
+}
+
+/**
+ * Built-in function to merge sketches of the same kind and size.
+ */
+static lval *builtin_sketch_merge(lenv *env, lval *args)
+{
+    LASSERT_ENV(args, env, BUILTIN_SYM_SKETCH_MERGE);
+    LASSERT_NO_ERROR(args);
+    LASSERT(args, LVAL_EXPR_CNT(args) > 0, "function '%s' expects at least 1 argument, received %d",
+        BUILTIN_SYM_SKETCH_MERGE, LVAL_EXPR_CNT(args));
+
+    for (pair *ptr = args->value.list.head; ptr; ptr = ptr->next)
+    {
+        LASSERT(args, ptr->data->type == LVAL_SKETCH, "function '%s' type mismatch - expected %s, received %s",
+            BUILTIN_SYM_SKETCH_MERGE, ltype_name(LVAL_SKETCH), ltype_name(ptr->data->type));
+    }
+
+    struct sketch *s = sketch_clone(LVAL_EXPR_FIRST(args)->value.sketch);
+    for (pair *ptr = args->value.list.head->next; ptr; ptr = ptr->next)
+    {
+        if (!sketch_merge_into(s, ptr->data->value.sketch))
+        {
+            sketch_del(s);
+            lval_del(args);
+            return lval_error("function '%s' expects sketches of the same kind and size", BUILTIN_SYM_SKETCH_MERGE);
+        }
+    }
+
+    lval_del(args);
+    return lval_sketch(s);
+}
+
+/**
+ * Checks the first argument is a sketch of the kind given.
+ */
+#define LASSERT_SKETCH(args, symbol, want, name)                                                  \
+    LASSERT(args, LVAL_EXPR_FIRST(args)->type == LVAL_SKETCH &&                                   \
+        LVAL_EXPR_FIRST(args)->value.sketch->kind == want,                                        \
+        "function '%s' type mismatch - expected %s, received %s", symbol, name,                  \
+        LVAL_EXPR_FIRST(args)->type == LVAL_SKETCH ? "another sketch" : ltype_name(LVAL_EXPR_FIRST(args)->type))
+
+/**
+ * Built-in function to get the number of values added to a sketch -- the
+ * estimated number of distinct values for a HyperLogLog.
+ */
+static lval *builtin_sketch_count(lenv *env, lval *args)
+{
+    LASSERT_ENV(args, env, BUILTIN_SYM_SKETCH_COUNT);
+    LASSERT_NO_ERROR(args);
+    LASSERT(args, LVAL_EXPR_CNT(args) == 1, "function '%s' expects 1 argument, received %d",
+        BUILTIN_SYM_SKETCH_COUNT, LVAL_EXPR_CNT(args));
+    LASSERT(args, LVAL_EXPR_FIRST(args)->type == LVAL_SKETCH, "function '%s' type mismatch - expected %s, received %s",
+        BUILTIN_SYM_SKETCH_COUNT, ltype_name(LVAL_SKETCH), ltype_name(LVAL_EXPR_FIRST(args)->type));
+
+    const struct sketch *s = LVAL_EXPR_FIRST(args)->value.sketch;
+    long rv = s->kind == SKETCH_HLL ? lround(sketch_hll_estimate(s)) :
+        s->kind == SKETCH_TDIGEST ? (long)s->td.total : (long)s->cms.total;
+    lval_del(args);
+    return lval_long(rv);
+}
+
+/**
+ * Built-in function to estimate the value at a quantile, from 0 to 1, of the
+ * numbers added to a t-digest.
+ */
+static lval *builtin_sketch_quantile(lenv *env, lval *args)
+{
+    LASSERT_ENV(args, env, BUILTIN_SYM_SKETCH_QUANTILE);
+    LASSERT_NO_ERROR(args);
+    LASSERT(args, LVAL_EXPR_CNT(args) == 2, "function '%s' expects 2 arguments, received %d",
+        BUILTIN_SYM_SKETCH_QUANTILE, LVAL_EXPR_CNT(args));
+    LASSERT_SKETCH(args, BUILTIN_SYM_SKETCH_QUANTILE, SKETCH_TDIGEST, "t-digest");
+
+    lval *q = lval_expr_item(args, 1);
+    LASSERT(args, q->type == LVAL_LONG || q->type == LVAL_DOUBLE, "function '%s' type mismatch - expected %s, received %s",
+        BUILTIN_SYM_SKETCH_QUANTILE, ltype_name(LVAL_DOUBLE), ltype_name(q->type));
+
+    double x = q->type == LVAL_LONG ? q->value.num_l : q->value.num_d;
+    const struct sketch *s = LVAL_EXPR_FIRST(args)->value.sketch;
+    LASSERT(args, x >= 0 && x <= 1, "function '%s' expects a quantile from 0 to 1", BUILTIN_SYM_SKETCH_QUANTILE);
+    LASSERT(args, s->td.count, "function '%s' t-digest is empty", BUILTIN_SYM_SKETCH_QUANTILE);
+
+    double rv = sketch_td_quantile(s, x);
+    lval_del(args);
+    return lval_double(rv);
+}
+
+/**
+ * Built-in function to estimate how many times a value was added to a Count-Min
+ * sketch.
+ */
+static lval *builtin_sketch_frequency(lenv *env, lval *args)
+{
+    LASSERT_ENV(args, env, BUILTIN_SYM_SKETCH_FREQUENCY);
+    LASSERT_NO_ERROR(args);
+    LASSERT(args, LVAL_EXPR_CNT(args) == 2, "function '%s' expects 2 arguments, received %d",
+        BUILTIN_SYM_SKETCH_FREQUENCY, LVAL_EXPR_CNT(args));
+    LASSERT_SKETCH(args, BUILTIN_SYM_SKETCH_FREQUENCY, SKETCH_CMS, "count-min sketch");
+
+    long rv = sketch_cms_estimate(LVAL_EXPR_FIRST(args)->value.sketch, lval_expr_item(args, 1));
+    lval_del(args);
+    return lval_long(rv);
+}
+
+static const char base64_chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/**
+ * Built-in function to serialise a sketch to a base64 string.
+ */
+static lval *builtin_sketch_encode(lenv *env, lval *args)
+{
+    LASSERT_ENV(args, env, BUILTIN_SYM_SKETCH_ENCODE);
+    LASSERT_NO_ERROR(args);
+    LASSERT(args, LVAL_EXPR_CNT(args) == 1, "function '%s' expects 1 argument, received %d",
+        BUILTIN_SYM_SKETCH_ENCODE, LVAL_EXPR_CNT(args));
+    LASSERT(args, LVAL_EXPR_FIRST(args)->type == LVAL_SKETCH, "function '%s' type mismatch - expected %s, received %s",
+        BUILTIN_SYM_SKETCH_ENCODE, ltype_name(LVAL_SKETCH), ltype_name(LVAL_EXPR_FIRST(args)->type));
+
+    lbuf buf;
+    lbuf_init(&buf);
+    sketch_serialise(&buf, LVAL_EXPR_FIRST(args)->value.sketch);
+    lval_del(args);
+
+    const unsigned char *data = (const unsigned char*)buf.data;
+    char *str = malloc((buf.len + 2) / 3 * 4 + 1), *out = str;
+    for (size_t i = 0; i < buf.len; i += 3)
+    {
+        uint32_t n = data[i] << 16 | (i + 1 < buf.len ? data[i + 1] << 8 : 0) | (i + 2 < buf.len ? data[i + 2] : 0);
+        *out++ = base64_chars[n >> 18];
+        *out++ = base64_chars[(n >> 12) & 63];
+        *out++ = i + 1 < buf.len ? base64_chars[(n >> 6) & 63] : '=';
+        *out++ = i + 2 < buf.len ? base64_chars[n & 63] : '=';
+    }
+
+    *out = 0;
+    lbuf_free(&buf);
+    lval *rv = lval_string(str);
+    free(str);
+    return rv;
+}
+
+/**
+ * Built-in function to read a sketch from a string written by sketch-encode.
+ */
+static lval *builtin_sketch_decode(lenv *env, lval *args)
+{
+    LASSERT_ENV(args, env, BUILTIN_SYM_SKETCH_DECODE);
+    LASSERT_NO_ERROR(args);
+    LASSERT(args, LVAL_EXPR_CNT(args) == 1, "function '%s' expects 1 argument, received %d",
+        BUILTIN_SYM_SKETCH_DECODE, LVAL_EXPR_CNT(args));
+    LASSERT(args, LVAL_EXPR_FIRST(args)->type == LVAL_STRING, "function '%s' type mismatch - expected %s, received %s",
+        BUILTIN_SYM_SKETCH_DECODE, ltype_name(LVAL_STRING), ltype_name(LVAL_EXPR_FIRST(args)->type));
+
+    const char *str = LVAL_EXPR_FIRST(args)->value.str_val;
+    size_t len = strlen(str);
+    char *data = malloc(len / 4 * 3 + 1), *out = data;
+    bool valid = len % 4 == 0;
+    for (size_t i = 0; valid && i < len; i += 4)
+    {
+        uint32_t n = 0;
+        int pad = 0;
+        for (size_t j = 0; j < 4; j++)
+        {
+            const char *c = str[i + j] ? strchr(base64_chars, str[i + j]) : 0;
+            valid &= c ? !pad : str[i + j] == '=' && i + 4 == len && j >= 2;
+            pad += !c;
+            n = n << 6 | (c ? c - base64_chars : 0);
+        }
+
+        *out++ = n >> 16;
+        if (pad < 2)
+        {
+            *out++ = n >> 8;
+        }
+
+        if (pad < 1)
+        {
+            *out++ = n;
+        }
+    }
+
+    const char *pos = data;
+    struct sketch *s = valid ? sketch_deserialise(&pos, out) : 0;
+    free(data);
+    LASSERT(args, s, "function '%s' string is not an encoded sketch", BUILTIN_SYM_SKETCH_DECODE);
+
+    lval_del(args);
+    return lval_sketch(s);
+}
+
+void lenv_add_builtins_sketch(lenv *e)
+{
+    lenv_add_builtin(e, BUILTIN_SYM_SKETCH_HLL, builtin_sketch_hll);
+    lenv_add_builtin(e, BUILTIN_SYM_SKETCH_TDIGEST, builtin_sketch_tdigest);
+    lenv_add_builtin(e, BUILTIN_SYM_SKETCH_CMS, builtin_sketch_cms);
+    lenv_add_builtin(e, BUILTIN_SYM_SKETCH_ADD, builtin_sketch_add);
+    lenv_add_builtin(e, BUILTIN_SYM_SKETCH_ADD_BANG, builtin_sketch_add_bang);
+    lenv_add_builtin(e, BUILTIN_SYM_SKETCH_MERGE, builtin_sketch_merge);
+    lenv_add_builtin(e, BUILTIN_SYM_SKETCH_COUNT, builtin_sketch_count);
+    lenv_add_builtin(e, BUILTIN_SYM_SKETCH_QUANTILE, builtin_sketch_quantile);
+    lenv_add_builtin(e, BUILTIN_SYM_SKETCH_FREQUENCY, builtin_sketch_frequency);
+    lenv_add_builtin(e, BUILTIN_SYM_SKETCH_ENCODE, builtin_sketch_encode);
+    lenv_add_builtin(e, BUILTIN_SYM_SKETCH_DECODE, builtin_sketch_decode);
+}
@@ -0,0 +1,517 @@
+/*
+ * External sorting. (external-sort "input" "output") sorts the lines of a file
+ * without holding them all in memory: lines are read until LILITH_SORT_MEMORY
+ * bytes are used, sorted and written out to a temporary file as a run, and the
+ * runs are then merged in to the output through a loser tree. Whenever there are
+ * as many runs of the same length as are merged at once, they are merged in to one
+ * longer run, so the number of temporary files stays small however large the input.
+ *
+ * Lines are compared byte by byte, or by the key a function given as the third
+ * argument returns for each line -- a number or a string, numbers first. Lines
+ * that compare equal keep their order in the input.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "lilith_int.h"
+#include "builtin_symbols.h"
+
+#define SORT_DEFAULT_MEMORY (64L * 1024 * 1024)
+#define SORT_FAN_IN 64 // the most runs merged at once
+
+typedef struct
+{
+    lval *key;  // the key, or 0 when comparing lines
+    char *line;
+    size_t len;
+    uint64_t seq; // position in the input
+} sort_record;
+
+/**
+ * The runs written so far. Levels never increase along the list -- a run made by
+ * merging runs of one level is of the next.
+ */
+typedef struct
+{
+    FILE **files;
+    unsigned *levels;
+    size_t count;
+} sort_runs;
+
+/**
+ * What reading the next record of a run found.
+ */
+enum
+{
+    SORT_READ,  // a record
+    SORT_END,   // the end of the run
+    SORT_FAILED // a read error or a partial record
+};
+
+/**
+ * A run being merged and its next record.
+ */
+typedef struct
+{
+    FILE *file;
+    sort_record rec;
+    bool live;
+} sort_run;
+
+/**
+ * Gets the memory used for the lines of a run.
+ */
+static size_t sort_limit()
+{
+    const char *size = getenv("LILITH_SORT_MEMORY");
+    long rv = size && *size ? strtol(size, 0, 10) : 0;
+    return rv > 0 ? rv : SORT_DEFAULT_MEMORY;
+}
+
+/**
+ * Creates a temporary file, removed when it is closed.
+ */
+static FILE *sort_temp()
+{
+    const char *dir = getenv("TMPDIR");
+    char *path = malloc(strlen(dir && *dir ? dir : "/tmp") + sizeof("/lilith-sort-XXXXXX"));
+    sprintf(path, "%s/lilith-sort-XXXXXX", dir && *dir ? dir : "/tmp");
+
+    int fd = mkstemp(path);
+    FILE *rv = 0;
+    if (fd >= 0)
+    {
+        unlink(path);
+        rv = fdopen(fd, "w+b");
+        if (!rv)
+        {
+            close(fd);
+        }
+    }
+
+    free(path);
+    return rv;
+}
+
+static void sort_record_free(sort_record *r)
+{
+    if (r->key)
+    {
+        lval_del(r->key);
+    }
+
+    free(r->line);
+}
+
+static int sort_compare_keys(const lval *x, const lval *y)
+{
+    bool xnum = x->type != LVAL_STRING, ynum = y->type != LVAL_STRING;
+    if (xnum != ynum)
+    {
+        return xnum ? -1 : 1;
+    }
+
+    if (!xnum)
+    {
+        return strcmp(x->value.str_val, y->value.str_val);
+    }
+
+    if (x->type == LVAL_LONG && y->type == LVAL_LONG)
+    {
+        return (x->value.num_l > y->value.num_l) - (x->value.num_l < y->value.num_l);
+    }
+
+    double a = x->type == LVAL_LONG ? x->value.num_l : x->value.num_d;
+    double b = y->type == LVAL_LONG ? y->value.num_l : y->value.num_d;
+    return (a > b) - (a < b);
+}
+
+static int sort_compare(const void *px, const void *py)
+{
+    const sort_record *x = px, *y = py;
+    int rv;
+    if (x->key)
+    {
+        rv = sort_compare_keys(x->key, y->key);
+    }
+    else
+    {
+        rv = memcmp(x->line, y->line, x->len < y->len ? x->len : y->len);
+        rv = rv ? rv : (x->len > y->len) - (x->len < y->len);
+    }
+
+    return rv ? rv : (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+/**
+ * Writes a record to a run.
+ */
+static bool sort_write(FILE *file, const sort_record *r)
+{
+    lbuf buf;
+    lbuf_init(&buf);
+    if (r->key)
+    {
+        lval_serialise(&buf, r->key);
+    }
+
+    uint32_t keylen = buf.len, len = r->len;
+    bool rv = fwrite(&keylen, sizeof(keylen), 1, file) == 1 && fwrite(buf.data, 1, buf.len, file) == buf.len &&
+        fwrite(&r->seq, sizeof(r->seq), 1, file) == 1 && fwrite(&len, sizeof(len), 1, file) == 1 &&
+        fwrite(r->line, 1, r->len, file) == r->len;
+    lbuf_free(&buf);
+    return rv;
+}
+
+/**
+ * Reads the next record of a run. A run only ends cleanly between records.
+ */
+static int sort_read(FILE *file, sort_record *r)
+{
+    uint32_t keylen, len;
+    size_t got = fread(&keylen, 1, sizeof(keylen), file);
+    if (got != sizeof(keylen))
+    {
+        return got == 0 && feof(file) && !ferror(file) ? SORT_END : SORT_FAILED;
+    }
+
+    r->key = 0;
+    if (keylen)
+    {
+        char *data = malloc(keylen);
+        const char *pos = data;
+        if (fread(data, 1, keylen, file) == keylen)
+        {
+            r->key = lval_deserialise(&pos, data + keylen);
+        }
+
+        free(data);
+        if (!r->key)
+        {
+            return SORT_FAILED;
+        }
+    }
+
+    if (fread(&r->seq, sizeof(r->seq), 1, file) != 1 || fread(&len, sizeof(len), 1, file) != 1)
+    {
+        if (r->key)
+        {
+            lval_del(r->key);
+        }
+
+        return SORT_FAILED;
+    }
+
+    r->len = len;
+    r->line = malloc(len + 1);
+    if (fread(r->line, 1, len, file) != len)
+    {
+        sort_record_free(r);
+        return SORT_FAILED;
+    }
+
+    return SORT_READ;
+}
+
+/**
+ * Checks whether the next record of one run comes before that of another. Run k
+ * stands for a record before every other while the tree is built, and finished
+ * runs come after every other.
+ */
+static bool sort_before(sort_run *runs, size_t k, size_t a, size_t b)
+{
+    if (a == k || b == k)
+    {
+        return a == k;
+    }
+
+    if (!runs[a].live || !runs[b].live)
+    {
+        return runs[a].live;
+    }
+
+    return sort_compare(&runs[a].rec, &runs[b].rec) < 0;
+}
+
+/**
+ * Replays the matches from a run's leaf to the root of a loser tree. Each node
+ * keeps the loser of the match there and the winner moves up.
+ */
+static void sort_adjust(size_t *tree, sort_run *runs, size_t k, size_t s)
+{
+    for (size_t t = (s + k) / 2; t > 0; t /= 2)
+    {
+        if (sort_before(runs, k, tree[t], s))
+        {
+            size_t tmp = tree[t];
+            tree[t] = s;
+            s = tmp;
+        }
+    }
+
+    tree[0] = s;
+}
+
+/**
+ * Merges runs in to a file, as a run or, if lines is set, as the lines alone.
+ * Returns false if a run could not be read in full or a file could not be written.
+ */
+static bool sort_merge(FILE **files, size_t k, FILE *out, bool lines)
+{
+    sort_run *runs = calloc(k, sizeof(sort_run));
+    size_t *tree = malloc(sizeof(size_t) * k);
+    bool ok = true;
+    for (size_t i = 0; i < k; i++)
+    {
+        // Writes still buffered may only fail now
+        ok = ok && fflush(files[i]) == 0;
+        runs[i].file = files[i];
+        rewind(files[i]);
+        int status = ok ? sort_read(files[i], &runs[i].rec) : SORT_END;
+        runs[i].live = status == SORT_READ;
+        ok = ok && status != SORT_FAILED;
+        tree[i] = k;
+    }
+
+    for (size_t i = k; i-- > 0; )
+    {
+        sort_adjust(tree, runs, k, i);
+    }
+
+    while (ok && runs[tree[0]].live)
+    {
+        sort_run *r = &runs[tree[0]];
+        ok = lines ? fwrite(r->rec.line, 1, r->rec.len, out) == r->rec.len && fputc('\n', out) != EOF :
+            sort_write(out, &r->rec);
+        sort_record_free(&r->rec);
+        int status = sort_read(r->file, &r->rec);
+        r->live = status == SORT_READ;
+        ok = ok && status != SORT_FAILED;
+        sort_adjust(tree, runs, k, tree[0]);
+    }
+
+    // Stopped early, so some runs still hold a record
+    for (size_t i = 0; i < k; i++)
+    {
+        if (runs[i].live)
+        {
+            sort_record_free(&runs[i].rec);
+        }
+    }
+
+    free(tree);
+    free(runs);
+    return ok;
+}
+
+/**
+ * Sorts the records read so far and writes them out as a run.
+ */
+static FILE *sort_spill(sort_record *recs, size_t count)
+{
+    qsort(recs, count, sizeof(sort_record), sort_compare);
+    FILE *rv = sort_temp();
+    bool ok = rv != 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        ok = ok && sort_write(rv, &recs[i]);
+        sort_record_free(&recs[i]);
+    }
+
+    if (!ok && rv)
+    {
+        fclose(rv);
+        rv = 0;
+    }
+
+    return rv;
+}
+
+static void sort_close(FILE **files, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        fclose(files[i]);
+    }
+}
+
+/**
+ * Adds a run, merging the last runs while there are enough of one level. Returns
+ * false if the run, or a merged run, could not be written, or a run read back.
+ */
+static bool sort_push(sort_runs *runs, FILE *run)
+{
+    if (!run)
+    {
+        return false;
+    }
+
+    runs->files = realloc(runs->files, sizeof(FILE*) * (runs->count + 1));
+    runs->levels = realloc(runs->levels, sizeof(unsigned) * (runs->count + 1));
+    runs->files[runs->count] = run;
+    runs->levels[runs->count++] = 0;
+
+    while (runs->count >= SORT_FAN_IN &&
+        runs->levels[runs->count - SORT_FAN_IN] == runs->levels[runs->count - 1])
+    {
+        size_t first = runs->count - SORT_FAN_IN;
+        unsigned level = runs->levels[first] + 1;
+        FILE *out = sort_temp();
+        bool ok = out && sort_merge(runs->files + first, SORT_FAN_IN, out, false);
+        sort_close(runs->files + first, SORT_FAN_IN);
+        runs->count = first;
+        if (!ok)
+        {
+            if (out)
+            {
+                fclose(out);
+            }
+
+            return false;
+        }
+
+        runs->files[runs->count] = out;
+        runs->levels[runs->count++] = level;
+    }
+
+    return true;
+}
+
+/**
+ * Built-in function to sort the lines of a file in to another file, using
+ * temporary files rather than memory for large inputs.
+ */
+static lval *builtin_external_sort(lenv *env, lval *args)
+{
+    LASSERT_ENV(args, env, BUILTIN_SYM_EXTERNAL_SORT);
+    LASSERT_NO_ERROR(args);
+    LASSERT(args, LVAL_EXPR_CNT(args) == 2 || LVAL_EXPR_CNT(args) == 3,
+        "function '%s' expects 2 or 3 arguments, received %d", BUILTIN_SYM_EXTERNAL_SORT, LVAL_EXPR_CNT(args));
+    LASSERT(args, LVAL_EXPR_FIRST(args)->type == LVAL_STRING && lval_expr_item(args, 1)->type == LVAL_STRING,
+        "function '%s' expects the input and output file names", BUILTIN_SYM_EXTERNAL_SORT);
+
+    lval *f = LVAL_EXPR_CNT(args) == 3 ? lval_expr_item(args, 2) : 0;
+    LASSERT(args, !f || f->type == LVAL_BUILTIN_FUN || f->type == LVAL_USER_FUN || f->type == LVAL_FFI_FUN,
+        "function '%s' type mismatch - expected function, received %s", BUILTIN_SYM_EXTERNAL_SORT,
+        ltype_name(f->type));
+
+    const char *input = LVAL_EXPR_FIRST(args)->value.str_val;
+    FILE *in = fopen(input, "r");
+    LASSERT(args, in, "function '%s' could not open '%s'", BUILTIN_SYM_EXTERNAL_SORT, input);
+
+    size_t limit = sort_limit(), used = 0, count = 0, cap = 1024;
+    sort_record *recs = malloc(sizeof(sort_record) * cap);
+    sort_runs runs = { 0, 0, 0 };
+    lval *err = 0;
+
+    char *line = 0;
+    size_t size = 0;
+    uint64_t seq = 0;
+    for (ssize_t len; !err && (len = getline(&line, &size, in)) >= 0; seq++)
+    {
+        len -= len && line[len - 1] == '\n';
+        sort_record r = { 0, malloc(len + 1), len, seq };
+        memcpy(r.line, line, len);
+        r.line[len] = 0;
+
+        if (f)
+        {
+            lval *fn = lval_copy(f);
+            r.key = lval_call(env, fn, lval_add(lval_sexpression(), lval_string(r.line)));
+            lval_del(fn);
+            if (r.key->type != LVAL_LONG && r.key->type != LVAL_DOUBLE && r.key->type != LVAL_STRING)
+            {
+                err = r.key->type == LVAL_ERROR ? r.key :
+                    lval_error("function '%s' keys must be numbers or strings, received %s",
+                        BUILTIN_SYM_EXTERNAL_SORT, ltype_name(r.key->type));
+                if (err != r.key)
+                {
+                    lval_del(r.key);
+                }
+
+                free(r.line);
+                break;
+            }
+        }
+
+        if (count == cap)
+        {
+            cap *= 2;
+            recs = realloc(recs, sizeof(sort_record) * cap);
+        }
+
+        recs[count++] = r;
+        used += len + sizeof(sort_record) + (f ? sizeof(lval) : 0);
+        if (used >= limit)
+        {
+            FILE *run = sort_spill(recs, count);
+            count = used = 0;
+            if (!sort_push(&runs, run))
+            {
+                err = lval_error("function '%s' could not write or read back a temporary file",
+                    BUILTIN_SYM_EXTERNAL_SORT);
+            }
+        }
+    }
+
+    free(line);
+    fclose(in);
+
+    // What is left is a run too unless it is the only one
+    if (!err && count && runs.count)
+    {
+        FILE *run = sort_spill(recs, count);
+        count = 0;
+        if (!sort_push(&runs, run))
+        {
+            err = lval_error("function '%s' could not write or read back a temporary file", BUILTIN_SYM_EXTERNAL_SORT);
+        }
+    }
+
+    FILE *out = 0;
+    if (!err)
+    {
+        const char *output = lval_expr_item(args, 1)->value.str_val;
+        out = fopen(output, "w");
+        err = out ? 0 : lval_error("function '%s' could not open '%s'", BUILTIN_SYM_EXTERNAL_SORT, output);
+    }
+
+    if (!err)
+    {
+        bool ok = true;
+        if (runs.count)
+        {
+            ok = sort_merge(runs.files, runs.count, out, true);
+        }
+        else
+        {
+            qsort(recs, count, sizeof(sort_record), sort_compare);
+            for (size_t i = 0; i < count; i++)
+            {
+                ok = ok && fwrite(recs[i].line, 1, recs[i].len, out) == recs[i].len && fputc('\n', out) != EOF;
+            }
+        }
+
+        ok = (fclose(out) == 0) && ok;
+        err = ok ? 0 : lval_error("function '%s' could not read a temporary file or write the output",
+            BUILTIN_SYM_EXTERNAL_SORT);
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        sort_record_free(&recs[i]);
+    }
+
+    sort_close(runs.files, runs.count);
+    free(runs.files);
+    free(runs.levels);
+    free(recs);
+    lval_del(args);
+    return err ? err : lval_long(seq);
+}
+
+void lenv_add_builtins_sort(lenv *e)
+{
+    lenv_add_builtin(e, BUILTIN_SYM_EXTERNAL_SORT, builtin_external_sort);
+}
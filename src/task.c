@@ -0,0 +1,199 @@
+/*
+ * Step-sliced evaluation. A task evaluates an expression on its own stack and
+ * switches back to the host once it has used up its budget of evaluation steps,
+ * so the host can resume it later -- e.g. from an event loop.
+ */
+
+#ifndef __linux
+#define _XOPEN_SOURCE 600
+#define _DARWIN_C_SOURCE
+#endif
+
+#include <ucontext.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "lilith_int.h"
+#include "builtin_symbols.h"
+
+#define TASK_STACK_SIZE (8 * 1024 * 1024)
+
+struct lilith_task
+{
+    ucontext_t task_ctx;  // where the evaluation is running
+    ucontext_t host_ctx;  // where to return to when the budget runs out
+    char *stack;          // the stack the evaluation runs on, after a guard page
+    size_t stack_size;    // the size of the mapping, including the guard page
+    lenv *env;            // the environment to evaluate in
+    lval *input;          // the expression to evaluate
+    lval *result;         // the result, once finished
+    unsigned long budget; // evaluation steps left in this slice
+    bool started;         // the evaluation has been started
+    bool finished;        // the evaluation has completed
+    bool cancelled;       // the task is being freed before it finished
+};
+
+_Thread_local lilith_task *task_current;
+
+/**
+ * Entry point of the task's stack. Returning switches back to the host.
+ */
+static void task_main()
+{
+    lilith_task *task = task_current;
+    task->result = lilith_eval_expr(task->env, task->input);
+    task->input = 0;
+    task->finished = true;
+}
+
+lilith_task *lilith_task_new(lval *input)
+{
+    lilith_task *rv = calloc(1, sizeof(lilith_task));
+    rv->input = input;
+    return rv;
+}
+
+lval *lilith_eval_step(lenv *env, lilith_task *task, unsigned long max_steps)
+{
+    if (task->finished)
+    {
+        return 0;
+    }
+
+    if (!task->started)
+    {
+        // Stacks grow down, so overflowing in to the guard page faults rather than
+        // writing over whatever is below the stack
+        size_t page = sysconf(_SC_PAGESIZE);
+        task->stack_size = TASK_STACK_SIZE + page;
+        task->stack = mmap(0, task->stack_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (task->stack == MAP_FAILED || mprotect(task->stack, page, PROT_NONE))
+        {
+            if (task->stack != MAP_FAILED)
+            {
+                munmap(task->stack, task->stack_size);
+            }
+
+            task->stack = 0;
+            task->finished = true;
+            return lval_error("unable to allocate a stack for the task");
+        }
+
+        task->env = env;
+        getcontext(&task->task_ctx);
+        task->task_ctx.uc_stack.ss_sp = task->stack + page;
+        task->task_ctx.uc_stack.ss_size = TASK_STACK_SIZE;
+        task->task_ctx.uc_link = &task->host_ctx;
+        makecontext(&task->task_ctx, task_main, 0);
+        task->started = true;
+    }
+
+    lilith_task *prev = task_current;
+    task_current = task;
+    task->budget = max_steps ? max_steps : 1;
+    swapcontext(&task->host_ctx, &task->task_ctx);
+    task_current = prev;
+
+    if (task->finished)
+    {
+        lval *rv = task->result;
+        task->result = 0;
+        return rv;
+    }
+
+    return 0;
+}
+
+bool lilith_task_done(const lilith_task *task)
+{
+    return task->finished;
+}
+
+bool task_step()
+{
+    if (task_current->cancelled)
+    {
+        return false;
+    }
+
+    if (--task_current->budget == 0)
+    {
+        swapcontext(&task_current->task_ctx, &task_current->host_ctx);
+    }
+
+    return !task_current->cancelled;
+}
+
+void lilith_task_del(lilith_task *task)
+{
+    if (task->started && !task->finished)
+    {
+        // Every remaining step fails so the evaluation unwinds and frees what it holds
+        task->cancelled = true;
+        lval *rv = lilith_eval_step(task->env, task, 1);
+        lval_del(rv);
+    }
+
+    if (task->input)
+    {
+        lval_del(task->input);
+    }
+
+    if (task->stack)
+    {
+        munmap(task->stack, task->stack_size);
+    }
+
+    free(task);
+}
+
+/**
+ * Built-in function to evaluate an expression as a task, in slices of a number of
+ * steps, giving up after a number of slices. Returns the result and the number of
+ * slices taken.
+ */
+static lval *builtin_eval_steps(lenv *env, lval *args)
+{
+    LASSERT_ENV(args, env, BUILTIN_SYM_EVAL_STEPS);
+    LASSERT_NO_ERROR(args);
+    LASSERT(args, LVAL_EXPR_CNT(args) == 3, "function '%s' expects 3 arguments, received %d",
+        BUILTIN_SYM_EVAL_STEPS, LVAL_EXPR_CNT(args));
+    LASSERT(args, LVAL_EXPR_FIRST(args)->type == LVAL_QEXPRESSION,
+        "function '%s' type mismatch - expected %s, received %s",
+        BUILTIN_SYM_EVAL_STEPS, ltype_name(LVAL_QEXPRESSION), ltype_name(LVAL_EXPR_FIRST(args)->type));
+    LASSERT(args, lval_expr_item(args, 1)->type == LVAL_LONG && lval_expr_item(args, 1)->value.num_l > 0 &&
+        lval_expr_item(args, 2)->type == LVAL_LONG && lval_expr_item(args, 2)->value.num_l > 0,
+        "function '%s' expects positive numbers of steps and slices", BUILTIN_SYM_EVAL_STEPS);
+
+    unsigned long steps = lval_expr_item(args, 1)->value.num_l;
+    long limit = lval_expr_item(args, 2)->value.num_l;
+    lval *expr = lval_take(args, 0);
+    expr->type = LVAL_SEXPRESSION;
+
+    lilith_task *task = lilith_task_new(expr);
+    lval *rv = 0;
+    long slices = 0;
+    while (!lilith_task_done(task) && slices < limit)
+    {
+        rv = lilith_eval_step(env, task, steps);
+        slices++;
+    }
+
+    if (!lilith_task_done(task))
+    {
+        lilith_task_del(task);
+        return lval_error("function '%s' unfinished after %ld slices", BUILTIN_SYM_EVAL_STEPS, limit);
+    }
+
+    lilith_task_del(task);
+    if (rv->type == LVAL_ERROR)
+    {
+        return rv;
+    }
+
+    return lval_add(lval_add(lval_qexpression(), rv), lval_long(slices));
+}
+
+void lenv_add_builtins_task(lenv *e)
+{
+    lenv_add_builtin(e, BUILTIN_SYM_EVAL_STEPS, builtin_eval_steps);
+}
@@ -30,6 +30,9 @@ typedef enum
     CHAR_CLOSE_PAREN = 0x0080,
     CHAR_ENDINGS     = 0x00E0,
     CHAR_OTHER       = 0x0100,
+    CHAR_COMMA       = 0x0200,
+    CHAR_AT          = 0x0400,
+    CHAR_SYMBOL      = 0x0702, // letters and other characters that make a symbol
     CHAR_ANY         = 0xFFFF
 } CHAR_TYPE;
 
@@ -65,7 +68,8 @@ static graph_el state_machine[] =
     { TOK_NONE, CHAR_QUOTE, TOK_STRING_BEGIN },
     { TOK_NONE, CHAR_DOT, TOK_DOUBLE },
     { TOK_NONE, CHAR_ADD_SUB, TOK_ADD_SUB },
-    { TOK_NONE, CHAR_OTHER | CHAR_LETTER, TOK_SYMBOL },
+    { TOK_NONE, CHAR_COMMA, TOK_UNQUOTE },
+    { TOK_NONE, CHAR_SYMBOL, TOK_SYMBOL },
 
     { TOK_LIST_BEGIN, CHAR_ANY, TOK_END },
     { TOK_LIST_END, CHAR_ANY, TOK_END },
@@ -75,12 +79,17 @@ static graph_el state_machine[] =
     { TOK_ADD_SUB, CHAR_ENDINGS, TOK_END },
     { TOK_ADD_SUB, CHAR_ANY, TOK_SYMBOL },
 
-    { TOK_LONG, CHAR_LETTER | CHAR_ADD_SUB | CHAR_OTHER, TOK_SYMBOL },
+    // An unquote, , or ,@, is a token of its own so whatever follows is read as usual
+    { TOK_UNQUOTE, CHAR_AT, TOK_SPLICE },
+    { TOK_UNQUOTE, CHAR_ANY, TOK_END },
+    { TOK_SPLICE, CHAR_ANY, TOK_END },
+
+    { TOK_LONG, CHAR_SYMBOL | CHAR_ADD_SUB, TOK_SYMBOL },
     { TOK_LONG, CHAR_DOT, TOK_DOUBLE },
     { TOK_LONG, CHAR_QUOTE, TOK_ERROR },
     { TOK_LONG, CHAR_ENDINGS, TOK_END },
 
-    { TOK_DOUBLE, CHAR_LETTER | CHAR_ADD_SUB | CHAR_OTHER, TOK_SYMBOL },
+    { TOK_DOUBLE, CHAR_SYMBOL | CHAR_ADD_SUB, TOK_SYMBOL },
     { TOK_DOUBLE, CHAR_QUOTE, TOK_ERROR },
     { TOK_DOUBLE, CHAR_ENDINGS, TOK_END },
 
@@ -94,7 +103,7 @@ static graph_el state_machine[] =
 /**
  * Nunber of lines in the state machine graph.
  */
-static const size_t state_machine_rows = 23;
+static const size_t state_machine_rows = 27;
 
 /**
  * Classifies a character.
@@ -121,6 +130,10 @@ static CHAR_TYPE get_char_type(char c)
     {
     case '"':
         return CHAR_QUOTE;
+    case ',':
+        return CHAR_COMMA;
+    case '@':
+        return CHAR_AT;
     case '.':
         return CHAR_DOT;
     case '-':
@@ -138,14 +151,17 @@ static CHAR_TYPE get_char_type(char c)
 }
 
 /**
- * Make sure the buffer is big enough to contain the token. Realloc it if not.
+ * Make sure the buffer is big enough to contain the token. Realloc it if not,
+ * moving the write position to the new buffer.
  */
-static void check_next_buff(tokeniser *tok, const char *ptr)
+static void check_next_buff(tokeniser *tok, char **ptr)
 {
-    if (ptr - tok->next >= (long)tok->next_size)
+    if (*ptr - tok->next >= (long)tok->next_size)
     {
+        size_t used = *ptr - tok->next;
         tok->next = realloc(tok->next, tok->next_size * 2);
         tok->next_size *= 2;
+        *ptr = tok->next + used;
     }
 }
 
@@ -292,7 +308,7 @@ bool get_next_token(tokeniser *tok, token *token)
     {
         current_type = best_type;
         copy_char(&ptr, tok, current_type);
-        check_next_buff(tok, ptr);
+        check_next_buff(tok, &ptr);
         increment_head(tok);
     }
 
@@ -333,6 +349,8 @@ static const char *token_type_names[] =
     "SYMBOL",
     "ERROR",
     "ADD_SUB",
+    "UNQUOTE",
+    "SPLICE",
     "END"
 };
 
@@ -19,6 +19,8 @@ typedef enum
     TOK_SYMBOL,
     TOK_ERROR,
     TOK_ADD_SUB,
+    TOK_UNQUOTE,
+    TOK_SPLICE,
     TOK_END
 } TOKEN_TYPE;
 
@@ -11,15 +11,15 @@
 /**
  * Read contents of file in to a string.
  */
-static char *load_file(const char *filename, struct stat *fn)
+char *load_file(const char *filename, struct stat *fn)
 {
-    char *contents = malloc(fn->st_size + 1);
     FILE *file = fopen(filename, "r");
     if (!file)
     {
         return 0;
     }
 
+    char *contents = malloc(fn->st_size + 1);
     fread(contents, 1, fn->st_size, file);
     *(contents + fn->st_size) = 0;
     fclose(file);
@@ -30,20 +30,20 @@ static char *load_file(const char *filename, struct stat *fn)
  * Search the local directory and the LILITH_PATH for the given file name.
  * 
  * @param filename the filename to search for
- * @returns        the contents of the file
+ * @param fn       populated with the file's details if found
+ * @returns        the path to the file, or 0 if not found
  */
-char *lookup_load_file(const char *filename)
+char *lookup_load_path(const char *filename, struct stat *fn)
 {
-    struct stat fn;
-    if (stat(filename, &fn) == 0)
+    if (stat(filename, fn) == 0)
     {
-        return load_file(filename, &fn);
+        return strdup(filename);
     }
 
     const char *lp = getenv("LILITH_PATH");
     if (lp)
     {
-        char buf[strlen(lp + 1)];
+        char buf[strlen(lp) + 1];
         char *next = buf;
         strcpy(buf, lp);
 
@@ -58,15 +58,15 @@ char *lookup_load_file(const char *filename)
             }
 
             sprintf(check, "%s/%s", next, filename);
-            if (stat(check, &fn) == 0)
+            if (stat(check, fn) == 0)
             {
-                char *contents = load_file(check, &fn);
-                free(check);
-                return contents;
+                return check;
             }
 
             next = end + 1;
         } while (end);
+
+        free(check);
     }
 
     return 0;
@@ -0,0 +1,242 @@
+/*
+ * Watch mode. A file is evaluated, then evaluated again each time it is saved --
+ * but only the top-level expressions that are new or have changed since the last
+ * time, identified by a hash of their structure. Everything else already defined
+ * in the environment is left alone.
+ */
+
+#include <libgen.h>
+#include <limits.h>
+#include <unistd.h>
+
+#ifdef __linux
+#include <sys/inotify.h>
+#endif
+
+#include "lilith_int.h"
+
+#define WATCH_POLL_USEC 200000
+
+char *load_file(const char *filename, struct stat *fn);
+
+/**
+ * The top-level expressions of the watched file that evaluated successfully, by hash.
+ */
+typedef struct
+{
+    uint64_t *hashes; // sorted
+    bool *used;       // matched by an expression in the current version of the file
+    size_t count;
+} watch_state;
+
+static int compare_hash(const void *x, const void *y)
+{
+    uint64_t a = *(const uint64_t*)x;
+    uint64_t b = *(const uint64_t*)y;
+    return a < b ? -1 : a > b;
+}
+
+/**
+ * Finds an unmatched expression with the given hash from the last version of the
+ * file and marks it as matched. The same expression can appear more than once.
+ */
+static bool watch_match(watch_state *state, uint64_t hash)
+{
+    size_t lo = 0, hi = state->count;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (state->hashes[mid] < hash)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+
+    for (; lo < state->count && state->hashes[lo] == hash; lo++)
+    {
+        if (!state->used[lo])
+        {
+            state->used[lo] = true;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void watch_error(lenv *env, lval *err)
+{
+    // Keep diagnostics in order with the output preceding them
+    lout *out = lenv_err(env);
+    lout_flush(lenv_out(env));
+    lval_print(out, err, 0);
+    lout_putc(out, '\n');
+    lout_flush(out);
+}
+
+/**
+ * Reads the file and evaluates the expressions not seen in the last version of it.
+ * Expressions that fail are evaluated again on the next change.
+ */
+static void watch_eval(lenv *env, const char *filename, watch_state *state)
+{
+    struct stat fn;
+    char *contents = stat(filename, &fn) == 0 ? load_file(filename, &fn) : 0;
+    if (!contents)
+    {
+        // Mid-save; the next event picks up the new file
+        return;
+    }
+
+    lval *expr = lilith_read_from_string(contents);
+    free(contents);
+    if (expr->type == LVAL_ERROR)
+    {
+        watch_error(env, expr);
+        lval_del(expr);
+        return;
+    }
+
+    size_t total = LVAL_EXPR_CNT(expr), count = 0, evaluated = 0;
+    uint64_t *hashes = malloc(sizeof(uint64_t) * (total + 1));
+    for (size_t i = 0; i < state->count; i++)
+    {
+        state->used[i] = false;
+    }
+
+    while (LVAL_EXPR_CNT(expr))
+    {
+        lval *x = lval_pop(expr);
+        uint64_t hash = lval_hash(x, LILITH_HASH_SEED);
+        if (watch_match(state, hash))
+        {
+            hashes[count++] = hash;
+            lval_del(x);
+            continue;
+        }
+
+        evaluated++;
+        x = lilith_eval_expr(env, x);
+        if (x->type == LVAL_ERROR)
+        {
+            watch_error(env, x);
+        }
+        else
+        {
+            hashes[count++] = hash;
+        }
+
+        lval_del(x);
+    }
+
+    lval_del(expr);
+    qsort(hashes, count, sizeof(uint64_t), compare_hash);
+    free(state->hashes);
+    free(state->used);
+    state->hashes = hashes;
+    state->used = calloc(count + 1, sizeof(bool));
+    state->count = count;
+
+    lout_printf(lenv_err(env), "; %s: evaluated %zu of %zu expressions\n", filename, evaluated, total);
+    lilith_flush(env);
+}
+
+#ifdef __linux
+
+/**
+ * Blocks until the file is written. Watches the directory rather than the file so
+ * saves that replace the file, as most editors do, are seen.
+ */
+static bool watch_wait(int fd, const char *name)
+{
+    char buf[sizeof(struct inotify_event) + NAME_MAX + 1] __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool changed = false;
+    while (!changed)
+    {
+        ssize_t len = read(fd, buf, sizeof(buf));
+        if (len <= 0)
+        {
+            return false;
+        }
+
+        for (char *ptr = buf; ptr < buf + len; )
+        {
+            struct inotify_event *event = (struct inotify_event*)ptr;
+            changed |= event->len && strcmp(event->name, name) == 0;
+            ptr += sizeof(struct inotify_event) + event->len;
+        }
+    }
+
+    return true;
+}
+
+lval *lilith_watch(lenv *env, const char *filename)
+{
+    struct stat fn;
+    if (stat(filename, &fn) != 0)
+    {
+        return lval_error("File not found %s", filename);
+    }
+
+    char *dir_copy = strdup(filename);
+    char *name_copy = strdup(filename);
+    int fd = inotify_init();
+    if (fd < 0 || inotify_add_watch(fd, dirname(dir_copy), IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+
+        free(dir_copy);
+        free(name_copy);
+        return lval_error("unable to watch %s", filename);
+    }
+
+    watch_state state = { 0 };
+    const char *name = basename(name_copy);
+    do
+    {
+        watch_eval(env, filename, &state);
+    } while (watch_wait(fd, name));
+
+    close(fd);
+    free(state.hashes);
+    free(state.used);
+    free(dir_copy);
+    free(name_copy);
+    return lval_error("unable to watch %s", filename);
+}
+
+#else
+
+lval *lilith_watch(lenv *env, const char *filename)
+{
+    // No portable change notification -- poll the modification time
+    struct stat last = { 0 }, fn;
+    if (stat(filename, &fn) != 0)
+    {
+        return lval_error("File not found %s", filename);
+    }
+
+    watch_state state = { 0 };
+    for (;;)
+    {
+        if (stat(filename, &fn) == 0 &&
+            (fn.st_mtime != last.st_mtime || fn.st_size != last.st_size || fn.st_ino != last.st_ino))
+        {
+            last = fn;
+            watch_eval(env, filename, &state);
+        }
+
+        usleep(WATCH_POLL_USEC);
+    }
+
+    return 0;
+}
+
+#endif